@@ -0,0 +1,34 @@
+#!/bin/sh
+# Compare sequential 1 MiB-block throughput of my_passthrough's copy path
+# (--copy-io), its read_buf/write_buf path with and without splice, and
+# the native tmpfs it is mirroring.
+#
+# usage: bench/compare_io.sh [path to my_passthrough] [size in MiB]
+
+set -e
+
+FS=${1:-./my_passthrough}
+SIZE=${2:-1024}
+HERE=$(dirname "$0")
+SEQIO=$(mktemp /tmp/seqio.XXXXXX)
+BACKING=$(mktemp -d /dev/shm/myfs-bench.XXXXXX)
+MNT=$(mktemp -d /tmp/myfs-mnt.XXXXXX)
+
+cleanup() {
+	fusermount3 -u "$MNT" 2>/dev/null || true
+	rm -rf "$BACKING" "$MNT" "$SEQIO"
+}
+trap cleanup EXIT
+
+gcc -Wall -O2 "$HERE/seqio.c" -o "$SEQIO"
+
+echo "native:"
+"$SEQIO" "$BACKING/file" "$SIZE" 1024
+
+for mode in --copy-io --no-splice ""; do
+	echo "my_passthrough ${mode:-(splice)}:"
+	"$FS" $mode "$MNT"
+	# my_passthrough mirrors /, so the backing file shows up under $MNT$BACKING
+	"$SEQIO" "$MNT$BACKING/file" "$SIZE" 1024
+	fusermount3 -u "$MNT"
+done
@@ -0,0 +1,56 @@
+#!/bin/sh
+# Print fsbench results side by side with a baseline.
+#
+#   bench/compare_results.sh RESULTS.jsonl
+#       every filesystem against the "native" results of the same file
+#   bench/compare_results.sh BASE.jsonl NEW.jsonl
+#       NEW against BASE, matched by filesystem, test, block size and
+#       threads, e.g. to look for regressions between two commits
+#
+# The ratio is of the throughput (IOPS); above 1 is faster than the baseline.
+
+if [ $# -lt 1 ] || [ $# -gt 2 ]; then
+	echo "usage: $0 RESULTS.jsonl | BASE.jsonl NEW.jsonl" >&2
+	exit 1
+fi
+
+awk -v two=$(($# == 2)) '
+function field(line, name,    m) {
+	if (match(line, "\"" name "\":\"?[^,\"}]*")) {
+		m = substr(line, RSTART + length(name) + 3, RLENGTH - length(name) - 3)
+		sub(/^"/, "", m)
+		return m
+	}
+	return ""
+}
+{
+	label = field($0, "label")
+	if (label == "env")
+		next
+	test = field($0, "test"); bs = field($0, "bs"); threads = field($0, "threads")
+	key = test " " bs " " threads
+	if (two && FILENAME == ARGV[1]) {
+		base[label " " key] = field($0, "iops"); basep99[label " " key] = field($0, "p99_us")
+		next
+	}
+	if (!two && label == "native") {
+		base[key] = field($0, "iops"); basep99[key] = field($0, "p99_us")
+	}
+	n++
+	lines[n] = $0; keys[n] = two ? label " " key : key
+}
+END {
+	printf "%-18s %-10s %8s %3s %12s %10s %10s %8s\n", "fs", "test", "bs", "thr", "iops", "p99_us", "base_iops", "ratio"
+	for (i = 1; i <= n; i++) {
+		l = lines[i]
+		if (field(l, "error") != "") {
+			printf "%-18s %-10s %8s %3s  failed: %s\n", field(l, "label"), field(l, "test"), field(l, "bs"),
+				field(l, "threads"), field(l, "error")
+			continue
+		}
+		b = base[keys[i]]
+		printf "%-18s %-10s %8s %3s %12.0f %10.2f %10s %8s\n", field(l, "label"), field(l, "test"), field(l, "bs"),
+			field(l, "threads"), field(l, "iops"), field(l, "p99_us"), b == "" ? "-" : sprintf("%.0f", b),
+			b == "" || b == 0 ? "-" : sprintf("%.3f", field(l, "iops") / b)
+	}
+}' "$@"
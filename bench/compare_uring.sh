@@ -0,0 +1,40 @@
+#!/bin/sh
+# Compare my_passthrough_ll's blocking engine (--io=sync) with its
+# io_uring engine (--io=uring) on random 4 KiB O_DIRECT reads and writes
+# at queue depths 1 to 128. Both mounts get the same, small number of
+# worker threads (-o max_threads), which is what bounds the blocking engine.
+#
+# The backing directory has to support O_DIRECT, tmpfs before Linux 6.6
+# does not.
+#
+# usage: bench/compare_uring.sh [path to my_passthrough_ll] [backing dir] [seconds per run]
+#        MAX_THREADS=N to change the worker thread limit (default 4)
+
+set -e
+
+FS=${1:-./my_passthrough_ll}
+BACKING=$(mktemp -d "${2:-/var/tmp}/myfs-bench.XXXXXX")
+SECONDS_PER_RUN=${3:-5}
+MAX_THREADS=${MAX_THREADS:-4}
+HERE=$(dirname "$0")
+QDIO=$(mktemp /tmp/qdio.XXXXXX)
+MNT=$(mktemp -d /tmp/myfs-mnt.XXXXXX)
+
+cleanup() {
+	fusermount3 -u "$MNT" 2>/dev/null || true
+	rm -rf "$BACKING" "$MNT" "$QDIO"
+}
+trap cleanup EXIT
+
+gcc -Wall -O2 -pthread "$HERE/qdio.c" -o "$QDIO"
+
+for io in sync uring; do
+	echo "my_passthrough_ll --io=$io (max_threads=$MAX_THREADS):"
+	"$FS" --io=$io --source="$BACKING" -o max_threads="$MAX_THREADS" "$MNT"
+	for mode in r w; do
+		for depth in 1 2 4 8 16 32 64 128; do
+			"$QDIO" "$MNT/file" $depth "$SECONDS_PER_RUN" $mode
+		done
+	done
+	fusermount3 -u "$MNT"
+done
@@ -0,0 +1,543 @@
+/*
+   Filesystem benchmark matrix
+
+   Runs a fixed set of workloads in <dir> and prints one JSON object per
+   result on stdout (JSON Lines), and a readable table on stderr:
+
+     seq_write, seq_read     one file, block sizes 4 KiB, 64 KiB, 1 MiB
+     rand_read, rand_write   4 KiB and 64 KiB at random aligned offsets,
+                             1 thread, and 4 KiB with 4 and 16 threads
+     create, stat, unlink    --files empty files, 1 and 4 threads
+     readdir                 full listings of a directory with --files entries
+     untar                   small files of 512 B - 64 KiB in directories of
+                             100, with the calls tar makes per file
+
+   Every result has the operation count, bytes, elapsed time, MiB/s, IOPS
+   and the p50/p99 latency of one operation. Offsets and file sizes come
+   from fixed seeds and the amount of work is fixed, not the duration, so
+   two runs of the same build do the same calls. Reads drop the file's
+   cached pages first so they reach the filesystem.
+
+   Compile with
+
+   gcc -Wall -O2 -pthread bench/fsbench.c -o fsbench
+   ./fsbench [--label=NAME] [--size=MiB] [--files=N] <dir>
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define RAND_OPS 65536 //random I/O operations per result, split over the threads
+
+static const char *label = "fs";
+static const char *dir;
+static size_t file_size = 256 << 20;
+static long nfiles = 10000;
+
+struct lat {
+	uint64_t *ns;
+	size_t n, cap;
+};
+
+struct result {
+	const char *test;
+	size_t bs;
+	int threads;
+	uint64_t ops;
+	uint64_t bytes;
+	double secs;
+	struct lat lat;
+	int err; //errno of the first failure, 0 if the test ran through
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void lat_add(struct lat *l, uint64_t ns)
+{
+	if (l->n == l->cap) {
+		size_t cap = l->cap ? l->cap * 2 : 4096;
+		uint64_t *p = realloc(l->ns, cap * sizeof(*p));
+		if (p == NULL)
+			return;
+		l->ns = p;
+		l->cap = cap;
+	}
+	l->ns[l->n++] = ns;
+}
+
+static void lat_merge(struct lat *into, struct lat *from)
+{
+	for (size_t i = 0; i < from->n; i++)
+		lat_add(into, from->ns[i]);
+	free(from->ns);
+	memset(from, 0, sizeof(*from));
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static double lat_quantile_us(struct lat *l, double q)
+{
+	if (l->n == 0)
+		return 0;
+	return l->ns[(size_t) (q * (l->n - 1))] / 1e3;
+}
+
+static void report(struct result *r)
+{
+	double p50, p99;
+
+	qsort(r->lat.ns, r->lat.n, sizeof(uint64_t), cmp_u64);
+	p50 = lat_quantile_us(&r->lat, 0.50);
+	p99 = lat_quantile_us(&r->lat, 0.99);
+	if (r->err) {
+		printf("{\"label\":\"%s\",\"test\":\"%s\",\"bs\":%zu,\"threads\":%d,\"error\":\"%s\"}\n",
+		       label, r->test, r->bs, r->threads, strerror(r->err));
+		fprintf(stderr, "%-12s %-10s %8zu %3d  failed: %s\n", label, r->test, r->bs, r->threads,
+			strerror(r->err));
+	} else {
+		printf("{\"label\":\"%s\",\"test\":\"%s\",\"bs\":%zu,\"threads\":%d,\"ops\":%llu,\"bytes\":%llu,"
+		       "\"secs\":%.6f,\"mib_s\":%.2f,\"iops\":%.1f,\"p50_us\":%.2f,\"p99_us\":%.2f}\n",
+		       label, r->test, r->bs, r->threads, (unsigned long long) r->ops, (unsigned long long) r->bytes,
+		       r->secs, r->bytes / 1048576.0 / r->secs, r->ops / r->secs, p50, p99);
+		fprintf(stderr, "%-12s %-10s %8zu %3d %10.1f MiB/s %10.0f IOPS  p50 %9.2f us  p99 %9.2f us\n",
+			label, r->test, r->bs, r->threads, r->bytes / 1048576.0 / r->secs, r->ops / r->secs, p50, p99);
+	}
+	fflush(stdout);
+	free(r->lat.ns);
+}
+
+static void path_of(char *buf, size_t size, const char *name)
+{
+	snprintf(buf, size, "%s/%s", dir, name);
+}
+
+/* time one call, fail the result on error */
+#define TIMED(r, call) ({                                 \
+		uint64_t t0_ = now_ns();                  \
+		long res_ = (long) (call);                \
+		lat_add(&(r)->lat, now_ns() - t0_);       \
+		if (res_ < 0 && (r)->err == 0)            \
+			(r)->err = errno;                 \
+		res_;                                     \
+	})
+
+static void seq_write(size_t bs)
+{
+	struct result r = { "seq_write", bs, 1 };
+	char path[4096];
+	char *buf;
+	uint64_t t;
+	int fd;
+
+	path_of(path, sizeof(path), "seq");
+	if (posix_memalign((void **) &buf, 4096, bs) != 0)
+		return;
+	memset(buf, 0xa5, bs);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		r.err = errno;
+		goto out;
+	}
+	t = now_ns();
+	for (size_t done = 0; done < file_size && r.err == 0; done += bs) {
+		if (TIMED(&r, write(fd, buf, bs)) == (long) bs) {
+			r.ops++;
+			r.bytes += bs;
+		}
+	}
+	fsync(fd); //part of the time: data has to reach the filesystem
+	r.secs = (now_ns() - t) / 1e9;
+	close(fd);
+out:
+	report(&r);
+	free(buf);
+}
+
+static void seq_read(size_t bs)
+{
+	struct result r = { "seq_read", bs, 1 };
+	char path[4096];
+	char *buf;
+	uint64_t t;
+	int fd;
+
+	path_of(path, sizeof(path), "seq");
+	if (posix_memalign((void **) &buf, 4096, bs) != 0)
+		return;
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		r.err = errno;
+		goto out;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	t = now_ns();
+	for (;;) {
+		long n = TIMED(&r, read(fd, buf, bs));
+		if (n <= 0)
+			break;
+		r.ops++;
+		r.bytes += n;
+	}
+	r.secs = (now_ns() - t) / 1e9;
+	close(fd);
+out:
+	report(&r);
+	free(buf);
+}
+
+struct rand_arg {
+	struct result *r;
+	int writing;
+	int id;
+	uint64_t ops;
+	uint64_t bytes;
+	struct lat lat;
+	int err;
+};
+
+static void *rand_thread(void *arg)
+{
+	struct rand_arg *a = arg;
+	struct result *r = a->r;
+	unsigned int seed = 42 + a->id;
+	size_t nblocks = file_size / r->bs;
+	uint64_t nops = RAND_OPS / r->threads;
+	char path[4096];
+	char *buf;
+	int fd;
+
+	path_of(path, sizeof(path), "rand");
+	if (posix_memalign((void **) &buf, 4096, r->bs) != 0)
+		return NULL;
+	memset(buf, 0x5a, r->bs);
+	fd = open(path, a->writing ? O_WRONLY : O_RDONLY);
+	if (fd == -1) {
+		a->err = errno;
+		free(buf);
+		return NULL;
+	}
+	for (uint64_t i = 0; i < nops; i++) {
+		off_t off = (off_t) (rand_r(&seed) % nblocks) * r->bs;
+		uint64_t t0 = now_ns();
+		ssize_t n = a->writing ? pwrite(fd, buf, r->bs, off) : pread(fd, buf, r->bs, off);
+		lat_add(&a->lat, now_ns() - t0);
+		if (n < 0) {
+			a->err = errno;
+			break;
+		}
+		a->ops++;
+		a->bytes += n;
+	}
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+/* lay out the file random I/O works on once, so reads do not hit holes */
+static int rand_prepare(void)
+{
+	char path[4096];
+	struct stat st;
+	char *block;
+	int fd, err = 0;
+
+	path_of(path, sizeof(path), "rand");
+	if (stat(path, &st) == 0 && (size_t) st.st_size >= file_size)
+		return 0;
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return errno;
+	block = calloc(1, 1 << 20);
+	for (size_t done = 0; block != NULL && done < file_size; done += 1 << 20) {
+		if (write(fd, block, 1 << 20) != 1 << 20) {
+			err = errno ? errno : EIO;
+			break;
+		}
+	}
+	free(block);
+	fsync(fd);
+	close(fd);
+	return err;
+}
+
+static void rand_io(const char *test, int writing, size_t bs, int threads)
+{
+	struct result r = { test, bs, threads };
+	struct rand_arg *args = calloc(threads, sizeof(*args));
+	pthread_t *tids = calloc(threads, sizeof(*tids));
+	char path[4096];
+	uint64_t t;
+
+	if (args == NULL || tids == NULL)
+		return;
+	if ((r.err = rand_prepare()) != 0)
+		goto out;
+	if (!writing) {
+		int fd;
+		path_of(path, sizeof(path), "rand");
+		if ((fd = open(path, O_RDONLY)) != -1) {
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+			close(fd);
+		}
+	}
+	t = now_ns();
+	for (int i = 0; i < threads; i++) {
+		args[i] = (struct rand_arg) { .r = &r, .writing = writing, .id = i };
+		pthread_create(&tids[i], NULL, rand_thread, &args[i]);
+	}
+	for (int i = 0; i < threads; i++) {
+		pthread_join(tids[i], NULL);
+		r.ops += args[i].ops;
+		r.bytes += args[i].bytes;
+		if (r.err == 0)
+			r.err = args[i].err;
+		lat_merge(&r.lat, &args[i].lat);
+	}
+	r.secs = (now_ns() - t) / 1e9;
+out:
+	report(&r);
+	free(args);
+	free(tids);
+}
+
+/* create, stat and unlink nfiles files, each thread in its own directory */
+struct meta_arg {
+	int id;
+	int phase; //0 create, 1 stat, 2 unlink
+	long count;
+	struct lat lat;
+	int err;
+};
+
+static void *meta_thread(void *arg)
+{
+	struct meta_arg *a = arg;
+	char path[4096];
+	struct stat st;
+
+	for (long i = 0; i < a->count; i++) {
+		uint64_t t0;
+		int res;
+
+		snprintf(path, sizeof(path), "%s/meta%d/f%ld", dir, a->id, i);
+		t0 = now_ns();
+		if (a->phase == 0) {
+			res = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+			if (res >= 0)
+				res = close(res);
+		} else if (a->phase == 1)
+			res = stat(path, &st);
+		else
+			res = unlink(path);
+		lat_add(&a->lat, now_ns() - t0);
+		if (res < 0) {
+			a->err = errno;
+			break;
+		}
+	}
+	return NULL;
+}
+
+static void meta(int threads)
+{
+	static const char *const names[] = { "create", "stat", "unlink" };
+	struct meta_arg *args = calloc(threads, sizeof(*args));
+	pthread_t *tids = calloc(threads, sizeof(*tids));
+	char path[4096];
+
+	if (args == NULL || tids == NULL)
+		return;
+	for (int i = 0; i < threads; i++) {
+		snprintf(path, sizeof(path), "%s/meta%d", dir, i);
+		mkdir(path, 0755);
+	}
+	for (int phase = 0; phase < 3; phase++) {
+		struct result r = { names[phase], 0, threads };
+		uint64_t t = now_ns();
+
+		for (int i = 0; i < threads; i++) {
+			args[i] = (struct meta_arg) { .id = i, .phase = phase, .count = nfiles / threads };
+			pthread_create(&tids[i], NULL, meta_thread, &args[i]);
+		}
+		for (int i = 0; i < threads; i++) {
+			pthread_join(tids[i], NULL);
+			r.ops += args[i].lat.n;
+			if (r.err == 0)
+				r.err = args[i].err;
+			lat_merge(&r.lat, &args[i].lat);
+		}
+		r.secs = (now_ns() - t) / 1e9;
+		report(&r);
+	}
+	for (int i = 0; i < threads; i++) {
+		snprintf(path, sizeof(path), "%s/meta%d", dir, i);
+		rmdir(path);
+	}
+	free(args);
+	free(tids);
+}
+
+/* ops are directory entries, the latency is that of one full listing */
+static void readdir_big(void)
+{
+	struct result r = { "readdir", 0, 1 };
+	char path[4096];
+	uint64_t t;
+	long made;
+
+	snprintf(path, sizeof(path), "%s/big", dir);
+	mkdir(path, 0755);
+	for (made = 0; made < nfiles; made++) {
+		int fd;
+		snprintf(path, sizeof(path), "%s/big/entry-with-a-longer-name-%ld", dir, made);
+		if ((fd = open(path, O_WRONLY | O_CREAT, 0644)) == -1) {
+			r.err = errno;
+			break;
+		}
+		close(fd);
+	}
+	snprintf(path, sizeof(path), "%s/big", dir);
+	t = now_ns();
+	for (int pass = 0; pass < 10 && r.err == 0; pass++) {
+		uint64_t t0 = now_ns();
+		DIR *dp = opendir(path);
+		if (dp == NULL) {
+			r.err = errno;
+			break;
+		}
+		while (readdir(dp) != NULL)
+			r.ops++;
+		closedir(dp);
+		lat_add(&r.lat, now_ns() - t0);
+	}
+	r.secs = (now_ns() - t) / 1e9;
+	report(&r);
+	for (long i = 0; i < made; i++) {
+		snprintf(path, sizeof(path), "%s/big/entry-with-a-longer-name-%ld", dir, i);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/big", dir);
+	rmdir(path);
+}
+
+/* what tar -x does for every member: create, write, chmod, set times, close */
+static void untar(void)
+{
+	struct result r = { "untar", 0, 1 };
+	static char data[64 * 1024];
+	unsigned int seed = 7;
+	struct timespec times[2] = { { 1000000000, 0 }, { 1000000000, 0 } };
+	char path[4096];
+	uint64_t t;
+	long made;
+
+	memset(data, 'x', sizeof(data));
+	snprintf(path, sizeof(path), "%s/tree", dir);
+	mkdir(path, 0755);
+	t = now_ns();
+	for (made = 0; made < nfiles && r.err == 0; made++) {
+		size_t size = 512 + rand_r(&seed) % (sizeof(data) - 512);
+		uint64_t t0 = now_ns();
+		int fd;
+
+		if (made % 100 == 0) {
+			snprintf(path, sizeof(path), "%s/tree/d%ld", dir, made / 100);
+			if (mkdir(path, 0755) == -1)
+				r.err = errno;
+		}
+		snprintf(path, sizeof(path), "%s/tree/d%ld/f%ld", dir, made / 100, made);
+		fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd == -1) {
+			r.err = errno;
+			break;
+		}
+		if (write(fd, data, size) != (ssize_t) size)
+			r.err = errno ? errno : EIO;
+		/* not every filesystem under test implements these, tar only warns either */
+		(void) fchmod(fd, 0640);
+		(void) futimens(fd, times);
+		close(fd);
+		lat_add(&r.lat, now_ns() - t0);
+		r.ops++;
+		r.bytes += size;
+	}
+	r.secs = (now_ns() - t) / 1e9;
+	report(&r);
+	for (long i = 0; i < made; i++) {
+		snprintf(path, sizeof(path), "%s/tree/d%ld/f%ld", dir, i / 100, i);
+		unlink(path);
+	}
+	for (long d = 0; d <= made / 100; d++) {
+		snprintf(path, sizeof(path), "%s/tree/d%ld", dir, d);
+		rmdir(path);
+	}
+	snprintf(path, sizeof(path), "%s/tree", dir);
+	rmdir(path);
+}
+
+int main(int argc, char *argv[])
+{
+	static const size_t seq_bs[] = { 4096, 65536, 1 << 20 };
+	char path[4096];
+	int i;
+
+	for (i = 1; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+		if (strncmp(argv[i], "--label=", 8) == 0)
+			label = argv[i] + 8;
+		else if (strncmp(argv[i], "--size=", 7) == 0)
+			file_size = (size_t) atol(argv[i] + 7) << 20;
+		else if (strncmp(argv[i], "--files=", 8) == 0)
+			nfiles = atol(argv[i] + 8);
+		else
+			break;
+	}
+	if (i != argc - 1 || file_size < (1 << 20) || nfiles < 1) {
+		fprintf(stderr, "usage: %s [--label=NAME] [--size=MiB] [--files=N] <dir>\n", argv[0]);
+		return 1;
+	}
+	dir = argv[i];
+
+	for (size_t b = 0; b < sizeof(seq_bs) / sizeof(seq_bs[0]); b++) {
+		seq_write(seq_bs[b]);
+		seq_read(seq_bs[b]);
+	}
+	path_of(path, sizeof(path), "seq");
+	unlink(path);
+
+	rand_io("rand_read", 0, 4096, 1);
+	rand_io("rand_write", 1, 4096, 1);
+	rand_io("rand_read", 0, 65536, 1);
+	rand_io("rand_write", 1, 65536, 1);
+	/* parallel clients */
+	rand_io("rand_read", 0, 4096, 4);
+	rand_io("rand_read", 0, 4096, 16);
+	rand_io("rand_write", 1, 4096, 4);
+	path_of(path, sizeof(path), "rand");
+	unlink(path);
+
+	meta(1);
+	meta(4);
+	readdir_big();
+	untar();
+	return 0;
+}
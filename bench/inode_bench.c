@@ -0,0 +1,149 @@
+/*
+   Microbenchmark for the myfs inode table
+
+   Creates N files (1M by default) spread over D directories and then
+   stats them in random order through path_lookup(), the same path
+   do_getattr() takes. Per-operation latency should stay flat as N grows.
+   With T threads each phase is split over T threads that take the same
+   locks and epochs as myfs.c, so creates into different directories and
+   all stats should scale with T.
+
+   Compile with
+
+   gcc -Wall -Wno-unused-function -O2 -pthread bench/inode_bench.c -o inode_bench
+   ./inode_bench [files] [dirs] [threads]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../myfs_inode.h"
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_path(char *buf, size_t size, long i, long ndirs)
+{
+	if (ndirs > 1)
+		snprintf(buf, size, "/d%ld/f%ld", i % ndirs, i);
+	else
+		snprintf(buf, size, "/f%ld", i);
+}
+
+static long nfiles, ndirs, nthreads;
+static long *order;
+
+/* thread t creates files t, t + T, ..., so each directory sees all threads */
+static void *create_files(void *arg)
+{
+	char path[64];
+
+	for (long i = (long) arg; i < nfiles; i += nthreads) {
+		const char *name;
+		size_t len;
+		make_path(path, sizeof(path), i, ndirs);
+		epoch_enter();
+		struct myfs_inode *parent = path_parent(path, &name, &len);
+		int res = -1;
+		if (parent != NULL) {
+			dir_lock(parent);
+			res = dir_add(parent, name, len, inode_new(S_IFREG | 0644));
+			dir_unlock(parent);
+		}
+		epoch_exit();
+		if (res != 0) {
+			fprintf(stderr, "create %s failed\n", path);
+			exit(1);
+		}
+	}
+	return NULL;
+}
+
+static void *stat_files(void *arg)
+{
+	char path[64];
+	struct stat st;
+
+	for (long i = (long) arg; i < nfiles; i += nthreads) {
+		make_path(path, sizeof(path), order[i], ndirs);
+		epoch_enter();
+		struct myfs_inode *inode = path_lookup(path);
+		if (inode != NULL)
+			inode_stat(inode, &st);
+		epoch_exit();
+		if (inode == NULL) {
+			fprintf(stderr, "stat %s failed\n", path);
+			exit(1);
+		}
+	}
+	return NULL;
+}
+
+/* run fn on nthreads threads, return the wall time */
+static double run(void *(*fn)(void *))
+{
+	pthread_t tid[nthreads];
+	double t = now();
+
+	for (long i = 0; i < nthreads; i++)
+		pthread_create(&tid[i], NULL, fn, (void *) i);
+	for (long i = 0; i < nthreads; i++)
+		pthread_join(tid[i], NULL);
+	return now() - t;
+}
+
+int main(int argc, char *argv[])
+{
+	double t;
+
+	nfiles = argc > 1 ? atol(argv[1]) : 1000000;
+	ndirs = argc > 2 ? atol(argv[2]) : 1;
+	nthreads = argc > 3 ? atol(argv[3]) : 1;
+	if (nthreads < 1)
+		nthreads = 1;
+
+	if (myfs_table_init(SIZE_MAX) != 0)
+		return 1;
+
+	for (long d = 0; ndirs > 1 && d < ndirs; d++) {
+		char name[32];
+		int len = snprintf(name, sizeof(name), "d%ld", d);
+		if (dir_add(myfs_root, name, len, inode_new(S_IFDIR | 0755)) != 0)
+			return 1;
+	}
+
+	t = run(create_files);
+	printf("create: %ld files in %ld dirs, %ld threads, %.3f s, %.1f ns/op\n",
+	       nfiles, ndirs, nthreads, t, t * 1e9 / nfiles);
+
+	/* Fisher-Yates shuffle so the stats hit the table in random order */
+	order = malloc(nfiles * sizeof(*order));
+	if (order == NULL)
+		return 1;
+	for (long i = 0; i < nfiles; i++)
+		order[i] = i;
+	srand(1);
+	for (long i = nfiles - 1; i > 0; i--) {
+		long j = ((long) rand() * RAND_MAX + rand()) % (i + 1);
+		long tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+
+	t = run(stat_files);
+	printf("stat:   %ld random lookups, %ld threads, %.3f s, %.1f ns/op\n",
+	       nfiles, nthreads, t, t * 1e9 / nfiles);
+
+	char stats[4096];
+	slab_format_stats(stats, sizeof(stats));
+	fputs(stats, stdout);
+
+	free(order);
+	return 0;
+}
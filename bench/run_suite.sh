@@ -0,0 +1,76 @@
+#!/bin/sh
+# Run bench/fsbench.c on the native tmpfs and on myfs, my_passthrough and
+# my_passthrough_ll (with and without --passthrough) mounted over it, and print every result next to the
+# native one. The raw results (JSON Lines, one environment line first)
+# are kept in bench/results/<commit>.jsonl, so runs of two commits can be
+# compared with bench/compare_results.sh.
+#
+# usage: bench/run_suite.sh [build dir] [output file]
+#        SIZE=MiB (default 256) and FILES=N (default 10000) scale the matrix
+
+set -e
+
+BUILD=${1:-build}
+HERE=$(dirname "$0")
+COMMIT=$(git -C "$HERE" describe --always --dirty 2>/dev/null || echo unknown)
+OUT=${2:-$HERE/results/$COMMIT.jsonl}
+SIZE=${SIZE:-256}
+FILES=${FILES:-10000}
+FSBENCH=$(mktemp /tmp/fsbench.XXXXXX)
+BACKING=$(mktemp -d /dev/shm/myfs-bench.XXXXXX)
+MNT=$(mktemp -d /tmp/myfs-mnt.XXXXXX)
+
+cleanup() {
+	fusermount3 -u "$MNT" 2>/dev/null || true
+	rm -rf "$BACKING" "$MNT" "$FSBENCH"
+}
+trap cleanup EXIT
+
+gcc -Wall -O2 -pthread "$HERE/fsbench.c" -o "$FSBENCH"
+mkdir -p "$(dirname "$OUT")"
+
+wait_mount() {
+	for i in 1 2 3 4 5 6 7 8 9 10; do
+		mountpoint -q "$MNT" && return 0
+		sleep 0.2
+	done
+	echo "$MNT did not get mounted" >&2
+	exit 1
+}
+
+run() {
+	label=$1 dir=$2
+	mkdir -p "$dir"
+	"$FSBENCH" --label="$label" --size="$SIZE" --files="$FILES" "$dir" >> "$OUT"
+}
+
+printf '{"label":"env","commit":"%s","date":"%s","kernel":"%s","cpus":%s,"size_mib":%s,"files":%s}\n' \
+	"$COMMIT" "$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$(uname -r)" "$(nproc)" "$SIZE" "$FILES" > "$OUT"
+
+run native "$BACKING/native"
+
+"$BUILD/myfs" "$MNT"
+wait_mount
+run myfs "$MNT/myfs"
+fusermount3 -u "$MNT"
+
+# my_passthrough mirrors /, so the backing directory shows up under $MNT$BACKING
+"$BUILD/my_passthrough" "$MNT"
+wait_mount
+run my_passthrough "$MNT$BACKING/passthrough"
+fusermount3 -u "$MNT"
+
+"$BUILD/my_passthrough_ll" --source="$BACKING" "$MNT"
+wait_mount
+run my_passthrough_ll "$MNT/passthrough_ll"
+fusermount3 -u "$MNT"
+
+# kernel passthrough: data I/O should be as fast as native when the kernel supports it
+"$BUILD/my_passthrough_ll" --passthrough --source="$BACKING" "$MNT"
+wait_mount
+run my_passthrough_ll_kpt "$MNT/passthrough_ll_kpt"
+fusermount3 -u "$MNT"
+
+echo
+echo "results in $OUT, relative to native:"
+"$HERE/compare_results.sh" "$OUT"
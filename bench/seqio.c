@@ -0,0 +1,85 @@
+/*
+   Sequential throughput benchmark
+
+   Writes a file with fixed-size blocks, then drops its cached pages and
+   reads it back, and prints the throughput of both passes. Run it inside
+   a mount and on the backing directory to compare against native.
+
+   Compile with
+
+   gcc -Wall -O2 bench/seqio.c -o seqio
+   ./seqio <file> [size in MiB] [block size in KiB]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <file> [size in MiB] [block size in KiB]\n", argv[0]);
+		return 1;
+	}
+	const char *file = argv[1];
+	size_t total = (argc > 2 ? atol(argv[2]) : 1024) << 20;
+	size_t bs = (argc > 3 ? atol(argv[3]) : 1024) << 10;
+	char *buf;
+	double t, wr, rd;
+	int fd;
+
+	if (posix_memalign((void **) &buf, 4096, bs) != 0)
+		return 1;
+	memset(buf, 0xa5, bs);
+
+	fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		perror(file);
+		return 1;
+	}
+	t = now();
+	for (size_t done = 0; done < total; done += bs) {
+		if (write(fd, buf, bs) != (ssize_t) bs) {
+			perror("write");
+			return 1;
+		}
+	}
+	fsync(fd);
+	wr = now() - t;
+	close(fd);
+
+	fd = open(file, O_RDONLY);
+	if (fd == -1) {
+		perror(file);
+		return 1;
+	}
+	/* make the read pass go through the filesystem, not the page cache */
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	t = now();
+	for (size_t done = 0; done < total; done += bs) {
+		if (read(fd, buf, bs) != (ssize_t) bs) {
+			perror("read");
+			return 1;
+		}
+	}
+	rd = now() - t;
+	close(fd);
+	unlink(file);
+
+	printf("seqio: size %zu MiB block %zu KiB write %.1f MiB/s read %.1f MiB/s\n",
+	       total >> 20, bs >> 10, (total >> 20) / wr, (total >> 20) / rd);
+	free(buf);
+	return 0;
+}
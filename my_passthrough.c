@@ -9,18 +9,61 @@
  * This is implemented by just "passing through" all requests 
  * to the corresponding user-space libc functions.
  * 
- * But its performance is terrible. // 성능 측정해보기(gettimeofday, ...)
+ * But its performance is terrible. // 성능 측정: /.myfs_stats (my_passthrough_stats.h)
  * 
  *
  * Compile with
  *
+ * cmake -S . -B build && cmake --build build
+ *
+ * which probes for the HAVE_* features below, or by hand
+ *
  * gcc -Wall my_passthrough.c `pkg-config fuse3 --cflags --libs` -o my_passthrough
  *
+ * Options
+ *
+ * --cache                  let the kernel cache names and attributes, changes made
+ *                          to the backing tree are pushed out with inotify
+ * --entry-timeout=SECS     name lookup cache timeout with --cache (default 10)
+ * --attr-timeout=SECS      attribute cache timeout with --cache (default 10)
+ * --negative-timeout=SECS  negative lookup cache timeout with --cache (default 0)
+ * --copy-io                serve read/write by copying through a user buffer
+ *                          instead of read_buf/write_buf (for comparison)
+ * --no-splice              use read_buf/write_buf but don't ask for splice
+ * --workers=N              maximum number of worker threads
+ * --idle-workers=N         number of idle worker threads to keep around
+ * --pin-workers            pin each worker to a CPU and give it its own
+ *                          /dev/fuse clone fd
+ *
+ * --no-stats               don't time the operations
+ * --trace=LEVEL            trace requests: 0 off, 1 failed ones, 2 all;
+ *                          SIGUSR2 cycles through the levels at runtime
+ * --trace-file=FILE        write trace records to FILE instead of stderr
+ * --fd-cache=N             keep up to N files open for requests without a file
+ *                          handle and for open() (default 1024, 0 disables)
+ * --writeback              let the kernel cache writes and send them in large
+ *                          batches (FUSE_CAP_WRITEBACK_CACHE); data reaches the
+ *                          backing files on flush/fsync or when the kernel
+ *                          writes back dirty pages
+ * --write-buffer=KiB       merge small sequential writes of each open file in a
+ *                          buffer of this size before writing them out
+ * --write-flush-ms=MS      write out data buffered for longer than this
+ *                          (default 50)
+ * --readahead=KiB          prefetch up to this much ahead of sequential
+ *                          readers into the page cache
+ *
+ * Request counts per worker are printed to stderr when the filesystem is
+ * unmounted.
+ *
+ * Per-operation counts, bytes and latency percentiles can be read from
+ * <mount point>/.myfs_stats, or are printed to stderr on SIGUSR1
+ * (run with -f to see them).
+ *
  * ## Source code ##
  * \include my_passthrough.c
  */
 
-#define FUSE_USE_VERSION 31
+#define FUSE_USE_VERSION 312
 
 /* 
  ** 구현에 따라 존재하지 않을 수도 있는 매크로의 사용 **
@@ -49,13 +92,16 @@ _XOPEN_SOURCE가 어떤 값으로든 정의되어 있으면 POSIX.1, POSIX.2, X/
 #endif
 
 #include <fuse.h>
+#include <fuse_lowlevel.h> // fuse_parse_cmdline()
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h> // 여러 시스템콜 proto type: access(), chdir(), fsync(), getcwd, unlink, truncate, ...
 #include <fcntl.h> // fcntl()과 open()을 위한 자료형,상수,함수 정의
 #include <sys/stat.h> // 파일의 상태를 확인하기 위한 자료형, 구조체, 상수와 관련된 함수 정의:fstat, ...
 #include <dirent.h> // 파일시스템의 디렉터리를 나타내기 위한 구조체 정의: closedir/opendir/readdir/...
 #include <errno.h> // errno 변수와 에러 상수 정의
+#include <stddef.h> // offsetof()
 
 #ifdef __FreeBSD__
 #include <sys/socket.h> //네트워크 통신을 위한 소켓 인터페이스를 위한 자료형,구조체,함수정의
@@ -68,7 +114,175 @@ _XOPEN_SOURCE가 어떤 값으로든 정의되어 있으면 POSIX.1, POSIX.2, X/
 #include <sys/xattr.h>
 #endif
 
+/* copy_file_range()는 glibc 2.27부터 있다. config.h가 없으면 glibc 버전으로 판단한다 */
+#if !defined(HAVE_CONFIG_H) && defined(__linux__) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE
+#endif
+
 #include "my_passthrough_helpers.h"
+#include "my_passthrough_watch.h"
+#include "my_passthrough_workers.h"
+#include "my_passthrough_stats.h"
+#include "myfs_trace.h"
+#include "my_passthrough_fdcache.h"
+#include "my_passthrough_wbuf.h"
+#include "my_passthrough_readahead.h"
+#ifdef HAVE_COPY_FILE_RANGE
+#include "my_passthrough_copy.h"
+#endif
+#include "my_passthrough_dio.h"
+
+/* 
+ ** 명령행 옵션 **
+    fuse_opt_parse()가 libfuse에 넘기기 전에 아래 옵션들을 argv에서 골라내 채운다.
+*/
+static struct myfs_options {
+    int cache;               // --cache: 커널의 entry/attr 캐시 사용
+    double entry_timeout;
+    double attr_timeout;
+    double negative_timeout;
+    int copy_io;             // --copy-io: read_buf/write_buf 대신 read/write 사용
+    int no_splice;           // --no-splice: FUSE_CAP_SPLICE_* 를 요청하지 않음
+    int workers;             // --workers=N: 최대 worker thread 수
+    int idle_workers;        // --idle-workers=N: 남겨둘 idle worker 수
+    int pin_workers;         // --pin-workers: worker를 CPU에 고정, worker마다 clone fd
+    int no_stats;            // --no-stats: 연산별 지연 시간을 재지 않음
+    int trace;               // --trace=LEVEL: 요청 trace 수준 (myfs_trace.h), SIGUSR2로 변경
+    const char *trace_file;  // --trace-file=FILE: trace 출력 파일 (기본값 stderr)
+    int fd_cache;            // --fd-cache=N: 캐시할 fd 수, 0이면 캐시 안 함
+    int writeback;           // --writeback: 커널 writeback cache 사용
+    int write_buffer;        // --write-buffer=KiB: 파일 핸들마다 write를 모을 buffer 크기, 0이면 안 모음
+    int write_flush_ms;      // --write-flush-ms=MS: buffer에 이보다 오래 있던 데이터는 내보냄
+    int readahead;           // --readahead=KiB: 순차 읽기일 때 미리 읽을 최대 크기, 0이면 안 함
+    int copy_chunk;          // --copy-chunk=MiB: copy_file_range 요청 하나가 실제로 복사할 최대 크기
+    const char *direct_io;   // --direct-io=RULES: 규칙에 맞는 파일은 direct_io로 연다 (my_passthrough_dio.h)
+    const char *keep_cache;  // --keep-cache=RULES: 규칙에 맞는 파일은 open 사이에 page cache를 유지
+    int backing_direct;      // --backing-direct: direct_io 파일은 하위 파일도 O_DIRECT로 읽고 씀
+    int parallel_direct_writes; // --parallel-direct-writes: direct_io 파일의 write를 커널이 동시에 보냄
+} options = {
+    .entry_timeout = 10.0,
+    .attr_timeout = 10.0,
+    .negative_timeout = 0.0, // negative entries cannot be invalidated through the high-level API
+    .idle_workers = -1,      // -1: libfuse 기본값 사용
+    .fd_cache = 1024,
+    .write_flush_ms = 50,
+    .copy_chunk = 64,
+};
+
+static FILE *trace_file;
+
+#define OPTION(t, p) { t, offsetof(struct myfs_options, p), 1 }
+static const struct fuse_opt option_spec[] = {
+    OPTION("--cache", cache),
+    OPTION("--entry-timeout=%lf", entry_timeout),
+    OPTION("--attr-timeout=%lf", attr_timeout),
+    OPTION("--negative-timeout=%lf", negative_timeout),
+    OPTION("--copy-io", copy_io),
+    OPTION("--no-splice", no_splice),
+    OPTION("--workers=%d", workers),
+    OPTION("--idle-workers=%d", idle_workers),
+    OPTION("--pin-workers", pin_workers),
+    OPTION("--no-stats", no_stats),
+    OPTION("--trace=%d", trace),
+    OPTION("--trace-file=%s", trace_file),
+    OPTION("--fd-cache=%d", fd_cache),
+    OPTION("--writeback", writeback),
+    OPTION("--write-buffer=%d", write_buffer),
+    OPTION("--write-flush-ms=%d", write_flush_ms),
+    OPTION("--readahead=%d", readahead),
+    OPTION("--copy-chunk=%d", copy_chunk),
+    OPTION("--direct-io=%s", direct_io),
+    OPTION("--keep-cache=%s", keep_cache),
+    OPTION("--backing-direct", backing_direct),
+    OPTION("--parallel-direct-writes", parallel_direct_writes),
+    FUSE_OPT_END
+};
+
+/*
+    open/create가 fi->fh에 넣는 파일 핸들.
+    하위 파일의 fd와, --write-buffer를 쓰면 write buffer(my_passthrough_wbuf.h)를,
+    --readahead를 쓰면 읽기 패턴(my_passthrough_readahead.h)을 가진다.
+*/
+struct myfs_file {
+    int fd;
+    struct wbuf *wb;    // buffer를 쓰지 않거나 읽기 전용이면 NULL
+    dev_t dev;          // --write-buffer나 --cache를 쓸 때 하위 파일의 inode, 읽기 전에 다른 핸들의 buffer를 찾는다
+    ino_t ino;
+    int held;           // 쓰기 핸들이라 watch_hold()했음, release에서 watch_unhold()
+    struct ra_state *ra; // read-ahead를 쓰지 않으면 NULL
+    int dfd;            // --backing-direct: 하위 파일의 O_DIRECT fd, 없으면 -1
+};
+
+static inline struct myfs_file *get_file(struct fuse_file_info *fi)
+{
+    return (struct myfs_file *) (uintptr_t) fi->fh;
+}
+
+static inline int get_fd(struct fuse_file_info *fi)
+{
+    return get_file(fi)->fd;
+}
+
+/* fd를 가진 핸들을 만들어 fi->fh에 넣는다. 실패하면 fd를 닫는다. */
+static int new_file(struct fuse_file_info *fi, int fd)
+{
+    struct myfs_file *f = malloc(sizeof(struct myfs_file));
+    struct stat st;
+    if(f == NULL){
+        close(fd);
+        return -ENOMEM;
+    }
+    f->fd = fd;
+    f->wb = NULL;
+    f->dev = 0;
+    f->ino = 0;
+    f->held = 0;
+    if((wbuf_size != 0 || watch_fd != -1) && fstat(fd, &st) == 0){
+        f->dev = st.st_dev;
+        f->ino = st.st_ino;
+        if(wbuf_size != 0)
+            f->wb = wbuf_new(fd, &st);
+        if(watch_fd != -1 && (fcntl(fd, F_GETFL) & O_ACCMODE) != O_RDONLY){
+            watch_hold(f->dev, f->ino); // 이 핸들로 쓴 변경의 inotify 이벤트는 무시한다
+            f->held = 1;
+        }
+    }
+    f->ra = ra_new();
+    f->dfd = -1;
+    fi->fh = (uintptr_t) f;
+    return 0;
+}
+
+/*
+    --direct-io/--keep-cache 규칙으로 이 open의 캐시 방식을 정한다. new_file() 다음에 부른다.
+    direct_io 파일에 하위 O_DIRECT fd가 생기면 데이터는 어느 쪽 page cache에도 남지 않으므로
+    write buffer와 read-ahead는 쓰지 않는다.
+*/
+static void cache_mode(const char *path, struct fuse_file_info *fi)
+{
+    struct myfs_file *f = get_file(fi);
+
+    if(dio_direct.n != 0 && dio_match(&dio_direct, path, f->fd)){
+        fi->direct_io = 1;
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 14)
+        fi->parallel_direct_writes = options.parallel_direct_writes;
+#endif
+        atomic_fetch_add_explicit(&dio_direct_opens, 1, memory_order_relaxed);
+        if(dio_backing){
+            f->dfd = open(path, (fcntl(f->fd, F_GETFL) & O_ACCMODE) | O_DIRECT | O_CLOEXEC);
+            if(f->dfd != -1){ // 하위 파일시스템이 O_DIRECT를 지원하지 않으면 EINVAL
+                wbuf_free(f->wb);
+                f->wb = NULL;
+                ra_free(f->ra);
+                f->ra = NULL;
+            }
+        }
+    } else if(dio_keep.n != 0 && dio_match(&dio_keep, path, f->fd)){
+        fi->keep_cache = 1;
+        atomic_fetch_add_explicit(&dio_keep_opens, 1, memory_order_relaxed);
+    }
+}
 
 /* 함수 원형: void* (* init) (struct fuse_conn_info *conn, struct fuse_config *cfg) */
 /* Initialize filesystem, 파일시스템이 mount될 때 가장 먼저 호출되는 함수.
@@ -84,8 +298,16 @@ _XOPEN_SOURCE가 어떤 값으로든 정의되어 있으면 POSIX.1, POSIX.2, X/
 */
 static void *myfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
 {
-    printf("[myfs_init] Called\n");
-    (void) conn;
+    if(trace_start(options.trace, trace_file) != 0)
+        fprintf(stderr, "my_passthrough: cannot start tracing\n");
+
+    /* splice: /dev/fuse와 하위 파일 사이의 데이터를 pipe를 통해 커널 안에서 옮긴다.
+       read_buf/write_buf가 fd를 가리키는 buffer를 주고받으므로 사용자 공간 복사가 없어진다. */
+    if(!options.copy_io && !options.no_splice){
+        conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+        if(!options.write_buffer) // write buffer는 데이터를 메모리로 받아야 한다
+            conn->want |= conn->capable & FUSE_CAP_SPLICE_READ;
+    }
     /*
         struct fuse_config { ... ``use_ino`` ...}
         This value is used to fill in the st_ino field in the stat, lstat, fstat functions
@@ -123,6 +345,34 @@ static void *myfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
        caching negative lookups are disabled. 
     */
     cfg->negative_timeout = 0; // negative lookups are not cached.
+
+    /* --cache: 캐시를 켜고, 하위 파일시스템이 바뀌면 inotify로 감지해서
+       fuse_invalidate_path()로 커널 캐시를 무효화한다. (my_passthrough_watch.h) */
+    if(options.cache){
+        cfg->entry_timeout = options.entry_timeout;
+        cfg->attr_timeout = options.attr_timeout;
+        cfg->negative_timeout = options.negative_timeout;
+        if(watch_start(fuse_get_context()->fuse) != 0){
+            fprintf(stderr, "my_passthrough: inotify unavailable, disabling --cache\n");
+            cfg->entry_timeout = cfg->attr_timeout = cfg->negative_timeout = 0;
+        }
+    }
+
+    /* --writeback: 작은 write를 커널 page cache에 모았다가 큰 write로 보낸다.
+       그 대신 커널이 O_WRONLY 파일도 읽을 수 있어야 하고, O_APPEND는 커널이 처리한다(writeback_flags()). */
+    if(options.writeback && (conn->capable & FUSE_CAP_WRITEBACK_CACHE))
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    else
+        conn->want &= ~FUSE_CAP_WRITEBACK_CACHE;
+
+    /* readdirplus: readdir이 entry의 속성까지 넘겨서 ls -l이 entry마다 getattr을 부르지 않게 한다.
+       속성을 캐시하지 않으면(attr_timeout 0) 커널이 어차피 getattr을 다시 부르므로 fstatat()만 낭비이다.
+       캐시할 때에는 커널이 알아서 고르는 AUTO 대신 항상 readdirplus를 쓴다. */
+    if(cfg->attr_timeout > 0 && (conn->capable & FUSE_CAP_READDIRPLUS)){
+        conn->want |= FUSE_CAP_READDIRPLUS;
+        conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+    } else
+        conn->want &= ~(FUSE_CAP_READDIRPLUS | FUSE_CAP_READDIRPLUS_AUTO);
     return NULL;
 }
 
@@ -143,9 +393,20 @@ static int myfs_getattr(const char *path, struct stat *stbuf, struct fuse_file_i
 {
     (void) fi;
     int res;
+    if(strcmp(path, STATS_PATH) == 0){ // 하위 파일시스템에는 없는 가상 파일
+        memset(stbuf, 0, sizeof(*stbuf));
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_uid = getuid();
+        stbuf->st_gid = getgid();
+        stbuf->st_size = stats_format(NULL, 0);
+        return 0;
+    }
     res = lstat(path, stbuf); // path에 위치한 파일의 정보를 얻어옴
     if(res == -1)  // 실패시 -1, 성공시 0
         return -errno;
+    wbuf_stat(stbuf); // 아직 buffer에 있는 write까지 크기에 포함
+    watch_path(path, stbuf->st_mode); // 커널이 캐시할 수 있는 entry는 변경을 감시
     return 0;
 }
 
@@ -194,6 +455,52 @@ static int myfs_readlink(const char* path, char *buf, size_t size)
     return 0;
 }
 
+/*
+    opendir에서 연 디렉토리 스트림. fi->fh에 넣어 두고 readdir 호출 사이에 유지하므로
+    커널 buffer가 찰 때마다 디렉토리를 다시 열고 처음부터 읽지 않아도 된다.
+    offset은 다음에 readdir()이 돌려줄 entry의 위치(telldir() 값)이다.
+*/
+struct myfs_dirp {
+    DIR *dp;
+    struct dirent *entry; // 읽었지만 buffer가 차서 아직 넘기지 못한 entry
+    off_t offset;
+};
+
+static inline struct myfs_dirp *get_dirp(struct fuse_file_info *fi)
+{
+    return (struct myfs_dirp *) (uintptr_t) fi->fh;
+}
+
+/* 함수 원형: int (*opendir) (const char *, struct fuse_file_info *) */
+/* Open directory
+   Unless the 'default_permissions' mount option is given, this method should check if opendir is permitted
+   for this directory. Optionally opendir may also return an arbitrary filehandle in the fuse_file_info
+   structure, which will be passed to readdir, releasedir and fsyncdir.
+*/
+static int myfs_opendir(const char *path, struct fuse_file_info *fi)
+{
+    struct myfs_dirp *d = malloc(sizeof(struct myfs_dirp));
+    if(d == NULL)
+        return -ENOMEM;
+    /* 디렉토리 이름을 인수로 받아 해당 디렉토리 스트림을 연다. 정상적이면 DIR* 포인터가 리턴,
+       실패하면 NULL을 리턴하고 errno에 에러코드가 들어간다.
+       정상적으로 리턴된 DIR* 포인터를 가지고 readdir()과 closedir()을 사용 */
+    d->dp = opendir(path);
+    if(d->dp == NULL){
+        int res = -errno;
+        free(d);
+        return res;
+    }
+    d->offset = 0;
+    d->entry = NULL;
+    fi->fh = (uintptr_t) d;
+    /* --cache: 디렉토리 내용도 커널이 캐시한다. 하위 디렉토리가 바뀌면 watch가 무효화한다 */
+    if(options.cache)
+        fi->cache_readdir = 1;
+    watch_dir(path);
+    return 0;
+}
+
 /* 함수 원형: int (*readdir)(const char *, void *, fuse_fill_dir_t, off_t, struct fuse_file_info*, enum fuse_readdir_flags) */
 /* Read directory. 
        디렉토리의 inode를 읽어 해당 디렉토리가 위치한 block주소 위치를 알아내어 
@@ -205,42 +512,49 @@ static int myfs_readlink(const char* path, char *buf, size_t size)
    2) The readdir implementation keeps track of the offsets of the directory entries. It uses the offset parameter
    and always passes non-zero offset to the filler function. When the buffer is full (or an error happes) the
    filler function will return '1'.
+
+   여기서는 2)를 사용한다. 커널이 준 offset이 스트림의 현재 위치와 다르면(lseek 등) seekdir()로 옮긴다.
+   flags에 FUSE_READDIR_PLUS가 있으면(readdirplus) entry마다 fstatat()으로 얻은 전체 속성을
+   FUSE_FILL_DIR_PLUS와 함께 넘기므로, ls -l이 entry마다 getattr을 따로 부르지 않아도 된다.
 */
 static int myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                 off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
 {
-    DIR *dp;
-    struct dirent *de;
-    (void) fi;
-    (void) offset;
-    (void) flags;
-    /* 디렉토리 이름을 인수로 받아 해당 디렉토리 스트림을 연다. 정상적이면 DIR* 포인터가 리턴,
-       실패하면 NULL을 리턴하고 errno에 에러코드가 들어간다.
-       정상적으로 리턴된 DIR* 포인터를 가지고 readdir()과 closedir()을 사용 */
-    dp = opendir(path); 
-    if(dp == NULL)
-        return -errno;
-    /* opendir()로 얻어진 디렉토리 포인터를 통해 디렉토리 정보를 하나씩 차례대로 읽음
-       디렉토리 스트림 끝에 도달(디렉토리 내 파일 정보를 모두 읽음)하거나 에러가 발생하면
-       NULL을 리턴한다.
-       
-       readdir()이 정상적이면 struct dirent 구조체의 포인터를 리턴하기 때문에 사용전
-       DIR* 포인터가 정상이지 확인하고 연속적으로 readdir()을 호출할 시에는 리턴 포인터를
-       반드시 확인해야 한다.
-
-       readdir()이 NULL을 리턴했는데 디렉토리 끝인지 에러인지 구분하고 싶다면 
-       호출 전 errno를 0으로 지우고 readdir()을 호출한다. 디렉토리 끝으로 NULL을 리턴한 경우 
-       errno값이 0으로 유지되므로 에러를 구분할 수 있다. 
-    */
-    while((de = readdir(dp)) != NULL){
+    struct myfs_dirp *d = get_dirp(fi);
+    (void) path;
+
+    if(offset != d->offset){
+        seekdir(d->dp, offset);
+        d->entry = NULL;
+        d->offset = offset;
+    }
+    while(1){
         struct stat st;
-        memset(&st, 0, sizeof(st));
-        st.st_ino = de->d_ino;
-        /* 
-          Why shift 12 bit for d_type?
-          https://stackoverflow.com/questions/8420234/why-shift-12-bit-for-d-type-in-fusexmp
-        */
-        st.st_mode = de->d_type << 12; 
+        off_t nextoff;
+        enum fuse_fill_dir_flags fill_flags = 0;
+
+        if(d->entry == NULL){
+            /* opendir()로 얻어진 디렉토리 포인터를 통해 디렉토리 정보를 하나씩 차례대로 읽음
+               디렉토리 스트림 끝에 도달하거나 에러가 발생하면 NULL을 리턴한다. */
+            d->entry = readdir(d->dp);
+            if(d->entry == NULL)
+                break;
+        }
+        if(flags & FUSE_READDIR_PLUS){
+            int res = fstatat(dirfd(d->dp), d->entry->d_name, &st, AT_SYMLINK_NOFOLLOW);
+            if(res != -1)
+                fill_flags |= FUSE_FILL_DIR_PLUS;
+        }
+        if(!(fill_flags & FUSE_FILL_DIR_PLUS)){
+            memset(&st, 0, sizeof(st));
+            st.st_ino = d->entry->d_ino;
+            /* 
+              Why shift 12 bit for d_type?
+              https://stackoverflow.com/questions/8420234/why-shift-12-bit-for-d-type-in-fusexmp
+            */
+            st.st_mode = d->entry->d_type << 12;
+        }
+        nextoff = telldir(d->dp);
         /* filler함수: typedef int(*fuse_fill_dir_t) (void *buf, const char *name, 
                                     const struct stat *stbuf, off_t off, enum fuse_fill_dir_flags flags)
          * function to add an entry in a readdir() operation.
@@ -250,23 +564,30 @@ static int myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
          * @param off offset of the next entry or zero
          * @param flags fill flags
          * return 1 if buffer is full, zero otherwise
-         * 
-         * 
-         * 디렉토리로부터 읽어들인 디렉토리 내에 존재하는 파일 이름을 ``name에, 그 파일의 metadata를 ``stat에 채워
-         * filler함수를 호출함으로써 읽어 들인 내용을 반환할 수 있다.
          *
-         * The *off* parameter - 1) 0으로 설정: 한 번의 readdir함수 호출로 전체 directory를 읽어 들임
-                               - 2) 디렉토리에서 현재 읽어 들인 엔트리의 offset을 설정: 디렉토리 entry를 읽어 들일
-                                    때마다 readdir 함수가 호출되도록 함.
+         * off에 다음 entry의 offset을 넘기므로 buffer가 차면(1을 리턴) 이 entry는 d->entry에 남겨 두고
+         * 다음 readdir 호출에서 다시 넘긴다.
          */
-        if(filler(buf, de->d_name, &st, 0, 0)) //return 값이 1이면 버퍼가 꽉참
+        if(filler(buf, d->entry->d_name, &st, nextoff, fill_flags))
             break;
+        d->entry = NULL;
+        d->offset = nextoff;
     }
+    return 0;
+}
+
+/* 함수 원형: int (*releasedir) (const char *, struct fuse_file_info *) */
+/* Release directory */
+static int myfs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    struct myfs_dirp *d = get_dirp(fi);
+    (void) path;
     /* int closedir(DIR *dirstream)
        디렉토리 스트림을 닫음, 시스템 자원을 사용하므로 DIR*포인터를 통해서 닫아야 함.
        정상이면 0, 실패하면 -1을 리턴함.
      */
-    closedir(dp); 
+    closedir(d->dp);
+    free(d);
     return 0;
 }
 
@@ -325,6 +646,7 @@ static int myfs_mkdir(const char *path, mode_t mode)
 static int myfs_unlink(const char *path)
 {
     int res;
+    fdcache_evict_path(path); // 캐시된 fd가 지워진 파일을 붙잡고 있지 않도록
     res = unlink(path);
     // 리턴값 0: 정상적으로 파일 또는 link가 삭제됨
     // 리턴값 -1: 오류가 발생, 상세 내용은 errno에 저장됨.
@@ -382,6 +704,7 @@ static int myfs_rename(const char *from, const char* to, unsigned int flags)
 
     if(flags)
         return -EINVAL; //EINVAL: 
+    fdcache_evict_path(to); // 덮어써지는 파일
     res = rename(from, to);
     if(res == -1)
         return -errno;
@@ -424,9 +747,11 @@ static int myfs_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
     (void)fi;
     int res;
 
+    watch_touch(path); // 커널은 이 변경을 이미 알고 있다
     res = chmod(path, mode);
     if(res == -1)
         return -errno;
+    fdcache_evict_inode(path); // 예전 권한으로 연 fd를 계속 쓰지 않도록
     return 0;
 }
 
@@ -451,10 +776,12 @@ static int myfs_chown(const char *path, uid_t uid, gid_t gid,
 {
     (void)fi;
     int res;
+    watch_touch(path);
     res = lchown(path, uid, gid);
 
     if(res == -1)
         return -errno;
+    fdcache_evict_inode(path);
     return 0;
 }
 
@@ -471,10 +798,15 @@ static int myfs_truncate(const char *path, off_t size, struct fuse_file_info *fi
         truncate/ftruncate는 path로 지정된 파일이나 fd로 참조되는 파일을 
         size 바이트 크기가 되도록 자른다.
     */
-    if(fi !=NULL) //열려있다면
-        res = ftruncate(fi->fh, size); //fuse_file_info {... fh ...}-> fh=file handle id.
-    else
+    if(fi !=NULL){ //열려있다면
+        // 어느 핸들의 buffer에 남은 write라도 truncate 뒤에 쓰이면 안 됨
+        wbuf_flush_inode(get_file(fi)->dev, get_file(fi)->ino);
+        res = ftruncate(get_fd(fi), size); //fuse_file_info {... fh ...}-> fh=file handle id.
+    } else {
+        wbuf_flush_path(path);
+        watch_touch(path);
         res = truncate(path, size);
+    }
     if(res == -1)
         return -errno;
     return 0;
@@ -527,13 +859,28 @@ static int myfs_utimens(const char *path, const struct timespec ts[2], struct fu
                      역참조 될 수 없다는 뜻(심볼릭 링크 자체의 타임스탬프는 변경돼야만 함)
             
     */
-    res = utimensat(0, path, ts, AT_SYMLINK_NOFOLLOW);
+    watch_touch(path);
+    res = utimensat(AT_FDCWD, path, ts, AT_SYMLINK_NOFOLLOW);
     if(res == -1)
         return -errno;
     return 0;
 }
 #endif
 
+/*
+    writeback cache를 쓰면 커널은 page 단위로 읽고 쓰기 때문에 O_WRONLY로 연 파일에도 read를
+    보내고, O_APPEND 파일의 쓰기 위치도 커널이 직접 계산해서 offset으로 보낸다.
+    따라서 하위 파일은 O_RDWR로 열고 O_APPEND는 빼야 한다.
+*/
+static int writeback_flags(int flags)
+{
+    if(!options.writeback)
+        return flags;
+    if((flags & O_ACCMODE) == O_WRONLY)
+        flags = (flags & ~O_ACCMODE) | O_RDWR;
+    return flags & ~O_APPEND;
+}
+
 /* 함수 원형: int (*create) (const char *, mode_t, struct fuse_file_info *) */
 /*
     Create and open a file.
@@ -545,7 +892,7 @@ static int myfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
     int res;
     /* int open(const char *pathname, int flags, ...// mode_t mode); */
-    res = open(path, fi->flags, mode); 
+    res = open(path, writeback_flags(fi->flags), mode); 
     /* struct fuse_file_info *fi
        Information about an open file. File Handles are created by the open, opendir, 
        and create methods and closed by the release and releasedir methods.
@@ -554,12 +901,14 @@ static int myfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
     */
     if(res == -1)
         return -errno;
-    fi->fh = res; //성공하면 fd 리턴
     /*
         struct fuse_file_info *fi-> fh: File Handle id. May be filled in by filesystem in 
                                         create, open, and opendir().
     */
-    return 0;
+    res = new_file(fi, res); //성공하면 fd를 가진 핸들 리턴
+    if(res == 0)
+        cache_mode(path, fi);
+    return res;
 }
 
 /* 함수 원형: int (*open) (const char *, struct fuse_file_info *) */
@@ -581,11 +930,45 @@ static int myfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 static int myfs_open(const char *path, struct fuse_file_info *fi)
 {
     int res;
-    res = open(path, fi->flags);
-    if(res == -1)
-        return -errno;
-    fi->fh = res;
-    return 0;
+    if(strcmp(path, STATS_PATH) == 0){
+        struct stats_snapshot *snap;
+        if((fi->flags & O_ACCMODE) != O_RDONLY)
+            return -EACCES;
+        snap = stats_snapshot(); // open 시점의 값을 release까지 보여준다
+        if(snap == NULL)
+            return -ENOMEM;
+        fi->fh = (uintptr_t) snap;
+        fi->direct_io = 1; // 크기가 getattr 때와 달라도 끝까지 읽히도록
+        return 0;
+    }
+    /* 특별한 flag가 없으면 캐시된 fd를 dup()해서 쓴다. pread/pwrite만 쓰므로
+       file offset을 공유해도 상관없지만 O_APPEND 같은 status flag는 공유되면 안 된다.
+       access mode가 같은 fd만 쓰고(없으면 그 mode로 새로 연다), 그래서 권한 검사는 open(2)와 같다. */
+    int flags = writeback_flags(fi->flags);
+
+    wbuf_flush_path(path); // 다른 핸들이 buffer에 가진 write를 이 핸들에서 볼 수 있도록
+    if((flags & ~(O_ACCMODE | O_LARGEFILE | O_CLOEXEC | O_NOCTTY)) == 0 && fdcache_max != 0){
+        struct fdcache_entry *e;
+        int fd = fdcache_get(path, flags, 1, &e);
+        if(fd < 0)
+            return fd;
+        if(e == NULL)
+            res = fd;
+        else {
+            res = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+            fdcache_put(e, fd);
+            if(res == -1)
+                return -errno;
+        }
+    } else {
+        res = open(path, flags);
+        if(res == -1)
+            return -errno;
+    }
+    res = new_file(fi, res);
+    if(res == 0)
+        cache_mode(path, fi);
+    return res;
 }
 
 /* 함수 원형: int (*read) (const char *, char *, size_t, off_t, struct fuse_file_info *) */
@@ -599,15 +982,38 @@ static int myfs_open(const char *path, struct fuse_file_info *fi)
 static int myfs_read(const char *path, char *buf, size_t size, off_t offset,
         struct fuse_file_info *fi)
 {
+    struct fdcache_entry *e = NULL;
     int fd;
     int res;
 
-    if(fi == NULL)
-        fd = open(path, O_RDONLY);
-    else
-        fd = fi->fh;
-    if(fd == -1)
-        return -errno;
+    if(strcmp(path, STATS_PATH) == 0){
+        struct stats_snapshot *snap = (struct stats_snapshot *) (uintptr_t) fi->fh;
+        if((size_t) offset >= snap->len)
+            return 0;
+        if(size > snap->len - offset)
+            size = snap->len - offset;
+        memcpy(buf, snap->text + offset, size);
+        return size;
+    }
+    if(fi != NULL){
+        /* 읽을 범위가 아직 어느 핸들의 buffer에 있으면 먼저 쓴다. 크기는 getattr이 이미 보여줬다 */
+        wbuf_flush_range(get_file(fi)->dev, get_file(fi)->ino, offset, size);
+        if(get_file(fi)->dfd != -1){
+            if(dio_aligned(offset, size))
+                return dio_pread(get_file(fi)->dfd, buf, size, offset);
+            atomic_fetch_add_explicit(&dio_unaligned, 1, memory_order_relaxed);
+        }
+    }
+    if(fi == NULL){
+        fd = fdcache_get(path, O_RDONLY, 0, &e); // 열린 파일이 없으면 캐시된 fd를 빌린다
+        if(fd >= 0)
+            wbuf_flush_fd_range(fd, offset, size);
+    } else {
+        fd = get_fd(fi);
+        ra_read(get_file(fi)->ra, fd, offset, size); // 순차 읽기면 다음 범위를 미리 읽게 한다
+    }
+    if(fd < 0)
+        return fd;
     /* 
     #include <unistd.h>
     ssize_t pread(int fd, void *buf, size_t count, off_t offset);
@@ -617,9 +1023,9 @@ static int myfs_read(const char *path, char *buf, size_t size, off_t offset,
     */
     res = pread(fd, buf, size, offset);
     if(res == -1)
-        return -errno;
+        res = -errno;
     if(fi == NULL)
-        close(fd);
+        fdcache_put(e, fd);
     return res;
 }
 
@@ -633,16 +1039,32 @@ static int myfs_read(const char *path, char *buf, size_t size, off_t offset,
 static int myfs_write(const char *path, const char *buf, size_t size, 
             off_t offset, struct fuse_file_info *fi)
 {
+    struct fdcache_entry *e = NULL;
     int fd;
     int res;
 
-    (void) fi;
-    if(fi == NULL)
-        fd = open(path, O_WRONLY);
-    else
-        fd = fi->fh;
-    if(fd == -1)
-        return -errno;
+    if(fi != NULL){
+        struct myfs_file *f = get_file(fi);
+        /* 다른 핸들의 buffer에 남은 겹치는 write가 이 write 뒤에 쓰이면 안 된다.
+           O_DIRECT로 쓰면 이 핸들의 buffer도 건너뛰므로 함께 내보낸다. */
+        wbuf_flush_others(f->dfd != -1 ? NULL : f->wb, f->dev, f->ino, offset, size);
+    }
+    if(fi != NULL && get_file(fi)->dfd != -1){
+        if(dio_aligned(offset, size))
+            return dio_pwrite(get_file(fi)->dfd, buf, size, offset);
+        atomic_fetch_add_explicit(&dio_unaligned, 1, memory_order_relaxed);
+    }
+    if(fi != NULL && get_file(fi)->wb != NULL)
+        return wbuf_write(get_file(fi)->wb, buf, size, offset); // 이어지는 작은 write는 모아서 쓴다
+    if(fi == NULL){
+        watch_touch(path);
+        fd = fdcache_get(path, O_WRONLY, 0, &e);
+        if(fd >= 0)
+            wbuf_flush_fd_range(fd, offset, size);
+    } else
+        fd = get_fd(fi);
+    if(fd < 0)
+        return fd;
     /* 
     #include <unistd.h>
     ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset);
@@ -654,10 +1076,114 @@ static int myfs_write(const char *path, const char *buf, size_t size,
     if(res == -1)
         res = -errno;
     if(fi == NULL)
-        close(fd);
+        fdcache_put(e, fd);
     return res;
 }
 
+/* 함수 원형: int (*read_buf) (const char *, struct fuse_bufvec **bufp, size_t size, off_t off, struct fuse_file_info *) */
+/*
+    Store data from an open file in a buffer
+    read()와 같지만 데이터를 직접 복사하지 않고 "fi->fh의 offset부터 size만큼"을 가리키는
+    fd buffer를 돌려준다. libfuse는 이 buffer를 splice()로 /dev/fuse에 옮기므로
+    (FUSE_CAP_SPLICE_WRITE) 데이터가 사용자 공간을 거치지 않는다.
+    splice를 쓸 수 없으면 libfuse가 알아서 pread()로 복사한다.
+*/
+static int myfs_read_buf(const char *path, struct fuse_bufvec **bufp,
+            size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct fuse_bufvec *src;
+    struct myfs_file *f;
+
+    src = malloc(sizeof(struct fuse_bufvec)); // libfuse가 free한다, 메모리 buffer의 mem도 함께
+    if(src == NULL)
+        return -ENOMEM;
+    if(strcmp(path, STATS_PATH) == 0){ // snapshot의 일부를 복사해서 넘긴다
+        struct stats_snapshot *snap = (struct stats_snapshot *) (uintptr_t) fi->fh;
+        char *mem;
+        if((size_t) offset > snap->len)
+            offset = snap->len;
+        if(size > snap->len - offset)
+            size = snap->len - offset;
+        if((mem = malloc(size ? size : 1)) == NULL){
+            free(src);
+            return -ENOMEM;
+        }
+        memcpy(mem, snap->text + offset, size);
+        *src = FUSE_BUFVEC_INIT(size);
+        src->buf[0].mem = mem;
+        *bufp = src;
+        return 0;
+    }
+    f = get_file(fi);
+    wbuf_flush_range(f->dev, f->ino, offset, size); // libfuse가 fd에서 읽기 전에, 다른 핸들의 buffer까지
+    if(f->dfd != -1){ // 하위 파일을 O_DIRECT로 읽어서 메모리 buffer로 넘긴다
+        if(dio_aligned(offset, size)){
+            void *mem;
+            ssize_t res;
+            if(posix_memalign(&mem, DIO_ALIGN, size) != 0){
+                free(src);
+                return -ENOMEM;
+            }
+            res = dio_pread(f->dfd, mem, size, offset);
+            if(res < 0){
+                free(mem);
+                free(src);
+                return res;
+            }
+            *src = FUSE_BUFVEC_INIT(res);
+            src->buf[0].mem = mem;
+            *bufp = src;
+            return 0;
+        }
+        atomic_fetch_add_explicit(&dio_unaligned, 1, memory_order_relaxed);
+    }
+    ra_read(get_file(fi)->ra, get_fd(fi), offset, size);
+    *src = FUSE_BUFVEC_INIT(size);
+    src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    src->buf[0].fd = get_fd(fi);
+    src->buf[0].pos = offset;
+    *bufp = src;
+    return 0;
+}
+
+/* 함수 원형: int (*write_buf) (const char *, struct fuse_bufvec *buf, off_t off, struct fuse_file_info *) */
+/*
+    Write contents of buffer to an open file
+    buf가 /dev/fuse의 pipe를 가리키면(FUSE_CAP_SPLICE_READ) fuse_buf_copy()가
+    splice()로 하위 파일에 바로 옮긴다. 아니면 pwrite()와 같다.
+*/
+static int myfs_write_buf(const char *path, struct fuse_bufvec *buf,
+            off_t offset, struct fuse_file_info *fi)
+{
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+    struct myfs_file *f = get_file(fi);
+    size_t size = fuse_buf_size(buf);
+    (void) path;
+
+    if(f->dfd != -1){ // O_DIRECT는 정렬된 메모리에서만 쓸 수 있으므로 pipe나 요청 buffer에서 먼저 복사한다
+        if(dio_aligned(offset, size)){
+            struct fuse_bufvec tmp = FUSE_BUFVEC_INIT(size);
+            void *mem;
+            ssize_t res;
+            if(posix_memalign(&mem, DIO_ALIGN, size) != 0)
+                return -ENOMEM;
+            tmp.buf[0].mem = mem;
+            res = fuse_buf_copy(&tmp, buf, 0);
+            if(res == (ssize_t) size)
+                res = dio_pwrite(f->dfd, mem, size, offset);
+            else if(res >= 0)
+                res = -EIO;
+            free(mem);
+            return res;
+        }
+        atomic_fetch_add_explicit(&dio_unaligned, 1, memory_order_relaxed);
+    }
+    dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    dst.buf[0].fd = get_fd(fi); // write buffer를 쓰면 write_buf 대신 write가 불린다
+    dst.buf[0].pos = offset;
+    return fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+}
+
 /* 함수 원형: int (*statfs) (const char *, struct statvfs *) */
 /*
     Get file system statistics. The 'f_favail', 'f_fsid' and 'f_flag' fields are ignored.
@@ -699,8 +1225,20 @@ static int myfs_statfs(const char *path, struct statvfs *stbuf)
 */
 static int myfs_release(const char *path, struct fuse_file_info *fi)
 {
-    (void) path;
-    close(fi->fh);
+    if(strcmp(path, STATS_PATH) == 0){
+        free((void *) (uintptr_t) fi->fh);
+        return 0;
+    }
+    struct myfs_file *f = get_file(fi);
+    wbuf_flush(f->wb); // release의 에러는 아무도 받지 않는다, close()가 받는 것은 flush의 에러
+    wbuf_free(f->wb);
+    if(f->held)
+        watch_unhold(f->dev, f->ino);
+    ra_free(f->ra);
+    if(f->dfd != -1)
+        close(f->dfd);
+    close(f->fd);
+    free(f);
     return 0;
 }
 
@@ -711,13 +1249,73 @@ static int myfs_release(const char *path, struct fuse_file_info *fi)
 */
 static int myfs_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
 {
-    /* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
+    struct fdcache_entry *e = NULL;
+    int fd;
+    int res;
+
+    if(fi != NULL && strcmp(path, STATS_PATH) == 0)
+        return 0;
+    if(fi == NULL)
+        fd = fdcache_get(path, O_RDONLY, 0, &e);
+    else {
+        if((res = wbuf_flush(get_file(fi)->wb)) < 0)
+            return res;
+        fd = get_fd(fi);
+    }
+    if(fd < 0)
+        return fd;
+    /* fsync()는 데이터와 metadata를, fdatasync()는 데이터와 데이터를 읽는 데 필요한 metadata(크기 등)만
+       디스크에 기록한다. writeback 모드에서는 커널이 dirty page를 먼저 보낸 뒤 fsync를 부른다. */
+    res = isdatasync ? fdatasync(fd) : fsync(fd);
+    if(res == -1)
+        res = -errno;
+    if(fi == NULL)
+        fdcache_put(e, fd);
+    return res;
+}
+
+/* 함수 원형: int (*flush) (const char *, struct fuse_file_info *) */
+/*
+    Possibly flush cached data
+    BIG NOTE: This is not equivalent to fsync(). It's not a request to sync dirty data.
+    Flush is called on each close() of a file descriptor, as opposed to release which is called
+    on the close of the last file descriptor for a file. Filesystems shouldn't assume that flush
+    will always be called after some writes, or that if will be called at all.
+
+    writeback 모드에서는 커널이 flush 전에 dirty page를 모두 write로 보내므로 close()가 돌아올 때에는
+    데이터가 하위 파일에 있다. 하위 파일시스템(NFS 등)이 close 시점에 하는 일을 그대로 하도록
+    dup()한 fd를 닫는다. 원래 fd는 release가 닫는다.
+*/
+static int myfs_flush(const char *path, struct fuse_file_info *fi)
+{
+    int res;
+
+    if(strcmp(path, STATS_PATH) == 0)
+        return 0;
+    /* buffer에 모아 둔 write는 여기서 내보내서 close()가 에러를 받을 수 있게 한다 */
+    if((res = wbuf_flush(get_file(fi)->wb)) < 0)
+        return res;
+    res = close(dup(get_fd(fi)));
+    if(res == -1)
+        return -errno;
+    return 0;
+}
+
+/* 함수 원형: int (*fsyncdir) (const char *, int, struct fuse_file_info *) */
+/*
+    Synchronize directory contents
+    새로 만든 파일이 crash 후에도 남아 있으려면 파일뿐 아니라 디렉토리 entry도 디스크에 있어야 한다.
+*/
+static int myfs_fsyncdir(const char *path, int isdatasync, struct fuse_file_info *fi)
+{
+    struct myfs_dirp *d = get_dirp(fi);
+    int res;
+    (void) path;
 
-	(void) path;
-	(void) isdatasync;
-	(void) fi;
-	return 0;
+    res = isdatasync ? fdatasync(dirfd(d->dp)) : fsync(dirfd(d->dp));
+    if(res == -1)
+        return -errno;
+    return 0;
 }
 
 /* 함수 원형: int (*fallocate) (const char *, int, off_t, off_t, struct fuse_file_info) */
@@ -731,19 +1329,21 @@ static int myfs_fsync(const char *path, int isdatasync, struct fuse_file_info *f
 static int myfs_fallocate(const char *path, int mode, off_t offset, off_t length,
             struct fuse_file_info *fi)
 {
+    struct fdcache_entry *e = NULL;
     int fd;
     int res;
 
-    (void) fi;
-
     if(mode)
         return -EOPNOTSUPP; // Operation not supported on transport endpoint
-    if(fi == NULL)
-        fd = open(path, O_WRONLY);
-    else
-        fd = fi->fh;
-    if(fd == -1)
-        return -errno;
+    if(fi == NULL){
+        watch_touch(path);
+        fd = fdcache_get(path, O_WRONLY, 0, &e);
+    } else {
+        wbuf_flush(get_file(fi)->wb);
+        fd = get_fd(fi);
+    }
+    if(fd < 0)
+        return fd;
     /*
         posix_fallocate(fd, offset, len) : fd가 가리키는 디스크 파일의 offset부터 len만큼의 범위에
                 해당하는 디스크 공간이 할당되도록 보장한다.이렇게 하면 응용 프로그램이 나중에 파일에
@@ -753,7 +1353,7 @@ static int myfs_fallocate(const char *path, int mode, off_t offset, off_t length
     res = -posix_fallocate(fd, offset, length);
     
     if(fi == NULL)
-        close(fd);
+        fdcache_put(e, fd);
     return res;
 }
 #endif
@@ -768,6 +1368,7 @@ static int myfs_setxattr(const char *path, const char *name, const char *value,
             size_t size, int flags)
 {
     // pathname으로 파일을 식별하지만, 심볼릭 링크를 역참조하지는 않는다.
+    watch_touch(path);
     int res = lsetxattr(path, name, value, size, flags);
     if(res == -1)
         return -errno;
@@ -784,7 +1385,7 @@ static int myfs_getxattr(const char *path, const char *name, char *value, size_t
     int res = lgetxattr(path, name, value, size);
     if(res == -1)
         return -errno;
-    return 0;
+    return res; // 값의 길이, size가 0이면 필요한 buffer 크기
 }
 
 /* 함수 원형: int (*listxattr) (const char *, char *, size_t) */
@@ -793,15 +1394,16 @@ static int myfs_getxattr(const char *path, const char *name, char *value, size_t
 */
 static int myfs_listxattr(const char *path, char *list, size_t size)
 {
-    int res = listxattr(path, list, size);
+    int res = llistxattr(path, list, size);
     if(res == -1)
         return -errno;
-    return 0;
+    return res; // 목록의 길이, size가 0이면 필요한 buffer 크기
 }
 
 /* 함수 원형: int (*removexattr) (const char *, const char *) */
 static int myfs_removexattr(const char *path, const char *name)
 {
+    watch_touch(path);
     int res = lremovexattr(path, name);
     if(res == -1)
         return -errno;
@@ -819,6 +1421,9 @@ static int myfs_removexattr(const char *path, const char *name)
     In canse this method is not implemented, applications are expected to fall back to a regular file copy.
     (Some glibc versions did this emulation automatically, but the emulation has been removed from
     all glibc release branches.)
+
+    실제 복사는 copy_range()가 한다 (my_passthrough_copy.h): reflink, copy_file_range, splice 순서로
+    시도하고, 요청 하나가 --copy-chunk보다 많이 복사하면 짧게 돌려준다.
 */
 #ifdef HAVE_COPY_FILE_RANGE
 static ssize_t myfs_copy_file_range(const char *path_in, 
@@ -827,22 +1432,31 @@ static ssize_t myfs_copy_file_range(const char *path_in,
                     struct fuse_file_info *fi_out,
                     off_t offset_out, size_t size, int flags)
 {
+    struct fdcache_entry *e_in = NULL, *e_out = NULL;
     int fd_in, fd_out;
     ssize_t res;
 
+    (void) flags; // 아직 정의된 flag가 없다
+    if(strcmp(path_in, STATS_PATH) == 0 || strcmp(path_out, STATS_PATH) == 0)
+        return -EOPNOTSUPP; // 복사하는 쪽이 read/write로 다시 시도한다
     if(fi_in == NULL)
-        fd_in = open(path_in, O_RDONLY);
-    else
-        fd_in = fi_in->fh;
-    if(fi_in == -1)
-        return -errno;
+        fd_in = fdcache_get(path_in, O_RDONLY, 0, &e_in);
+    else {
+        wbuf_flush(get_file(fi_in)->wb);
+        fd_in = get_fd(fi_in);
+    }
+    if(fd_in < 0)
+        return fd_in;
     if(fi_out == NULL)
-        fd_out = open(path_out, O_WRONLY);
-    else
-        fd_out = fi_out->fh;
-    if(fd_out == -1){
-        close(fd_in);
-        return -errno;
+        fd_out = fdcache_get(path_out, O_WRONLY, 0, &e_out);
+    else {
+        wbuf_flush(get_file(fi_out)->wb);
+        fd_out = get_fd(fi_out);
+    }
+    if(fd_out < 0){
+        if(fi_in == NULL)
+            fdcache_put(e_in, fd_in);
+        return fd_out;
     }
     /*
         #define _GNU_SOURCE
@@ -864,11 +1478,12 @@ static ssize_t myfs_copy_file_range(const char *path_in,
                            offset of fd_in is not changed, but off_in is adjusted appropriately.
                     
     */
-    res = copy_file_range(fd_in, &offset_in, fd_out, &offset_out, len, flags);
-    if(res == -1)
-        res = -errno;
-    close(fd_in);
-    close(fd_out);
+    res = copy_range(fd_in, offset_in, fd_out, offset_out, size);
+    /* fi_in/fi_out의 fd는 release가 닫는다 */
+    if(fi_in == NULL)
+        fdcache_put(e_in, fd_in);
+    if(fi_out == NULL)
+        fdcache_put(e_out, fd_out);
 
     return res;
 }
@@ -880,65 +1495,264 @@ static ssize_t myfs_copy_file_range(const char *path_in,
 */
 static off_t myfs_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi)
 {
+    struct fdcache_entry *e = NULL;
     int fd;
     off_t res;
 
+    if(strcmp(path, STATS_PATH) == 0) // SEEK_SET/CUR/END는 커널이 처리하고 여기에는 SEEK_DATA/HOLE만 온다
+        return -EINVAL;
     if(fi == NULL)
-        fd = open(path, O_RDONLY);
-    else
-        fd = fi->fh;
-    if(fd == -1)
-        return -errno;
+        fd = fdcache_get(path, O_RDONLY, 0, &e);
+    else {
+        wbuf_flush(get_file(fi)->wb);
+        fd = get_fd(fi);
+    }
+    if(fd < 0)
+        return fd;
     res = lseek(fd, off, whence);
     if(res == -1)
         res = -errno;
     if(fi == NULL)
-        close(fd);
+        fdcache_put(e, fd);
     return res;
 }
 
+/*
+ ** 요청 dispatch **
+    myfs_oper에는 handler를 직접 넣지 않고 아래 매크로가 만든 wrapper를 넣는다.
+    wrapper는 요청을 처리하는 worker를 세고(my_passthrough_workers.h) 원래 handler의
+    지연 시간, 에러, 옮긴 바이트 수를 기록하고(my_passthrough_stats.h) trace ring에 남긴다(myfs_trace.h).
+    DISPATCH_IO의 off와 bytes는 handler가 끝난 뒤 res를 가지고 계산되는 식이다.
+    모든 handler의 첫 번째 인자가 경로이므로 TRACE_PATH로 꺼낸다.
+*/
+#define TRACE_PATH(path, ...) path
+#define DISPATCH_IO(name, ret, params, args, off, bytes)                \
+    static ret dispatch_##name params                                   \
+    {                                                                   \
+        uint64_t start = 0;                                             \
+        ret res;                                                        \
+                                                                        \
+        worker_count();                                                 \
+        if(stats_enabled || trace_on(TRACE_ERRORS))                     \
+            start = stats_now();                                        \
+        res = myfs_##name args;                                         \
+        stats_end(STATS_##name, start, (bytes), res < 0);               \
+        trace_op(#name, TRACE_PATH args, (off), (bytes), start, res);   \
+        return res;                                                     \
+    }
+#define DISPATCH(name, ret, params, args) DISPATCH_IO(name, ret, params, args, 0, 0)
+
+DISPATCH(getattr, int, (const char *path, struct stat *st, struct fuse_file_info *fi), (path, st, fi))
+DISPATCH(access, int, (const char *path, int mask), (path, mask))
+DISPATCH(readlink, int, (const char *path, char *buf, size_t size), (path, buf, size))
+DISPATCH(opendir, int, (const char *path, struct fuse_file_info *fi), (path, fi))
+DISPATCH(readdir, int, (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+            struct fuse_file_info *fi, enum fuse_readdir_flags flags), (path, buf, filler, offset, fi, flags))
+DISPATCH(releasedir, int, (const char *path, struct fuse_file_info *fi), (path, fi))
+DISPATCH(mknod, int, (const char *path, mode_t mode, dev_t rdev), (path, mode, rdev))
+DISPATCH(mkdir, int, (const char *path, mode_t mode), (path, mode))
+DISPATCH(symlink, int, (const char *from, const char *to), (from, to))
+DISPATCH(unlink, int, (const char *path), (path))
+DISPATCH(rmdir, int, (const char *path), (path))
+DISPATCH(rename, int, (const char *from, const char *to, unsigned int flags), (from, to, flags))
+DISPATCH(link, int, (const char *from, const char *to), (from, to))
+DISPATCH(chmod, int, (const char *path, mode_t mode, struct fuse_file_info *fi), (path, mode, fi))
+DISPATCH(chown, int, (const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi), (path, uid, gid, fi))
+DISPATCH(truncate, int, (const char *path, off_t size, struct fuse_file_info *fi), (path, size, fi))
+#ifdef HAVE_UTIMENSAT
+DISPATCH(utimens, int, (const char *path, const struct timespec ts[2], struct fuse_file_info *fi), (path, ts, fi))
+#endif
+DISPATCH(open, int, (const char *path, struct fuse_file_info *fi), (path, fi))
+DISPATCH(create, int, (const char *path, mode_t mode, struct fuse_file_info *fi), (path, mode, fi))
+DISPATCH_IO(read, int, (const char *path, char *buf, size_t size, off_t offset,
+            struct fuse_file_info *fi), (path, buf, size, offset, fi), offset, res > 0 ? res : 0)
+DISPATCH_IO(write, int, (const char *path, const char *buf, size_t size, off_t offset,
+            struct fuse_file_info *fi), (path, buf, size, offset, fi), offset, res > 0 ? res : 0)
+DISPATCH_IO(read_buf, int, (const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+            struct fuse_file_info *fi), (path, bufp, size, offset, fi), offset,
+            res == 0 ? fuse_buf_size(*bufp) : 0)
+DISPATCH_IO(write_buf, int, (const char *path, struct fuse_bufvec *buf, off_t offset,
+            struct fuse_file_info *fi), (path, buf, offset, fi), offset, res > 0 ? res : 0)
+DISPATCH(statfs, int, (const char *path, struct statvfs *stbuf), (path, stbuf))
+DISPATCH(release, int, (const char *path, struct fuse_file_info *fi), (path, fi))
+DISPATCH(fsync, int, (const char *path, int isdatasync, struct fuse_file_info *fi), (path, isdatasync, fi))
+DISPATCH(flush, int, (const char *path, struct fuse_file_info *fi), (path, fi))
+DISPATCH(fsyncdir, int, (const char *path, int isdatasync, struct fuse_file_info *fi), (path, isdatasync, fi))
+#ifdef HAVE_POSIX_FALLOCATE
+DISPATCH(fallocate, int, (const char *path, int mode, off_t offset, off_t length,
+            struct fuse_file_info *fi), (path, mode, offset, length, fi))
+#endif
+#ifdef HAVE_SETXATTR
+DISPATCH(setxattr, int, (const char *path, const char *name, const char *value, size_t size,
+            int flags), (path, name, value, size, flags))
+DISPATCH(getxattr, int, (const char *path, const char *name, char *value, size_t size), (path, name, value, size))
+DISPATCH(listxattr, int, (const char *path, char *list, size_t size), (path, list, size))
+DISPATCH(removexattr, int, (const char *path, const char *name), (path, name))
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+DISPATCH_IO(copy_file_range, ssize_t, (const char *path_in, struct fuse_file_info *fi_in, off_t offset_in,
+            const char *path_out, struct fuse_file_info *fi_out, off_t offset_out, size_t size, int flags),
+            (path_in, fi_in, offset_in, path_out, fi_out, offset_out, size, flags),
+            offset_in, res > 0 ? res : 0)
+#endif
+DISPATCH(lseek, off_t, (const char *path, off_t off, int whence, struct fuse_file_info *fi), (path, off, whence, fi))
+
 static const struct fuse_operations myfs_oper = {
     .init       = myfs_init,
-    .getattr    = myfs_getattr,
-    .access     = myfs_access,
-    .readlink   = myfs_readlink,
-    .readdir    = myfs_readdir,
-    .mknod      = myfs_mknod,
-    .mkdir      = myfs_mkdir,
-    .symlink    = myfs_symlink,
-    .unlink     = myfs_unlink,
-    .rmdir      = myfs_rmdir,
-    .rename     = myfs_rename,
-    .link       = myfs_link,
-    .chmod      = myfs_chmod,
-    .chown      = myfs_chown,
-    .truncate   = myfs_truncate,
+    .getattr    = dispatch_getattr,
+    .access     = dispatch_access,
+    .readlink   = dispatch_readlink,
+    .opendir    = dispatch_opendir,
+    .readdir    = dispatch_readdir,
+    .releasedir = dispatch_releasedir,
+    .mknod      = dispatch_mknod,
+    .mkdir      = dispatch_mkdir,
+    .symlink    = dispatch_symlink,
+    .unlink     = dispatch_unlink,
+    .rmdir      = dispatch_rmdir,
+    .rename     = dispatch_rename,
+    .link       = dispatch_link,
+    .chmod      = dispatch_chmod,
+    .chown      = dispatch_chown,
+    .truncate   = dispatch_truncate,
 #ifdef HAVE_UTIMENSAT
-    .utimens    = myfs_utimens,
+    .utimens    = dispatch_utimens,
 #endif
-    .open       = myfs_open,
-    .create     = myfs_create,
-    .read       = myfs_read,
-    .write      = myfs_write,
-    .statfs     = myfs_statfs,
-    .release    = myfs_release,
-    .fsync      = myfs_fsync,
+    .open       = dispatch_open,
+    .create     = dispatch_create,
+    .read       = dispatch_read,
+    .write      = dispatch_write,
+    .read_buf   = dispatch_read_buf,
+    .write_buf  = dispatch_write_buf,
+    .statfs     = dispatch_statfs,
+    .release    = dispatch_release,
+    .fsync      = dispatch_fsync,
+    .flush      = dispatch_flush,
+    .fsyncdir   = dispatch_fsyncdir,
 #ifdef HAVE_POSIX_FALLOCATE
-    .fallocate  = myfs_fallocate,
+    .fallocate  = dispatch_fallocate,
 #endif
 #ifdef HAVE_SETXATTR
-    .setxattr   = myfs_setxattr,
-    .getxattr   = myfs_getxattr,
-    .listxattr  =myfs_listxattr,
-    .removexattr=myfs_removexattr,
+    .setxattr   = dispatch_setxattr,
+    .getxattr   = dispatch_getxattr,
+    .listxattr  = dispatch_listxattr,
+    .removexattr= dispatch_removexattr,
 #endif
 #ifdef HAVE_COPY_FILE_RANGE
-    .copy_file_range =  myfs_copy_file_range,
+    .copy_file_range = dispatch_copy_file_range,
 #endif
-    .lseek      = myfs_lseek,
+    .lseek      = dispatch_lseek,
 };
 
+/*
+    fuse_main()이 하는 일을 직접 풀어서 쓴다. multi-threaded loop의 worker 수,
+    idle worker 수, clone_fd를 정할 수 있게 하기 위해서이다.
+    -d는 디버그 출력 때문에 느리므로 성능 측정 시에는 -f만 사용한다.
+*/
 int main(int argc, char *argv[]){
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_operations oper = myfs_oper;
+    struct fuse_cmdline_opts opts;
+    struct fuse_loop_config *config;
+    struct fuse *fuse;
+    int ret = 1;
+
+    if(fuse_opt_parse(&args, &options, option_spec, NULL) == -1)
+        return 1;
+    if(fuse_parse_cmdline(&args, &opts) != 0)
+        return 1;
+    if(opts.show_version){
+        printf("FUSE library version %s\n", fuse_pkgversion());
+        fuse_lowlevel_version();
+        ret = 0;
+        goto out1;
+    }
+    if(opts.show_help){
+        printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+        fuse_cmdline_help();
+        fuse_lib_help(&args);
+        ret = 0;
+        goto out1;
+    }
+    if(opts.mountpoint == NULL){
+        fprintf(stderr, "usage: %s [options] <mountpoint>\n", argv[0]);
+        goto out1;
+    }
+
+    /* read_buf/write_buf가 있으면 libfuse는 read/write를 부르지 않는다 */
+    if(options.copy_io){
+        oper.read_buf = NULL;
+        oper.write_buf = NULL;
+    }
+    /* write buffer에 복사하려면 write()가 불려야 한다 */
+    if(options.write_buffer > 0){
+        oper.write_buf = NULL;
+        stats_add_extra(wbuf_format);
+    }
+    if(options.readahead > 0)
+        stats_add_extra(ra_format);
+#ifdef HAVE_COPY_FILE_RANGE
+    if(options.copy_chunk > 0)
+        copy_max = (size_t) options.copy_chunk << 20;
+    stats_add_extra(copy_format);
+#endif
+    if((options.direct_io != NULL && dio_parse(&dio_direct, options.direct_io) != 0) ||
+       (options.keep_cache != NULL && dio_parse(&dio_keep, options.keep_cache) != 0))
+        goto out1;
+    dio_backing = options.backing_direct;
+    stats_add_extra(dio_format);
+    if(options.trace_file != NULL && (trace_file = fopen(options.trace_file, "a")) == NULL){
+        perror(options.trace_file);
+        goto out1;
+    }
+    fdcache_max = options.fd_cache > 0 ? options.fd_cache : 0;
     umask(0);
-    return fuse_main(argc, argv, &myfs_oper, NULL);
+    fuse = fuse_new(&args, &oper, sizeof(oper), NULL);
+    if(fuse == NULL)
+        goto out1;
+    if(fuse_mount(fuse, opts.mountpoint) != 0)
+        goto out2;
+    if(fuse_daemonize(opts.foreground) != 0)
+        goto out3;
+    if(fuse_set_signal_handlers(fuse_get_session(fuse)) != 0)
+        goto out3;
+    stats_enabled = !options.no_stats;
+    if(stats_start_signal() != 0)
+        fprintf(stderr, "my_passthrough: cannot start the SIGUSR1 thread\n");
+    if(options.write_buffer > 0 &&
+       wbuf_start((size_t) options.write_buffer * 1024, options.write_flush_ms) != 0)
+        fprintf(stderr, "my_passthrough: cannot start the write buffer flusher, writes are not buffered\n");
+    if(options.readahead > 0 && ra_start((size_t) options.readahead * 1024) != 0)
+        fprintf(stderr, "my_passthrough: cannot start the prefetch threads, read-ahead is off\n");
+
+    if(opts.singlethread)
+        ret = fuse_loop(fuse);
+    else {
+        /* --workers, --idle-workers, --pin-workers가 -o max_threads, max_idle_threads, clone_fd보다 우선 */
+        if(options.workers > 0)
+            opts.max_threads = options.workers;
+        if(options.idle_workers >= 0)
+            opts.max_idle_threads = options.idle_workers;
+        if(options.pin_workers){
+            pin_workers = 1;
+            opts.clone_fd = 1; // worker마다 별도의 /dev/fuse fd
+        }
+        config = fuse_loop_cfg_create();
+        fuse_loop_cfg_set_clone_fd(config, opts.clone_fd);
+        fuse_loop_cfg_set_max_threads(config, opts.max_threads);
+        fuse_loop_cfg_set_idle_threads(config, opts.max_idle_threads);
+        ret = fuse_loop_mt(fuse, config);
+        fuse_loop_cfg_destroy(config);
+    }
+    worker_report(stderr);
+
+    fuse_remove_signal_handlers(fuse_get_session(fuse));
+out3:
+    fuse_unmount(fuse);
+out2:
+    fuse_destroy(fuse);
+out1:
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+    return ret ? 1 : 0;
 }
@@ -0,0 +1,177 @@
+/*
+ * Server-side copy for my_passthrough's copy_file_range
+ *
+ * A copy_file_range() on the mount reaches the daemon as one request, and
+ * the data should not have to travel through it. copy_range() tries, in
+ * order:
+ *
+ *  1. FICLONERANGE: on btrfs, xfs and other reflink file systems the
+ *     destination shares the source's extents, so the cost does not depend
+ *     on the size. Only whole blocks can be shared, the tail that is not
+ *     block aligned goes through the next step.
+ *  2. copy_file_range(2) in chunks of COPY_CHUNK. The kernel copies (or
+ *     offloads to NFS/SMB servers) without a round trip through user space.
+ *  3. splice(2) through a pipe, for file systems and kernels where
+ *     copy_file_range(2) refuses the pair (EXDEV, EINVAL, ...).
+ *
+ * Steps 2 and 3 move real data, so one request copies at most copy_max
+ * bytes (--copy-chunk) and returns the short count. The caller (cp, or the
+ * kernel's own loop) asks again for the rest, which keeps a 10 GB copy from
+ * holding a worker for its whole duration and lets other requests in
+ * between. Progress is visible in the counters of /.myfs_stats.
+ *
+ * reflink은 크기와 상관없이 메타데이터만 바꾸므로 copy_max 제한을 받지 않는다.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <linux/fs.h>               /* FICLONERANGE */
+#endif
+
+#define COPY_CHUNK (8 * 1024 * 1024)        /* one copy_file_range()/splice() call */
+#define COPY_PIPE_SIZE (1024 * 1024)
+
+static size_t copy_max = 64 * 1024 * 1024;  /* --copy-chunk, bytes of real copying per request */
+
+/* counters, printed in /.myfs_stats */
+static atomic_uint_fast64_t copy_calls;
+static atomic_uint_fast64_t copy_reflinked;     /* bytes shared with FICLONERANGE */
+static atomic_uint_fast64_t copy_offloaded;     /* bytes moved by copy_file_range(2) */
+static atomic_uint_fast64_t copy_spliced;       /* bytes moved through the pipe */
+static atomic_uint_fast64_t copy_short;         /* requests cut at copy_max */
+
+/* share whole blocks of [*off_in, +size) with *off_out; returns the bytes cloned */
+static size_t copy_reflink(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t size)
+{
+#ifdef FICLONERANGE
+    struct file_clone_range fcr;
+    struct stat st_in, st_out;
+    uint64_t len;
+
+    if(fstat(fd_in, &st_in) == -1 || fstat(fd_out, &st_out) == -1 || st_in.st_dev != st_out.st_dev)
+        return 0;
+    if(st_out.st_blksize <= 0 || *off_in % st_out.st_blksize != 0 || *off_out % st_out.st_blksize != 0)
+        return 0;
+    if(*off_in >= st_in.st_size)
+        return 0;
+    /* an unaligned length is only allowed when the range ends at the source's EOF */
+    if((uint64_t) *off_in + size >= (uint64_t) st_in.st_size)
+        len = st_in.st_size - *off_in;
+    else
+        len = size - size % st_out.st_blksize;
+    if(len == 0)
+        return 0;
+
+    fcr.src_fd = fd_in;
+    fcr.src_offset = *off_in;
+    fcr.src_length = len;
+    fcr.dest_offset = *off_out;
+    if(ioctl(fd_out, FICLONERANGE, &fcr) == -1)
+        return 0;                   /* EOPNOTSUPP, EXDEV, EINVAL, ...: copy instead */
+    *off_in += len;
+    *off_out += len;
+    atomic_fetch_add_explicit(&copy_reflinked, len, memory_order_relaxed);
+    return len;
+#else
+    (void) fd_in; (void) off_in; (void) fd_out; (void) off_out; (void) size;
+    return 0;
+#endif
+}
+
+/*
+   Move up to size bytes through a pipe; returns the bytes written or -errno.
+   The pipe lives for one request only: it costs three system calls next to
+   up to copy_max bytes of data, and a failed write cannot leave data behind
+   for the next request.
+*/
+static ssize_t copy_splice(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t size)
+{
+    size_t done = 0;
+    int p[2], err = 0;
+
+    if(pipe2(p, O_CLOEXEC) == -1)
+        return -errno;
+    fcntl(p[0], F_SETPIPE_SZ, COPY_PIPE_SIZE);
+    while(done < size && err == 0){
+        ssize_t n = splice(fd_in, off_in, p[1], NULL,
+                           size - done < COPY_PIPE_SIZE ? size - done : COPY_PIPE_SIZE, SPLICE_F_MOVE);
+        if(n == 0)
+            break;                  /* EOF */
+        if(n == -1){
+            err = errno;
+            break;
+        }
+        while(n > 0){
+            ssize_t m = splice(p[0], NULL, fd_out, off_out, n, SPLICE_F_MOVE);
+            if(m <= 0){
+                err = m == 0 ? EIO : errno;
+                break;
+            }
+            n -= m;
+            done += m;
+        }
+    }
+    close(p[0]);
+    close(p[1]);
+    atomic_fetch_add_explicit(&copy_spliced, done, memory_order_relaxed);
+    return done || err == 0 ? (ssize_t) done : -err;
+}
+
+/*
+   Copy size bytes from fd_in at off_in to fd_out at off_out. Returns the
+   bytes copied, which may be fewer than size (EOF, or the copy_max budget),
+   or -errno if nothing could be copied.
+*/
+static ssize_t copy_range(int fd_in, off_t off_in, int fd_out, off_t off_out, size_t size)
+{
+    size_t done, budget;
+    ssize_t n;
+
+    atomic_fetch_add_explicit(&copy_calls, 1, memory_order_relaxed);
+    done = copy_reflink(fd_in, &off_in, fd_out, &off_out, size);
+    if(done == size)
+        return done;
+
+    budget = size - done < copy_max ? size - done : copy_max;
+    if(budget < size - done)
+        atomic_fetch_add_explicit(&copy_short, 1, memory_order_relaxed);
+    for(size_t copied = 0; copied < budget; copied += n){
+        size_t chunk = budget - copied < COPY_CHUNK ? budget - copied : COPY_CHUNK;
+
+        n = copy_file_range(fd_in, &off_in, fd_out, &off_out, chunk, 0);
+        if(n == 0)
+            return done;            /* EOF */
+        if(n == -1){
+            if(errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+                return done ? (ssize_t) done : -errno;
+            /* the pair is not supported: the rest of the budget goes through the pipe */
+            n = copy_splice(fd_in, &off_in, fd_out, &off_out, budget - copied);
+            if(n < 0)
+                return done ? (ssize_t) done : n;
+            return done + n;
+        }
+        atomic_fetch_add_explicit(&copy_offloaded, n, memory_order_relaxed);
+        done += n;
+    }
+    return done;
+}
+
+/* snprintf() style, for the stats file */
+static int copy_format(char *buf, size_t size)
+{
+    if(atomic_load(&copy_calls) == 0)
+        return snprintf(buf, size, "%s", "");
+    return snprintf(buf, size, "copy_file_range: %llu requests, %llu bytes reflinked, %llu copied in kernel, "
+                    "%llu spliced, %llu requests cut at --copy-chunk\n",
+                    (unsigned long long) atomic_load(&copy_calls), (unsigned long long) atomic_load(&copy_reflinked),
+                    (unsigned long long) atomic_load(&copy_offloaded), (unsigned long long) atomic_load(&copy_spliced),
+                    (unsigned long long) atomic_load(&copy_short));
+}
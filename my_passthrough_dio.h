@@ -0,0 +1,194 @@
+/*
+ * Per-file cache modes for my_passthrough
+ *
+ * A file read through the mount is cached twice: in the page cache of the
+ * FUSE inode and in that of the backing file. For a multi-GB file that is
+ * streamed once both copies are wasted memory. Rules given at mount time
+ * decide per open() how a file is cached:
+ *
+ *   --direct-io=RULES   fi->direct_io: the kernel sends every read/write to
+ *                       the daemon, nothing is kept in the mount's page cache
+ *   --keep-cache=RULES  fi->keep_cache: cached pages survive the next open()
+ *   --backing-direct    direct_io files also get an O_DIRECT descriptor on
+ *                       the backing file, used for requests whose offset and
+ *                       size are DIO_ALIGN aligned, so the data is not cached
+ *                       on that side either
+ *
+ * RULES is a comma separated list. A rule is either a shell pattern that
+ * the path inside the mount is matched against with fnmatch() ('*' also
+ * matches '/'), or '>SIZE' for files larger than SIZE bytes (K, M and G
+ * suffixes), e.g. --direct-io='*.iso,*.mkv,>1G'.
+ *
+ * O_DIRECT는 buffer 주소도 정렬되어야 하므로, 요청 buffer가 정렬되어 있지 않으면
+ * DIO_ALIGN으로 정렬된 bounce buffer를 거친다.
+ */
+
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define DIO_ALIGN 4096      /* logical block size of every common block device, or a multiple of it */
+#define DIO_MAX_RULES 32
+
+struct dio_rule {
+    char *pattern;          /* NULL for a size rule */
+    off_t min_size;         /* size rule: files larger than this */
+};
+
+struct dio_rules {
+    int n;
+    struct dio_rule rule[DIO_MAX_RULES];
+};
+
+static struct dio_rules dio_direct, dio_keep;
+static int dio_backing;     /* --backing-direct */
+
+/* counters, printed in /.myfs_stats */
+static atomic_uint_fast64_t dio_direct_opens;       /* opens that got direct_io */
+static atomic_uint_fast64_t dio_keep_opens;         /* opens that got keep_cache */
+static atomic_uint_fast64_t dio_bytes;              /* bytes moved through a backing O_DIRECT fd */
+static atomic_uint_fast64_t dio_unaligned;          /* requests on such files that had to use the cached fd */
+
+/* "123", "64K", "512M", "1G" */
+static int dio_parse_size(const char *s, off_t *size)
+{
+    char *end;
+    long long v = strtoll(s, &end, 10);
+
+    if(end == s || v < 0)
+        return -1;
+    switch(*end){
+    case 'G': case 'g': v <<= 10; /* fall through */
+    case 'M': case 'm': v <<= 10; /* fall through */
+    case 'K': case 'k': v <<= 10; end++; break;
+    case '\0': break;
+    default: return -1;
+    }
+    if(*end != '\0')
+        return -1;
+    *size = v;
+    return 0;
+}
+
+/* parse a comma separated rule list; -1 on a malformed rule */
+static int dio_parse(struct dio_rules *rules, const char *spec)
+{
+    char *copy = strdup(spec), *save = NULL;
+
+    if(copy == NULL)
+        return -1;
+    for(char *tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)){
+        struct dio_rule *r;
+
+        if(rules->n == DIO_MAX_RULES){
+            fprintf(stderr, "too many rules in %s, at most %d\n", spec, DIO_MAX_RULES);
+            free(copy);
+            return -1;
+        }
+        r = &rules->rule[rules->n];
+        if(tok[0] == '>'){
+            if(dio_parse_size(tok + 1, &r->min_size) != 0){
+                fprintf(stderr, "bad size rule: %s\n", tok);
+                free(copy);
+                return -1;
+            }
+            r->pattern = NULL;
+        } else
+            r->pattern = strdup(tok);
+        rules->n++;
+    }
+    free(copy);
+    return 0;
+}
+
+/* does path, open as fd, match one of the rules */
+static int dio_match(const struct dio_rules *rules, const char *path, int fd)
+{
+    struct stat st;
+    int have_st = 0;
+
+    for(int i = 0; i < rules->n; i++){
+        const struct dio_rule *r = &rules->rule[i];
+
+        if(r->pattern != NULL){
+            if(fnmatch(r->pattern, path, 0) == 0)
+                return 1;
+            continue;
+        }
+        if(!have_st){
+            if(fstat(fd, &st) == -1)
+                continue;
+            have_st = 1;
+        }
+        if(S_ISREG(st.st_mode) && st.st_size > r->min_size)
+            return 1;
+    }
+    return 0;
+}
+
+/* can a request at off of size bytes go through the O_DIRECT fd */
+static inline int dio_aligned(off_t off, size_t size)
+{
+    return off % DIO_ALIGN == 0 && size % DIO_ALIGN == 0 && size != 0;
+}
+
+/* pread() from an O_DIRECT fd into any buffer; off and size must be aligned */
+static ssize_t dio_pread(int dfd, void *buf, size_t size, off_t off)
+{
+    void *bounce = buf;
+    ssize_t res;
+
+    if((uintptr_t) buf % DIO_ALIGN != 0 && posix_memalign(&bounce, DIO_ALIGN, size) != 0)
+        return -ENOMEM;
+    res = pread(dfd, bounce, size, off);
+    if(res == -1)
+        res = -errno;
+    else
+        atomic_fetch_add_explicit(&dio_bytes, res, memory_order_relaxed);
+    if(bounce != buf){
+        if(res > 0)
+            memcpy(buf, bounce, res);
+        free(bounce);
+    }
+    return res;
+}
+
+/* pwrite() to an O_DIRECT fd from any buffer; off and size must be aligned */
+static ssize_t dio_pwrite(int dfd, const void *buf, size_t size, off_t off)
+{
+    void *bounce = (void *) buf;
+    ssize_t res;
+
+    if((uintptr_t) buf % DIO_ALIGN != 0){
+        if(posix_memalign(&bounce, DIO_ALIGN, size) != 0)
+            return -ENOMEM;
+        memcpy(bounce, buf, size);
+    }
+    res = pwrite(dfd, bounce, size, off);
+    if(res == -1)
+        res = -errno;
+    else
+        atomic_fetch_add_explicit(&dio_bytes, res, memory_order_relaxed);
+    if(bounce != buf)
+        free(bounce);
+    return res;
+}
+
+/* snprintf() style, for the stats file */
+static int dio_format(char *buf, size_t size)
+{
+    if(dio_direct.n == 0 && dio_keep.n == 0)
+        return snprintf(buf, size, "%s", "");
+    return snprintf(buf, size, "cache modes: %llu direct_io opens, %llu keep_cache opens, "
+                    "%llu bytes through O_DIRECT, %llu unaligned requests\n",
+                    (unsigned long long) atomic_load(&dio_direct_opens),
+                    (unsigned long long) atomic_load(&dio_keep_opens),
+                    (unsigned long long) atomic_load(&dio_bytes),
+                    (unsigned long long) atomic_load(&dio_unaligned));
+}
@@ -0,0 +1,223 @@
+/*
+ * Cache of open file descriptors for my_passthrough
+ *
+ * Handlers that get no file handle (fi == NULL) used to open() the path,
+ * do one pread()/pwrite()/lseek() and close() it again. The cache keeps
+ * one descriptor per regular file, keyed by (st_dev, st_ino), so the next
+ * request for the same file only pays a stat(). Keying by inode instead
+ * of by path means a file that was renamed keeps its entry and a path
+ * that now names another file simply misses.
+ *
+ * The access mode is part of the key. open() only shares a descriptor
+ * opened with the same access mode it asks for, so the backing
+ * filesystem checks every open like open(2) would, and a file that is
+ * only read through the mount is never held open for writing. The
+ * handlers without a file handle may use an O_RDWR entry for reading or
+ * writing, and a write among them opens O_RDWR when it is allowed so the
+ * reads after it hit too. Entries are reference counted: an entry pushed
+ * out of the LRU list while a request still uses its descriptor is
+ * closed by the last fdcache_put().
+ *
+ * unlink()과 rename()으로 이름이 없어지는 inode는 캐시에서 지운다. 그렇지 않으면
+ * 캐시가 연 fd 때문에 지워진 파일의 공간이 반환되지 않는다. chmod()와 chown() 뒤에도
+ * 지워서 권한이 바뀐 파일을 예전 권한으로 연 fd로 쓰지 않게 한다.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define FDCACHE_BUCKETS 4096
+
+struct fdcache_entry {
+    struct fdcache_entry *hnext;            /* next entry in the same bucket */
+    struct fdcache_entry *prev, *next;      /* LRU list, most recently used first */
+    dev_t dev;
+    ino_t ino;
+    int fd;
+    int mode;                               /* O_RDONLY, O_WRONLY or O_RDWR, part of the key */
+    int refs;                               /* requests using fd right now */
+    int evicted;                            /* no longer in the cache, close on last put */
+};
+
+static size_t fdcache_max = 1024;           /* --fd-cache=N, 0 turns the cache off */
+static size_t fdcache_count;
+static struct fdcache_entry *fdcache_buckets[FDCACHE_BUCKETS];
+static struct fdcache_entry fdcache_lru = { .prev = &fdcache_lru, .next = &fdcache_lru };
+static pthread_mutex_t fdcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t fdcache_hash(dev_t dev, ino_t ino)
+{
+    uint64_t h = (uint64_t) ino * 0x9e3779b97f4a7c15ULL ^ (uint64_t) dev;
+    return (h >> 20) & (FDCACHE_BUCKETS - 1);
+}
+
+/* called with fdcache_lock held */
+static struct fdcache_entry *fdcache_find(dev_t dev, ino_t ino, int mode)
+{
+    struct fdcache_entry *e = fdcache_buckets[fdcache_hash(dev, ino)];
+    for(; e != NULL; e = e->hnext)
+        if(e->dev == dev && e->ino == ino && e->mode == mode)
+            return e;
+    return NULL;
+}
+
+/* take e out of the hash and LRU list; called with fdcache_lock held */
+static void fdcache_unlink(struct fdcache_entry *e)
+{
+    struct fdcache_entry **pp = &fdcache_buckets[fdcache_hash(e->dev, e->ino)];
+    while(*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    fdcache_count--;
+    if(e->refs == 0){
+        close(e->fd);
+        free(e);
+    } else
+        e->evicted = 1;
+}
+
+/* called with fdcache_lock held */
+static void fdcache_insert(struct fdcache_entry *e)
+{
+    size_t b = fdcache_hash(e->dev, e->ino);
+
+    e->hnext = fdcache_buckets[b];
+    fdcache_buckets[b] = e;
+    e->next = fdcache_lru.next;
+    e->prev = &fdcache_lru;
+    e->next->prev = e;
+    fdcache_lru.next = e;
+    fdcache_count++;
+    while(fdcache_count > fdcache_max)
+        fdcache_unlink(fdcache_lru.prev);
+}
+
+/*
+   Return a descriptor for path that can be used with flags' access mode,
+   or -errno. With exact (open()) it was opened with that access mode;
+   otherwise (handlers without a file handle) it may also be an O_RDWR
+   one. *ep is set to the cache entry the descriptor belongs to, or NULL
+   if it was opened just for this call (not a regular file, or the cache
+   is off). Either way hand it back with fdcache_put().
+*/
+static int fdcache_get(const char *path, int flags, int exact, struct fdcache_entry **ep)
+{
+    int mode = flags & O_ACCMODE;
+    struct fdcache_entry *e;
+    struct stat st;
+    int fd;
+
+    *ep = NULL;
+    if(fdcache_max == 0 || stat(path, &st) == -1 || !S_ISREG(st.st_mode)){
+        fd = open(path, flags);
+        return fd == -1 ? -errno : fd;
+    }
+
+    pthread_mutex_lock(&fdcache_lock);
+    e = fdcache_find(st.st_dev, st.st_ino, mode);
+    if(e == NULL && !exact && mode != O_RDWR)
+        e = fdcache_find(st.st_dev, st.st_ino, O_RDWR);
+    if(e != NULL){
+        e->refs++;
+        e->prev->next = e->next;            /* move to the front of the LRU list */
+        e->next->prev = e->prev;
+        e->next = fdcache_lru.next;
+        e->prev = &fdcache_lru;
+        e->next->prev = e;
+        fdcache_lru.next = e;
+        pthread_mutex_unlock(&fdcache_lock);
+        *ep = e;
+        return e->fd;
+    }
+    pthread_mutex_unlock(&fdcache_lock);
+
+    /* miss: open outside the lock, the backing filesystem may be slow */
+    fd = -1;
+    if(!exact && mode == O_WRONLY){
+        fd = open(path, O_RDWR);
+        if(fd == -1 && errno != EACCES && errno != EPERM)
+            return -errno;
+    }
+    if(fd == -1)
+        fd = open(path, mode);
+    if(fd == -1)
+        return -errno;
+    if(fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+        return fd;                          /* replaced since the stat(), don't cache it */
+
+    e = calloc(1, sizeof(*e));
+    if(e == NULL)
+        return fd;
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    e->fd = fd;
+    e->mode = fcntl(fd, F_GETFL) & O_ACCMODE;
+    e->refs = 1;
+
+    pthread_mutex_lock(&fdcache_lock);
+    struct fdcache_entry *old = fdcache_find(e->dev, e->ino, e->mode);
+    if(old != NULL)
+        fdcache_unlink(old);                /* another thread was faster */
+    fdcache_insert(e);
+    pthread_mutex_unlock(&fdcache_lock);
+    *ep = e;
+    return fd;
+}
+
+static void fdcache_put(struct fdcache_entry *e, int fd)
+{
+    if(e == NULL){
+        close(fd);
+        return;
+    }
+    pthread_mutex_lock(&fdcache_lock);
+    if(--e->refs == 0 && e->evicted){
+        close(e->fd);
+        free(e);
+    }
+    pthread_mutex_unlock(&fdcache_lock);
+}
+
+/* drop every entry of the inode of st; called with fdcache_lock held */
+static void fdcache_unlink_inode(const struct stat *st)
+{
+    static const int modes[] = { O_RDONLY, O_WRONLY, O_RDWR };
+    struct fdcache_entry *e;
+
+    for(size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+        if((e = fdcache_find(st->st_dev, st->st_ino, modes[i])) != NULL)
+            fdcache_unlink(e);
+}
+
+/* path is about to lose its name (unlink, rename target): drop its inode
+   unless it has other names */
+static void fdcache_evict_path(const char *path)
+{
+    struct stat st;
+
+    if(fdcache_max == 0 || lstat(path, &st) == -1 || !S_ISREG(st.st_mode))
+        return;
+    if(st.st_nlink > 1)
+        return;                             /* the inode lives on under another name */
+    pthread_mutex_lock(&fdcache_lock);
+    fdcache_unlink_inode(&st);
+    pthread_mutex_unlock(&fdcache_lock);
+}
+
+/* the permissions of path changed (chmod, chown): its descriptors were
+   opened under the old ones */
+static void fdcache_evict_inode(const char *path)
+{
+    struct stat st;
+
+    if(fdcache_max == 0 || stat(path, &st) == -1 || !S_ISREG(st.st_mode))
+        return;
+    pthread_mutex_lock(&fdcache_lock);
+    fdcache_unlink_inode(&st);
+    pthread_mutex_unlock(&fdcache_lock);
+}
@@ -0,0 +1,1174 @@
+/*
+    FUSE: Filesystem in USErspace
+*/
+
+/*
+ *
+ * my_passthrough.c의 low-level API 버전
+ *
+ * my_passthrough.c gets a full path for every request and resolves it again
+ * with lstat(path), open(path), opendir(path), ... and the high-level
+ * library keeps its own path tree that is locked on every call.
+ *
+ * This version talks to the kernel with the low-level API (fuse_lowlevel_ops).
+ * The kernel refers to files by inode number, and every inode the kernel
+ * knows about is kept in a hash table keyed by (st_dev, st_ino) together
+ * with an O_PATH file descriptor and a lookup count. Operations use the
+ * *at() system calls relative to the fd of the parent directory, so a
+ * request costs one component lookup no matter how deep the file is, and
+ * rename does not need a global lock on a path tree.
+ *
+ * Compile with
+ *
+ * cmake -S . -B build && cmake --build build
+ *
+ * which probes for the HAVE_* features below, or by hand
+ *
+ * gcc -Wall my_passthrough_ll.c `pkg-config fuse3 --cflags --libs` -o my_passthrough_ll
+ *
+ * Options
+ *
+ * --source=DIR             directory to mirror (default /)
+ * --entry-timeout=SECS     name lookup cache timeout (default 0)
+ * --attr-timeout=SECS      attribute cache timeout (default 0)
+ * --io=sync|uring          I/O engine for read/write/fsync/fallocate (default sync)
+ * --io-rings=N             io_uring rings, each with its own completion thread (default 1)
+ * --io-depth=N             submission queue entries per ring (default 256)
+ * --passthrough            let the kernel read and write regular files directly
+ *                          (FUSE passthrough, Linux 6.9 and libfuse 3.16 or later)
+ *
+ * The io_uring engine needs liburing:
+ *
+ * gcc -Wall -DHAVE_LIBURING my_passthrough_ll.c `pkg-config fuse3 liburing --cflags --libs` -o my_passthrough_ll
+ *
+ * ## Source code ##
+ * \include my_passthrough_ll.c
+ */
+
+#define FUSE_USE_VERSION 312
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+
+#ifdef __FreeBSD__
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#ifdef HAVE_SETXATTR
+#include <sys/xattr.h>
+#endif
+
+#include "my_passthrough_helpers.h"
+#include "my_passthrough_uring.h"
+
+/*
+ ** inode 테이블 **
+    커널이 알고 있는 파일마다 하나씩 존재한다. fuse_ino_t로는 이 구조체의 주소를 그대로 넘기고,
+    커널이 forget()으로 lookup count를 0으로 만들면 fd를 닫고 테이블에서 지운다.
+*/
+struct myfs_inode {
+    struct myfs_inode *next; // 같은 bucket의 다음 inode
+    int fd;                  // O_PATH fd, *at() 시스템콜의 기준 디렉토리로 사용
+    dev_t dev;
+    ino_t ino;
+    uint64_t nlookup;        // lookup count, protected by myfs_data.mutex
+    int backing_id;          // kernel passthrough backing file, protected by passthrough_lock
+    unsigned int backing_refs; // open handles using backing_id
+    int backing_writable;    // the backing file was opened O_RDWR
+};
+
+struct myfs_dirp {
+    DIR *dp;
+    struct dirent *entry;
+    off_t offset;
+};
+
+static struct myfs_data {
+    pthread_mutex_t mutex;   // protects the hash table and the lookup counts only
+    struct myfs_inode root;
+    struct myfs_inode **buckets;
+    size_t nbuckets;
+    size_t count;
+} data = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .root = { .fd = -1 },
+};
+
+static struct myfs_options {
+    const char *source;
+    double entry_timeout;
+    double attr_timeout;
+    const char *io;
+    int io_rings;
+    int io_depth;
+    int passthrough;
+} options = {
+    .source = "/",
+    .io = "sync",
+    .io_rings = 1,
+    .io_depth = 256,
+};
+
+#define OPTION(t, p) { t, offsetof(struct myfs_options, p), 1 }
+static const struct fuse_opt option_spec[] = {
+    OPTION("--source=%s", source),
+    OPTION("--entry-timeout=%lf", entry_timeout),
+    OPTION("--attr-timeout=%lf", attr_timeout),
+    OPTION("--io=%s", io),
+    OPTION("--io-rings=%d", io_rings),
+    OPTION("--io-depth=%d", io_depth),
+    OPTION("--passthrough", passthrough),
+    FUSE_OPT_END
+};
+
+static struct myfs_inode *myfs_inode(fuse_ino_t ino)
+{
+    if(ino == FUSE_ROOT_ID)
+        return &data.root;
+    return (struct myfs_inode *) (uintptr_t) ino;
+}
+
+static int myfs_fd(fuse_ino_t ino)
+{
+    return myfs_inode(ino)->fd;
+}
+
+/* O_PATH fd로는 read/write/chmod 등을 할 수 없으므로 /proc/self/fd/N 경로로 다시 연다. */
+static void proc_path(char *buf, size_t size, int fd)
+{
+    snprintf(buf, size, "/proc/self/fd/%i", fd);
+}
+
+static size_t inode_hash(dev_t dev, ino_t ino)
+{
+    uint64_t h = (uint64_t) ino * 0x9e3779b97f4a7c15ULL ^ (uint64_t) dev;
+    return (h ^ (h >> 29)) & (data.nbuckets - 1);
+}
+
+/* called with data.mutex held */
+static struct myfs_inode *inode_find(dev_t dev, ino_t ino)
+{
+    struct myfs_inode *inode = data.buckets[inode_hash(dev, ino)];
+    for(; inode != NULL; inode = inode->next)
+        if(inode->ino == ino && inode->dev == dev)
+            return inode;
+    return NULL;
+}
+
+/* called with data.mutex held; doubling keeps chains short */
+static void inode_insert(struct myfs_inode *inode)
+{
+    if(data.count >= data.nbuckets){
+        size_t n = data.nbuckets * 2;
+        struct myfs_inode **b = calloc(n, sizeof(*b));
+        if(b != NULL){
+            struct myfs_inode **old = data.buckets;
+            size_t old_n = data.nbuckets;
+            data.buckets = b;
+            data.nbuckets = n;
+            for(size_t i = 0; i < old_n; i++){
+                struct myfs_inode *p = old[i], *next;
+                for(; p != NULL; p = next){
+                    next = p->next;
+                    size_t h = inode_hash(p->dev, p->ino);
+                    p->next = b[h];
+                    b[h] = p;
+                }
+            }
+            free(old);
+        }
+    }
+    size_t h = inode_hash(inode->dev, inode->ino);
+    inode->next = data.buckets[h];
+    data.buckets[h] = inode;
+    data.count++;
+}
+
+/* called with data.mutex held */
+static void inode_remove(struct myfs_inode *inode)
+{
+    struct myfs_inode **pp = &data.buckets[inode_hash(inode->dev, inode->ino)];
+    while(*pp != inode)
+        pp = &(*pp)->next;
+    *pp = inode->next;
+    data.count--;
+}
+
+static void unref_inode(struct myfs_inode *inode, uint64_t n)
+{
+    if(inode == &data.root)
+        return;
+    pthread_mutex_lock(&data.mutex);
+    inode->nlookup -= n;
+    if(inode->nlookup == 0){
+        inode_remove(inode);
+        pthread_mutex_unlock(&data.mutex);
+        close(inode->fd);
+        free(inode);
+        return;
+    }
+    pthread_mutex_unlock(&data.mutex);
+}
+
+/*
+    parent 디렉토리 안의 name을 찾아서 inode 테이블에 등록(이미 있으면 lookup count 증가)하고
+    reply에 쓸 fuse_entry_param을 채운다. 실패하면 errno를 리턴한다.
+*/
+static int do_lookup(fuse_ino_t parent, const char *name, struct fuse_entry_param *e)
+{
+    int fd;
+    struct myfs_inode *inode, *found;
+
+    memset(e, 0, sizeof(*e));
+    e->attr_timeout = options.attr_timeout;
+    e->entry_timeout = options.entry_timeout;
+
+    fd = openat(myfs_fd(parent), name, O_PATH | O_NOFOLLOW);
+    if(fd == -1)
+        return errno;
+    if(fstatat(fd, "", &e->attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1){
+        int err = errno;
+        close(fd);
+        return err;
+    }
+
+    pthread_mutex_lock(&data.mutex);
+    found = inode_find(e->attr.st_dev, e->attr.st_ino);
+    if(found != NULL){
+        found->nlookup++;
+        pthread_mutex_unlock(&data.mutex);
+        close(fd);
+        e->ino = (uintptr_t) found;
+        return 0;
+    }
+    inode = calloc(1, sizeof(*inode));
+    if(inode == NULL){
+        pthread_mutex_unlock(&data.mutex);
+        close(fd);
+        return ENOMEM;
+    }
+    inode->fd = fd;
+    inode->dev = e->attr.st_dev;
+    inode->ino = e->attr.st_ino;
+    inode->nlookup = 1;
+    inode_insert(inode);
+    pthread_mutex_unlock(&data.mutex);
+
+    e->ino = (uintptr_t) inode;
+    return 0;
+}
+
+/*
+ ** kernel passthrough **
+    With --passthrough the daemon registers a backing file with the kernel when a
+    regular file is opened (fuse_passthrough_open) and returns its id in
+    fi->backing_id. read, write, splice and mmap on that handle then go from the
+    FUSE inode straight to the backing file; the daemon still sees open, release,
+    fsync, setattr and the other metadata requests.
+
+    The kernel allows one backing file per inode at a time, and a handle that uses
+    the page cache of the FUSE inode cannot be open next to a passthrough one. So
+    the backing file belongs to the inode and is shared by all its handles, and it
+    is opened O_RDWR whenever the permissions allow it. A handle that cannot use
+    it (a write open when only O_RDONLY worked, or a failed registration) is
+    opened direct_io and served by the userspace handlers below.
+
+    release에는 backing_id가 오지 않으므로 어떤 fd가 passthrough인지는 passthrough_fds에 기록한다.
+*/
+static int passthrough_on;          // --passthrough and the kernel supports it
+static pthread_mutex_t passthrough_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char *passthrough_fds;  // indexed by fd, 1 if the handle holds a backing_refs
+static size_t passthrough_nfds;
+
+#ifdef FUSE_CAP_PASSTHROUGH
+/* called with passthrough_lock held; returns the inode's backing id or 0 */
+static int backing_get(fuse_req_t req, struct myfs_inode *inode)
+{
+    if(inode->backing_refs == 0){
+        char procname[64];
+        int fd, id, writable = 1;
+
+        proc_path(procname, sizeof(procname), inode->fd);
+        fd = open(procname, O_RDWR);
+        if(fd == -1 && (errno == EACCES || errno == EPERM || errno == EROFS || errno == ETXTBSY)){
+            fd = open(procname, O_RDONLY);
+            writable = 0;
+        }
+        if(fd == -1)
+            return 0;
+        /* the kernel takes its own reference on the file */
+        id = fuse_passthrough_open(req, fd);
+        close(fd);
+        if(id <= 0)
+            return 0;
+        inode->backing_id = id;
+        inode->backing_writable = writable;
+    }
+    inode->backing_refs++;
+    return inode->backing_id;
+}
+
+/* called with passthrough_lock held */
+static void backing_put(fuse_req_t req, struct myfs_inode *inode)
+{
+    if(--inode->backing_refs == 0){
+        fuse_passthrough_close(req, inode->backing_id);
+        inode->backing_id = 0;
+    }
+}
+#endif
+
+/* decide how the new handle fi (fd in fi->fh) of ino is served, before fuse_reply_open/create */
+static void passthrough_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+#ifdef FUSE_CAP_PASSTHROUGH
+    struct myfs_inode *inode = myfs_inode(ino);
+    int writing = (fi->flags & O_ACCMODE) != O_RDONLY;
+
+    if(!passthrough_on)
+        return;
+    pthread_mutex_lock(&passthrough_lock);
+    if(fi->fh < passthrough_nfds && backing_get(req, inode) > 0){
+        if(!writing || inode->backing_writable){
+            fi->backing_id = inode->backing_id;
+            passthrough_fds[fi->fh] = 1;
+            pthread_mutex_unlock(&passthrough_lock);
+            return;
+        }
+        backing_put(req, inode);
+    }
+    pthread_mutex_unlock(&passthrough_lock);
+    fi->direct_io = 1;
+#else
+    (void) req; (void) ino; (void) fi;
+#endif
+}
+
+static void passthrough_release(fuse_req_t req, fuse_ino_t ino, int fd)
+{
+#ifdef FUSE_CAP_PASSTHROUGH
+    if((size_t) fd >= passthrough_nfds || !passthrough_fds[fd])
+        return;
+    pthread_mutex_lock(&passthrough_lock);
+    passthrough_fds[fd] = 0;
+    backing_put(req, myfs_inode(ino));
+    pthread_mutex_unlock(&passthrough_lock);
+#else
+    (void) req; (void) ino; (void) fd;
+#endif
+}
+
+/* 함수 원형: void (*init) (void *userdata, struct fuse_conn_info *conn) */
+static void myfs_init(void *userdata, struct fuse_conn_info *conn)
+{
+    (void) userdata;
+    if(conn->capable & FUSE_CAP_FLOCK_LOCKS)
+        conn->want |= FUSE_CAP_FLOCK_LOCKS;
+    if(uring_on){
+        /* write data has to be copied into a ring buffer anyway, a pipe would only add a step */
+        conn->want &= ~FUSE_CAP_SPLICE_READ;
+        /* let the kernel send as many async requests as the rings can take */
+        if(conn->max_background < (unsigned int) options.io_depth)
+            conn->max_background = options.io_depth;
+    }
+#ifdef FUSE_CAP_PASSTHROUGH
+    if(options.passthrough && passthrough_fds != NULL && (conn->capable & FUSE_CAP_PASSTHROUGH)){
+        conn->want |= FUSE_CAP_PASSTHROUGH;
+        /* the backing files are on an ordinary file system, one level below us */
+        conn->max_backing_stack_depth = 1;
+        passthrough_on = 1;
+    }
+#endif
+    if(options.passthrough && !passthrough_on)
+        fprintf(stderr, "kernel passthrough is not supported, read/write go through the daemon\n");
+}
+
+/* 함수 원형: void (*destroy) (void *userdata) */
+static void myfs_destroy(void *userdata)
+{
+    (void) userdata;
+    pthread_mutex_lock(&data.mutex);
+    for(size_t i = 0; i < data.nbuckets; i++){
+        struct myfs_inode *inode = data.buckets[i], *next;
+        for(; inode != NULL; inode = next){
+            next = inode->next;
+            if(inode == &data.root)
+                continue; // closed in main()
+            close(inode->fd);
+            free(inode);
+        }
+        data.buckets[i] = NULL;
+    }
+    data.count = 0;
+    pthread_mutex_unlock(&data.mutex);
+}
+
+/* 함수 원형: void (*lookup) (fuse_req_t req, fuse_ino_t parent, const char *name) */
+/* Look up a directory entry by name and get its attributes. */
+static void myfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct fuse_entry_param e;
+    int err = do_lookup(parent, name, &e);
+
+    if(err == ENOENT && options.entry_timeout > 0){
+        /* ino 0 means a negative entry that the kernel may cache */
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = options.entry_timeout;
+        fuse_reply_entry(req, &e);
+    } else if(err)
+        fuse_reply_err(req, err);
+    else
+        fuse_reply_entry(req, &e);
+}
+
+/* 함수 원형: void (*forget) (fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) */
+/* 커널이 inode를 캐시에서 내보낼 때 호출된다. lookup count가 0이 되면 O_PATH fd를 닫는다. */
+static void myfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+    unref_inode(myfs_inode(ino), nlookup);
+    fuse_reply_none(req);
+}
+
+static void myfs_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+    for(size_t i = 0; i < count; i++)
+        unref_inode(myfs_inode(forgets[i].ino), forgets[i].nlookup);
+    fuse_reply_none(req);
+}
+
+/* 함수 원형: void (*getattr) (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) */
+static void myfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct stat st;
+    (void) fi;
+
+    if(fstatat(myfs_fd(ino), "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1)
+        return (void) fuse_reply_err(req, errno);
+    fuse_reply_attr(req, &st, options.attr_timeout);
+}
+
+/* 함수 원형: void (*setattr) (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) */
+/*
+    high-level API의 chmod, chown, truncate, utimens를 하나로 합친 것.
+    to_set에 어떤 속성을 바꿔야 하는지가 FUSE_SET_ATTR_* 비트로 들어온다.
+*/
+static void myfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+            int valid, struct fuse_file_info *fi)
+{
+    int ifd = myfs_fd(ino);
+    char procname[64];
+    int res;
+
+    proc_path(procname, sizeof(procname), ifd);
+    if(valid & FUSE_SET_ATTR_MODE){
+        if(fi)
+            res = fchmod(fi->fh, attr->st_mode);
+        else
+            res = chmod(procname, attr->st_mode);
+        if(res == -1)
+            goto out_err;
+    }
+    if(valid & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)){
+        uid_t uid = (valid & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1;
+        gid_t gid = (valid & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1;
+
+        res = fchownat(ifd, "", uid, gid, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+        if(res == -1)
+            goto out_err;
+    }
+    if(valid & FUSE_SET_ATTR_SIZE){
+        if(fi)
+            res = ftruncate(fi->fh, attr->st_size);
+        else
+            res = truncate(procname, attr->st_size);
+        if(res == -1)
+            goto out_err;
+    }
+    if(valid & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)){
+        struct timespec tv[2];
+
+        tv[0].tv_sec = 0;
+        tv[1].tv_sec = 0;
+        tv[0].tv_nsec = UTIME_OMIT;
+        tv[1].tv_nsec = UTIME_OMIT;
+
+        if(valid & FUSE_SET_ATTR_ATIME_NOW)
+            tv[0].tv_nsec = UTIME_NOW;
+        else if(valid & FUSE_SET_ATTR_ATIME)
+            tv[0] = attr->st_atim;
+        if(valid & FUSE_SET_ATTR_MTIME_NOW)
+            tv[1].tv_nsec = UTIME_NOW;
+        else if(valid & FUSE_SET_ATTR_MTIME)
+            tv[1] = attr->st_mtim;
+
+        if(fi)
+            res = futimens(fi->fh, tv);
+        else
+            res = utimensat(AT_FDCWD, procname, tv, 0);
+        if(res == -1)
+            goto out_err;
+    }
+    return myfs_getattr(req, ino, fi);
+
+out_err:
+    fuse_reply_err(req, errno);
+}
+
+/* 함수 원형: void (*readlink) (fuse_req_t req, fuse_ino_t ino) */
+static void myfs_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+    char buf[PATH_MAX + 1];
+    ssize_t res;
+
+    res = readlinkat(myfs_fd(ino), "", buf, sizeof(buf));
+    if(res == -1)
+        return (void) fuse_reply_err(req, errno);
+    if(res == sizeof(buf))
+        return (void) fuse_reply_err(req, ENAMETOOLONG);
+    buf[res] = '\0';
+    fuse_reply_readlink(req, buf);
+}
+
+/* mknod, mkdir, symlink의 공통 부분: parent 디렉토리 fd 기준으로 만들고 lookup 결과로 응답 */
+static void make_node(fuse_req_t req, fuse_ino_t parent, const char *name,
+            mode_t mode, dev_t rdev, const char *link)
+{
+    struct fuse_entry_param e;
+    int err;
+
+    if(mknod_wrapper(myfs_fd(parent), name, link, mode, rdev) == -1)
+        return (void) fuse_reply_err(req, errno);
+    err = do_lookup(parent, name, &e);
+    if(err)
+        fuse_reply_err(req, err);
+    else
+        fuse_reply_entry(req, &e);
+}
+
+/* 함수 원형: void (*mknod) (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) */
+static void myfs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+            mode_t mode, dev_t rdev)
+{
+    make_node(req, parent, name, mode, rdev, NULL);
+}
+
+/* 함수 원형: void (*mkdir) (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) */
+static void myfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    make_node(req, parent, name, S_IFDIR | mode, 0, NULL);
+}
+
+/* 함수 원형: void (*symlink) (fuse_req_t req, const char *link, fuse_ino_t parent, const char *name) */
+static void myfs_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
+{
+    make_node(req, parent, name, S_IFLNK, 0, link);
+}
+
+/* 함수 원형: void (*link) (fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname) */
+static void myfs_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t parent, const char *name)
+{
+    struct myfs_inode *inode = myfs_inode(ino);
+    struct fuse_entry_param e;
+    char procname[64];
+
+    proc_path(procname, sizeof(procname), inode->fd);
+    if(linkat(AT_FDCWD, procname, myfs_fd(parent), name, AT_SYMLINK_FOLLOW) == -1)
+        return (void) fuse_reply_err(req, errno);
+
+    memset(&e, 0, sizeof(e));
+    e.attr_timeout = options.attr_timeout;
+    e.entry_timeout = options.entry_timeout;
+    if(fstatat(inode->fd, "", &e.attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1)
+        return (void) fuse_reply_err(req, errno);
+
+    pthread_mutex_lock(&data.mutex);
+    inode->nlookup++;
+    pthread_mutex_unlock(&data.mutex);
+    e.ino = (uintptr_t) inode;
+    fuse_reply_entry(req, &e);
+}
+
+/* 함수 원형: void (*unlink) (fuse_req_t req, fuse_ino_t parent, const char *name) */
+static void myfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    if(unlinkat(myfs_fd(parent), name, 0) == -1)
+        return (void) fuse_reply_err(req, errno);
+    fuse_reply_err(req, 0);
+}
+
+/* 함수 원형: void (*rmdir) (fuse_req_t req, fuse_ino_t parent, const char *name) */
+static void myfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    if(unlinkat(myfs_fd(parent), name, AT_REMOVEDIR) == -1)
+        return (void) fuse_reply_err(req, errno);
+    fuse_reply_err(req, 0);
+}
+
+/* 함수 원형: void (*rename) (fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname, unsigned int flags) */
+/*
+    두 디렉토리의 fd를 기준으로 renameat2()를 호출한다. 경로 트리가 없으므로
+    전역 lock 없이 커널(하위 파일시스템)이 원자성을 보장한다.
+    RENAME_EXCHANGE, RENAME_NOREPLACE도 그대로 넘긴다.
+*/
+static void myfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+            fuse_ino_t newparent, const char *newname, unsigned int flags)
+{
+    int res;
+
+    if(flags)
+        res = renameat2(myfs_fd(parent), name, myfs_fd(newparent), newname, flags);
+    else
+        res = renameat(myfs_fd(parent), name, myfs_fd(newparent), newname);
+    if(res == -1)
+        return (void) fuse_reply_err(req, errno);
+    fuse_reply_err(req, 0);
+}
+
+/* 함수 원형: void (*opendir) (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) */
+static void myfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct myfs_dirp *d;
+    int fd;
+
+    d = calloc(1, sizeof(*d));
+    if(d == NULL)
+        return (void) fuse_reply_err(req, ENOMEM);
+    fd = openat(myfs_fd(ino), ".", O_RDONLY | O_DIRECTORY);
+    if(fd == -1)
+        goto out_errno;
+    d->dp = fdopendir(fd);
+    if(d->dp == NULL){
+        close(fd);
+        goto out_errno;
+    }
+    fi->fh = (uintptr_t) d;
+    fuse_reply_open(req, fi);
+    return;
+
+out_errno:
+    fuse_reply_err(req, errno);
+    free(d);
+}
+
+/* readdir과 readdirplus의 공통 부분. offset은 telldir() 값을 그대로 커널에 넘겨 이어 읽기에 사용한다. */
+static void do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+            off_t offset, struct fuse_file_info *fi, int plus)
+{
+    struct myfs_dirp *d = (struct myfs_dirp *) (uintptr_t) fi->fh;
+    char *buf, *p;
+    size_t rem = size;
+    int err = 0;
+    (void) ino;
+
+    buf = malloc(size);
+    if(buf == NULL)
+        return (void) fuse_reply_err(req, ENOMEM);
+    p = buf;
+
+    if(offset != d->offset){
+        seekdir(d->dp, offset);
+        d->entry = NULL;
+        d->offset = offset;
+    }
+    for(;;){
+        size_t entsize;
+        off_t nextoff;
+        const char *name;
+
+        if(d->entry == NULL){
+            errno = 0;
+            d->entry = readdir(d->dp);
+            if(d->entry == NULL){
+                err = errno; // 0이면 디렉토리 끝
+                break;
+            }
+        }
+        nextoff = telldir(d->dp);
+        name = d->entry->d_name;
+        if(plus){
+            struct fuse_entry_param e;
+
+            if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0){
+                memset(&e, 0, sizeof(e));
+                e.attr.st_ino = d->entry->d_ino;
+                e.attr.st_mode = d->entry->d_type << 12;
+            } else {
+                err = do_lookup(ino, name, &e);
+                if(err)
+                    break;
+            }
+            entsize = fuse_add_direntry_plus(req, p, rem, name, &e, nextoff);
+            if(entsize > rem){
+                /* 버퍼가 꽉 참: 커널은 이 entry를 받지 못했으므로 lookup count를 되돌린다 */
+                if(e.ino != 0)
+                    unref_inode(myfs_inode(e.ino), 1);
+                break;
+            }
+        } else {
+            struct stat st;
+
+            memset(&st, 0, sizeof(st));
+            st.st_ino = d->entry->d_ino;
+            st.st_mode = d->entry->d_type << 12;
+            entsize = fuse_add_direntry(req, p, rem, name, &st, nextoff);
+            if(entsize > rem)
+                break;
+        }
+        p += entsize;
+        rem -= entsize;
+        d->entry = NULL;
+        d->offset = nextoff;
+    }
+
+    /* 일부라도 채웠다면 에러 대신 채운 만큼 돌려준다 */
+    if(err && rem == size)
+        fuse_reply_err(req, err);
+    else
+        fuse_reply_buf(req, buf, size - rem);
+    free(buf);
+}
+
+/* 함수 원형: void (*readdir) (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) */
+static void myfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+            off_t offset, struct fuse_file_info *fi)
+{
+    do_readdir(req, ino, size, offset, fi, 0);
+}
+
+/* 함수 원형: void (*readdirplus) (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) */
+/* readdir과 같지만 entry마다 lookup 결과(속성)까지 채워서 ls -l이 getattr을 따로 부르지 않게 한다. */
+static void myfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+            off_t offset, struct fuse_file_info *fi)
+{
+    do_readdir(req, ino, size, offset, fi, 1);
+}
+
+/* 함수 원형: void (*releasedir) (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) */
+static void myfs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct myfs_dirp *d = (struct myfs_dirp *) (uintptr_t) fi->fh;
+    (void) ino;
+
+    closedir(d->dp);
+    free(d);
+    fuse_reply_err(req, 0);
+}
+
+/* 함수 원형: void (*fsyncdir) (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) */
+static void myfs_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+    struct myfs_dirp *d = (struct myfs_dirp *) (uintptr_t) fi->fh;
+    int fd = dirfd(d->dp);
+    int res;
+    (void) ino;
+
+    res = datasync ? fdatasync(fd) : fsync(fd);
+    fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+/* 함수 원형: void (*create) (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) */
+static void myfs_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+            mode_t mode, struct fuse_file_info *fi)
+{
+    struct fuse_entry_param e;
+    int fd, err;
+
+    fd = openat(myfs_fd(parent), name, (fi->flags | O_CREAT) & ~O_NOFOLLOW, mode);
+    if(fd == -1)
+        return (void) fuse_reply_err(req, errno);
+    fi->fh = fd;
+
+    err = do_lookup(parent, name, &e);
+    if(err){
+        close(fd);
+        fuse_reply_err(req, err);
+    } else {
+        passthrough_open(req, e.ino, fi);
+        uring_add_fd(fd);
+        fuse_reply_create(req, &e, fi);
+    }
+}
+
+/* 함수 원형: void (*open) (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) */
+/* O_PATH fd는 읽기/쓰기를 할 수 없으므로 /proc/self/fd/N을 통해 fi->flags로 다시 연다. */
+static void myfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    char procname[64];
+    int fd;
+
+    proc_path(procname, sizeof(procname), myfs_fd(ino));
+    fd = open(procname, fi->flags & ~O_NOFOLLOW);
+    if(fd == -1)
+        return (void) fuse_reply_err(req, errno);
+    fi->fh = fd;
+    passthrough_open(req, ino, fi);
+    uring_add_fd(fd);
+    fuse_reply_open(req, fi);
+}
+
+/* 함수 원형: void (*release) (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) */
+static void myfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    passthrough_release(req, ino, fi->fh);
+    uring_del_fd(fi->fh);
+    close(fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+/* 함수 원형: void (*flush) (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) */
+/* close()가 호출될 때마다 불린다. dup한 fd를 닫아서 하위 파일시스템의 flush 동작을 그대로 흉내낸다. */
+static void myfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    int res;
+    (void) ino;
+
+    res = close(dup(fi->fh));
+    fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+/* 함수 원형: void (*fsync) (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) */
+static void myfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+    int res;
+    (void) ino;
+
+    if(uring_fsync(req, fi->fh, datasync) == 0)
+        return;
+    res = datasync ? fdatasync(fi->fh) : fsync(fi->fh);
+    fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+/* 함수 원형: void (*read) (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) */
+/*
+    데이터를 직접 읽지 않고 "fd의 off부터 size만큼"이라는 buffer를 넘긴다.
+    libfuse가 splice가 가능하면 커널 안에서, 아니면 pread로 /dev/fuse에 복사한다.
+    --io=uring이면 읽기를 ring에 넣고 바로 돌아가며, 응답은 completion thread가 보낸다.
+*/
+static void myfs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+            off_t offset, struct fuse_file_info *fi)
+{
+    struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+    (void) ino;
+
+    if(uring_read(req, fi->fh, size, offset) == 0)
+        return;
+    buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    buf.buf[0].fd = fi->fh;
+    buf.buf[0].pos = offset;
+    fuse_reply_data(req, &buf, 0);
+}
+
+/* 함수 원형: void (*write_buf) (fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi) */
+static void myfs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in_buf,
+            off_t offset, struct fuse_file_info *fi)
+{
+    struct fuse_bufvec out_buf = FUSE_BUFVEC_INIT(fuse_buf_size(in_buf));
+    ssize_t res;
+    (void) ino;
+
+    if(uring_write(req, fi->fh, in_buf, offset) == 0)
+        return;
+    out_buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    out_buf.buf[0].fd = fi->fh;
+    out_buf.buf[0].pos = offset;
+
+    res = fuse_buf_copy(&out_buf, in_buf, 0);
+    if(res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_write(req, (size_t) res);
+}
+
+/* 함수 원형: void (*statfs) (fuse_req_t req, fuse_ino_t ino) */
+static void myfs_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    struct statvfs st;
+
+    if(fstatvfs(myfs_fd(ino), &st) == -1)
+        return (void) fuse_reply_err(req, errno);
+    fuse_reply_statfs(req, &st);
+}
+
+/* 함수 원형: void (*fallocate) (fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi) */
+static void myfs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+            off_t offset, off_t length, struct fuse_file_info *fi)
+{
+    (void) ino;
+    if(uring_fallocate(req, fi->fh, mode, offset, length) == 0)
+        return;
+    if(fallocate(fi->fh, mode, offset, length) == -1)
+        return (void) fuse_reply_err(req, errno);
+    fuse_reply_err(req, 0);
+}
+
+/* 함수 원형: void (*flock) (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, int op) */
+static void myfs_flock(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, int op)
+{
+    (void) ino;
+    if(flock(fi->fh, op) == -1)
+        return (void) fuse_reply_err(req, errno);
+    fuse_reply_err(req, 0);
+}
+
+/* 함수 원형: void (*lseek) (fuse_req_t req, fuse_ino_t ino, off_t off, int whence, struct fuse_file_info *fi) */
+static void myfs_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+            struct fuse_file_info *fi)
+{
+    off_t res;
+    (void) ino;
+
+    res = lseek(fi->fh, off, whence);
+    if(res == -1)
+        return (void) fuse_reply_err(req, errno);
+    fuse_reply_lseek(req, res);
+}
+
+#ifdef HAVE_COPY_FILE_RANGE
+/* 함수 원형: void (*copy_file_range) (fuse_req_t req, fuse_ino_t ino_in, off_t off_in, struct fuse_file_info *fi_in,
+                fuse_ino_t ino_out, off_t off_out, struct fuse_file_info *fi_out, size_t len, int flags) */
+static void myfs_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in,
+            struct fuse_file_info *fi_in, fuse_ino_t ino_out, off_t off_out,
+            struct fuse_file_info *fi_out, size_t len, int flags)
+{
+    ssize_t res;
+    (void) ino_in;
+    (void) ino_out;
+
+    res = copy_file_range(fi_in->fh, &off_in, fi_out->fh, &off_out, len, flags);
+    if(res == -1)
+        return (void) fuse_reply_err(req, errno);
+    fuse_reply_write(req, res);
+}
+#endif
+
+#ifdef HAVE_SETXATTR
+/* xattr은 O_PATH fd로 다룰 수 없으므로 /proc/self/fd/N 경로를 사용한다. */
+static void myfs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+{
+    char procname[64];
+    char *value = NULL;
+    ssize_t res;
+
+    proc_path(procname, sizeof(procname), myfs_fd(ino));
+    if(size){
+        value = malloc(size);
+        if(value == NULL)
+            return (void) fuse_reply_err(req, ENOMEM);
+    }
+    res = getxattr(procname, name, value, size);
+    if(res == -1)
+        fuse_reply_err(req, errno);
+    else if(size)
+        fuse_reply_buf(req, value, res);
+    else
+        fuse_reply_xattr(req, res);
+    free(value);
+}
+
+static void myfs_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+    char procname[64];
+    char *value = NULL;
+    ssize_t res;
+
+    proc_path(procname, sizeof(procname), myfs_fd(ino));
+    if(size){
+        value = malloc(size);
+        if(value == NULL)
+            return (void) fuse_reply_err(req, ENOMEM);
+    }
+    res = listxattr(procname, value, size);
+    if(res == -1)
+        fuse_reply_err(req, errno);
+    else if(size)
+        fuse_reply_buf(req, value, res);
+    else
+        fuse_reply_xattr(req, res);
+    free(value);
+}
+
+static void myfs_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+            const char *value, size_t size, int flags)
+{
+    char procname[64];
+
+    proc_path(procname, sizeof(procname), myfs_fd(ino));
+    if(setxattr(procname, name, value, size, flags) == -1)
+        return (void) fuse_reply_err(req, errno);
+    fuse_reply_err(req, 0);
+}
+
+static void myfs_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
+{
+    char procname[64];
+
+    proc_path(procname, sizeof(procname), myfs_fd(ino));
+    if(removexattr(procname, name) == -1)
+        return (void) fuse_reply_err(req, errno);
+    fuse_reply_err(req, 0);
+}
+#endif /* HAVE_SETXATTR */
+
+static const struct fuse_lowlevel_ops myfs_oper = {
+    .init           = myfs_init,
+    .destroy        = myfs_destroy,
+    .lookup         = myfs_lookup,
+    .forget         = myfs_forget,
+    .forget_multi   = myfs_forget_multi,
+    .getattr        = myfs_getattr,
+    .setattr        = myfs_setattr,
+    .readlink       = myfs_readlink,
+    .mknod          = myfs_mknod,
+    .mkdir          = myfs_mkdir,
+    .symlink        = myfs_symlink,
+    .link           = myfs_link,
+    .unlink         = myfs_unlink,
+    .rmdir          = myfs_rmdir,
+    .rename         = myfs_rename,
+    .opendir        = myfs_opendir,
+    .readdir        = myfs_readdir,
+    .readdirplus    = myfs_readdirplus,
+    .releasedir     = myfs_releasedir,
+    .fsyncdir       = myfs_fsyncdir,
+    .create         = myfs_create,
+    .open           = myfs_open,
+    .release        = myfs_release,
+    .flush          = myfs_flush,
+    .fsync          = myfs_fsync,
+    .read           = myfs_read,
+    .write_buf      = myfs_write_buf,
+    .statfs         = myfs_statfs,
+    .fallocate      = myfs_fallocate,
+    .flock          = myfs_flock,
+    .lseek          = myfs_lseek,
+#ifdef HAVE_COPY_FILE_RANGE
+    .copy_file_range = myfs_copy_file_range,
+#endif
+#ifdef HAVE_SETXATTR
+    .getxattr       = myfs_getxattr,
+    .listxattr      = myfs_listxattr,
+    .setxattr       = myfs_setxattr,
+    .removexattr    = myfs_removexattr,
+#endif
+};
+
+int main(int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts opts;
+    struct fuse_loop_config *config;
+    struct fuse_session *se;
+    struct stat st;
+    int ret = -1;
+
+    if(fuse_opt_parse(&args, &options, option_spec, NULL) == -1)
+        return 1;
+    if(fuse_parse_cmdline(&args, &opts) != 0)
+        return 1;
+    if(opts.show_help){
+        printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        ret = 0;
+        goto err_out1;
+    } else if(opts.show_version){
+        printf("FUSE library version %s\n", fuse_pkgversion());
+        fuse_lowlevel_version();
+        ret = 0;
+        goto err_out1;
+    }
+    if(opts.mountpoint == NULL){
+        printf("usage: %s [options] <mountpoint>\n", argv[0]);
+        printf("       %s --help\n", argv[0]);
+        ret = 1;
+        goto err_out1;
+    }
+
+    data.nbuckets = 1024;
+    data.buckets = calloc(data.nbuckets, sizeof(*data.buckets));
+    if(data.buckets == NULL)
+        goto err_out1;
+    data.root.nlookup = 2; // the root is never forgotten
+    data.root.fd = open(options.source, O_PATH);
+    if(data.root.fd == -1 || fstatat(data.root.fd, "", &st, AT_EMPTY_PATH) == -1){
+        fprintf(stderr, "%s: %s\n", options.source, strerror(errno));
+        goto err_out1;
+    }
+    /* ".."로 root를 다시 찾았을 때 같은 inode가 나오도록 root도 테이블에 넣는다 */
+    data.root.dev = st.st_dev;
+    data.root.ino = st.st_ino;
+    inode_insert(&data.root);
+
+    if(options.passthrough){
+        struct rlimit rl;
+
+        passthrough_nfds = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY ? rl.rlim_cur : 65536;
+        if(passthrough_nfds > 1 << 20)
+            passthrough_nfds = 1 << 20;
+        passthrough_fds = calloc(passthrough_nfds, 1);
+        if(passthrough_fds == NULL)
+            passthrough_nfds = 0;
+    }
+
+    umask(0);
+    se = fuse_session_new(&args, &myfs_oper, sizeof(myfs_oper), NULL);
+    if(se == NULL)
+        goto err_out1;
+    if(fuse_set_signal_handlers(se) != 0)
+        goto err_out2;
+    if(fuse_session_mount(se, opts.mountpoint) != 0)
+        goto err_out3;
+    fuse_daemonize(opts.foreground);
+
+    /* the completion threads must be created in the daemon, after the fork */
+    if(strcmp(options.io, "uring") == 0){
+        if(uring_start(options.io_rings, options.io_depth) == -1)
+            fprintf(stderr, "io_uring is not available, using --io=sync\n");
+    } else if(strcmp(options.io, "sync") != 0)
+        fprintf(stderr, "unknown --io=%s, using --io=sync\n", options.io);
+
+    if(opts.singlethread)
+        ret = fuse_session_loop(se);
+    else {
+        config = fuse_loop_cfg_create();
+        fuse_loop_cfg_set_clone_fd(config, opts.clone_fd);
+        fuse_loop_cfg_set_max_threads(config, opts.max_threads);
+        fuse_loop_cfg_set_idle_threads(config, opts.max_idle_threads);
+        ret = fuse_session_loop_mt(se, config);
+        fuse_loop_cfg_destroy(config);
+    }
+
+    uring_stop();
+    fuse_session_unmount(se);
+err_out3:
+    fuse_remove_signal_handlers(se);
+err_out2:
+    fuse_session_destroy(se);
+err_out1:
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+    if(data.root.fd >= 0)
+        close(data.root.fd);
+    free(passthrough_fds);
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,205 @@
+/*
+ * Adaptive read-ahead for my_passthrough
+ *
+ * Every request is served with one pread() or splice from the backing
+ * file, so on slow storage a sequential reader waits for the device on
+ * each request of at most max_read bytes. With --readahead=KiB every open
+ * file tracks where its reader is heading. While reads keep continuing
+ * the previous one the window ahead of the reader doubles, up to the
+ * configured maximum, and the range beyond what was already requested is
+ * handed to a small pool of prefetch threads that pull it into the page
+ * cache with readahead(2). The request itself never waits for that I/O,
+ * and the pread()/splice that serves a later request finds the data in
+ * memory. A read that jumps elsewhere collapses the window, so random
+ * access does not drag in data nobody asked for.
+ *
+ * 캐시는 커널의 page cache를 그대로 쓴다. 데몬 안에 따로 캐시를 두면 splice로 넘기던
+ * read_buf 경로에 복사가 하나 더 생기기 때문이다.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define RA_MIN_WINDOW (128 * 1024)  /* first window of a sequential reader */
+#define RA_THREADS 2
+#define RA_QUEUE 64                 /* pending prefetches; more are dropped */
+
+struct ra_state {
+    pthread_mutex_t lock;
+    off_t next;                     /* where a sequential reader continues */
+    off_t ahead;                    /* end of the range already prefetched */
+    size_t window;                  /* 0 while the access pattern looks random */
+};
+
+struct ra_job {
+    int fd;                         /* dup of the handle's fd, closed by the prefetch thread */
+    off_t off;
+    size_t len;
+};
+
+static size_t ra_max;               /* --readahead, 0 = off */
+static struct ra_job ra_queue[RA_QUEUE];
+static unsigned int ra_head, ra_count;
+static pthread_mutex_t ra_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_queue_cond = PTHREAD_COND_INITIALIZER;
+
+/* counters, printed in /.myfs_stats */
+static atomic_uint_fast64_t ra_hits;        /* sequential reads inside the prefetched range */
+static atomic_uint_fast64_t ra_misses;      /* sequential reads beyond it */
+static atomic_uint_fast64_t ra_random;      /* reads that broke the pattern */
+static atomic_uint_fast64_t ra_bytes;       /* bytes handed to readahead(2) */
+static atomic_uint_fast64_t ra_dropped;     /* prefetches dropped on a full queue */
+
+static struct ra_state *ra_new(void)
+{
+    struct ra_state *ra;
+
+    if(ra_max == 0)
+        return NULL;
+    ra = calloc(1, sizeof(*ra));
+    if(ra != NULL)
+        pthread_mutex_init(&ra->lock, NULL);
+    return ra;
+}
+
+static void ra_free(struct ra_state *ra)
+{
+    if(ra == NULL)
+        return;
+    pthread_mutex_destroy(&ra->lock);
+    free(ra);
+}
+
+static void ra_submit(int fd, off_t off, size_t len)
+{
+    int dupfd;
+
+    pthread_mutex_lock(&ra_queue_lock);
+    if(ra_count == RA_QUEUE){
+        pthread_mutex_unlock(&ra_queue_lock);
+        atomic_fetch_add_explicit(&ra_dropped, 1, memory_order_relaxed);
+        return;
+    }
+    /* the handle may be released before the job runs, so the job gets its own fd */
+    dupfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if(dupfd == -1){
+        pthread_mutex_unlock(&ra_queue_lock);
+        return;
+    }
+    ra_queue[(ra_head + ra_count) % RA_QUEUE] = (struct ra_job) { dupfd, off, len };
+    ra_count++;
+    pthread_cond_signal(&ra_queue_cond);
+    pthread_mutex_unlock(&ra_queue_lock);
+}
+
+/* called before a read of size bytes at off is served from fd */
+static void ra_read(struct ra_state *ra, int fd, off_t off, size_t size)
+{
+    off_t start = 0, end = off + size;
+    size_t len = 0;
+
+    if(ra == NULL)
+        return;
+    pthread_mutex_lock(&ra->lock);
+    /* the kernel sends the pieces of one large read in parallel, so they may
+       arrive a little out of order: anything touching [next - size, next + size]
+       still counts as sequential */
+    if(off <= ra->next + (off_t) size && end >= ra->next && (ra->next != 0 || off == 0)){
+        if(end <= ra->ahead)
+            atomic_fetch_add_explicit(&ra_hits, 1, memory_order_relaxed);
+        else
+            atomic_fetch_add_explicit(&ra_misses, 1, memory_order_relaxed);
+        ra->window = ra->window ? ra->window * 2 : RA_MIN_WINDOW;
+        if(ra->window > ra_max)
+            ra->window = ra_max;
+        if(ra->ahead < end)
+            ra->ahead = end;
+        /* top the window up once half of it has been consumed */
+        if((size_t) (end + ra->window - ra->ahead) >= ra->window / 2){
+            start = ra->ahead;
+            len = end + ra->window - ra->ahead;
+            ra->ahead = start + len;
+        }
+    } else {
+        atomic_fetch_add_explicit(&ra_random, 1, memory_order_relaxed);
+        ra->window = 0;
+        ra->ahead = end;
+    }
+    if(end > ra->next)
+        ra->next = end;
+    else if(ra->window == 0)
+        ra->next = end;
+    pthread_mutex_unlock(&ra->lock);
+
+    if(len != 0)
+        ra_submit(fd, start, len);
+}
+
+static void *ra_thread(void *arg)
+{
+    (void) arg;
+
+    for(;;){
+        struct ra_job job;
+
+        pthread_mutex_lock(&ra_queue_lock);
+        while(ra_count == 0)
+            pthread_cond_wait(&ra_queue_cond, &ra_queue_lock);
+        job = ra_queue[ra_head];
+        ra_head = (ra_head + 1) % RA_QUEUE;
+        ra_count--;
+        pthread_mutex_unlock(&ra_queue_lock);
+
+#ifdef __linux__
+        if(readahead(job.fd, job.off, job.len) == 0)
+#else
+        if(posix_fadvise(job.fd, job.off, job.len, POSIX_FADV_WILLNEED) == 0)
+#endif
+            atomic_fetch_add_explicit(&ra_bytes, job.len, memory_order_relaxed);
+        close(job.fd);
+    }
+    return NULL;
+}
+
+/* start the prefetch threads; after fuse_daemonize(), which forks */
+static int ra_start(size_t max_window)
+{
+    pthread_t tid;
+
+    ra_max = max_window;
+    if(ra_max == 0)
+        return 0;
+    if(ra_max < RA_MIN_WINDOW)
+        ra_max = RA_MIN_WINDOW;
+    for(int i = 0; i < RA_THREADS; i++){
+        if(pthread_create(&tid, NULL, ra_thread, NULL) != 0){
+            if(i == 0){
+                ra_max = 0;
+                return -1;
+            }
+            break;
+        }
+        pthread_detach(tid);
+    }
+    return 0;
+}
+
+/* snprintf() style, for the stats file */
+static int ra_format(char *buf, size_t size)
+{
+    uint64_t hits = atomic_load(&ra_hits), misses = atomic_load(&ra_misses);
+
+    if(ra_max == 0)
+        return snprintf(buf, size, "%s", "");
+    return snprintf(buf, size, "readahead: %llu sequential reads (%llu hit, %llu missed, %.1f%% hit), "
+                    "%llu random, %llu bytes prefetched, %llu prefetches dropped\n",
+                    (unsigned long long) (hits + misses), (unsigned long long) hits,
+                    (unsigned long long) misses, hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+                    (unsigned long long) atomic_load(&ra_random), (unsigned long long) atomic_load(&ra_bytes),
+                    (unsigned long long) atomic_load(&ra_dropped));
+}
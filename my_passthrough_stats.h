@@ -0,0 +1,297 @@
+/*
+ * Per-operation statistics of the my_passthrough daemon
+ *
+ * Every handler in myfs_oper is called through a dispatch wrapper that
+ * takes two CLOCK_MONOTONIC timestamps (vDSO, no syscall) and bumps the
+ * counters of the calling thread: errors, bytes moved, total time and a
+ * log-linear latency histogram whose sum is the number of calls. Each
+ * thread owns its counters, so recording is a handful of plain stores with no atomic read-modify-write
+ * and no shared cache line. The per-thread blocks are only summed when
+ * somebody asks for them: reading /.myfs_stats or sending SIGUSR1.
+ *
+ * 히스토그램은 HDR histogram처럼 2의 거듭제곱 구간마다 STATS_SUB개의 bucket으로 나눈다.
+ * 따라서 값의 크기와 관계없이 상대 오차는 1/STATS_SUB 이하이다.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define STATS_PATH "/.myfs_stats" /* read-only file with the counters below */
+
+/* every operation that goes through a dispatch wrapper */
+#define STATS_OPS(X) \
+    X(getattr) X(access) X(readlink) X(opendir) X(readdir) X(releasedir) \
+    X(mknod) X(mkdir) X(symlink) X(unlink) X(rmdir) X(rename) X(link) \
+    X(chmod) X(chown) X(truncate) X(utimens) X(open) X(create) X(read) \
+    X(write) X(read_buf) X(write_buf) X(statfs) X(release) X(fsync) \
+    X(flush) X(fsyncdir) X(fallocate) X(setxattr) X(getxattr) X(listxattr) \
+    X(removexattr) X(copy_file_range) X(lseek)
+
+#define STATS_ENUM(name) STATS_##name,
+enum { STATS_OPS(STATS_ENUM) STATS_NOPS };
+#undef STATS_ENUM
+
+#define STATS_NAME(name) #name,
+static const char *const stats_names[STATS_NOPS] = { STATS_OPS(STATS_NAME) };
+#undef STATS_NAME
+
+#define STATS_SUB_BITS 3
+#define STATS_SUB (1 << STATS_SUB_BITS)
+#define STATS_NBUCKETS (STATS_SUB * 38) /* about 2^40 ns, longer calls land in the last bucket */
+
+/* counters are written by their owner thread only, relaxed atomics make the
+   racy reads of stats_format() well defined without costing a lock prefix */
+struct op_stats {
+    _Atomic uint64_t errors;
+    _Atomic uint64_t bytes;
+    _Atomic uint64_t ns; /* total latency */
+    _Atomic uint64_t hist[STATS_NBUCKETS]; /* latency in ns */
+};
+
+struct stats_thread {
+    struct stats_thread *next;
+    int in_use; /* 0 once the owner exited, the block is then reused by a new thread */
+    struct op_stats op[STATS_NOPS];
+};
+
+#define STATS_MAX_EXTRA 4
+
+static int stats_enabled = 1;
+/* other subsystems' counters, appended to the table by stats_format() */
+static int (*stats_extra[STATS_MAX_EXTRA])(char *buf, size_t size);
+static struct stats_thread *stats_threads;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+static __thread struct stats_thread *this_stats;
+
+static void stats_thread_exit(void *arg)
+{
+    struct stats_thread *st = arg;
+
+    pthread_mutex_lock(&stats_lock);
+    st->in_use = 0; /* keep the counts, they are part of the totals */
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void stats_make_key(void)
+{
+    pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+/* slow path: first instrumented call on this thread */
+static struct stats_thread *stats_register(void)
+{
+    struct stats_thread *st;
+
+    pthread_once(&stats_key_once, stats_make_key);
+    pthread_mutex_lock(&stats_lock);
+    for(st = stats_threads; st != NULL; st = st->next)
+        if(!st->in_use)
+            break;
+    if(st == NULL){
+        st = calloc(1, sizeof(*st));
+        if(st == NULL){
+            pthread_mutex_unlock(&stats_lock);
+            return NULL;
+        }
+        st->next = stats_threads;
+        stats_threads = st;
+    }
+    st->in_use = 1;
+    pthread_mutex_unlock(&stats_lock);
+    pthread_setspecific(stats_key, st);
+    return st;
+}
+
+static inline void stats_add(_Atomic uint64_t *c, uint64_t n)
+{
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static inline int stats_bucket(uint64_t ns)
+{
+    int msb, b;
+
+    if(ns < STATS_SUB)
+        return ns;
+    msb = 63 - __builtin_clzll(ns);
+    b = (msb - STATS_SUB_BITS + 1) * STATS_SUB + ((ns >> (msb - STATS_SUB_BITS)) & (STATS_SUB - 1));
+    return b < STATS_NBUCKETS ? b : STATS_NBUCKETS - 1;
+}
+
+/* smallest latency that falls into bucket b */
+static uint64_t stats_bucket_low(int b)
+{
+    int shift;
+
+    if(b < STATS_SUB)
+        return b;
+    shift = b / STATS_SUB - 1;
+    return (uint64_t) (STATS_SUB + b % STATS_SUB) << shift;
+}
+
+static inline uint64_t stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void stats_end(int op, uint64_t start, uint64_t bytes, int failed)
+{
+    struct op_stats *s;
+    uint64_t ns;
+
+    if(!stats_enabled)
+        return;
+    ns = stats_now() - start;
+    if(this_stats == NULL && (this_stats = stats_register()) == NULL)
+        return;
+    s = &this_stats->op[op];
+    if(failed)
+        stats_add(&s->errors, 1);
+    if(bytes)
+        stats_add(&s->bytes, bytes);
+    stats_add(&s->ns, ns);
+    stats_add(&s->hist[stats_bucket(ns)], 1);
+}
+
+/* fn prints extra lines in snprintf() style; call before the filesystem is mounted */
+static void stats_add_extra(int (*fn)(char *buf, size_t size))
+{
+    for(int i = 0; i < STATS_MAX_EXTRA; i++){
+        if(stats_extra[i] == NULL){
+            stats_extra[i] = fn;
+            return;
+        }
+    }
+}
+
+/* latency below which a fraction q of the n calls in hist completed */
+static uint64_t stats_quantile(const uint64_t *hist, uint64_t n, double q)
+{
+    uint64_t want = (uint64_t) (n * q), seen = 0;
+
+    for(int b = 0; b < STATS_NBUCKETS; b++){
+        seen += hist[b];
+        if(seen > want)
+            return stats_bucket_low(b);
+    }
+    return stats_bucket_low(STATS_NBUCKETS - 1);
+}
+
+/*
+   Sum the per-thread counters and print one line per operation that was
+   called at least once. Works like snprintf(): returns the length of the
+   whole text even if it did not fit, buf may be NULL.
+*/
+static int stats_format(char *buf, size_t size)
+{
+    static uint64_t hist[STATS_NBUCKETS];
+    static pthread_mutex_t format_lock = PTHREAD_MUTEX_INITIALIZER;
+    int len;
+
+    pthread_mutex_lock(&format_lock);
+    len = snprintf(buf, size, "%-16s %12s %8s %14s %10s %10s %10s %10s %10s\n",
+                   "op", "calls", "errors", "bytes", "avg_ns", "p50_ns", "p90_ns", "p99_ns", "max_ns");
+    for(int op = 0; op < STATS_NOPS; op++){
+        uint64_t calls = 0, errors = 0, bytes = 0, sum = 0, max = 0;
+
+        memset(hist, 0, sizeof(hist));
+        pthread_mutex_lock(&stats_lock);
+        for(struct stats_thread *st = stats_threads; st != NULL; st = st->next){
+            struct op_stats *s = &st->op[op];
+            errors += atomic_load_explicit(&s->errors, memory_order_relaxed);
+            bytes += atomic_load_explicit(&s->bytes, memory_order_relaxed);
+            sum += atomic_load_explicit(&s->ns, memory_order_relaxed);
+            for(int b = 0; b < STATS_NBUCKETS; b++)
+                hist[b] += atomic_load_explicit(&s->hist[b], memory_order_relaxed);
+        }
+        pthread_mutex_unlock(&stats_lock);
+        /* count calls from the histogram so the quantiles are consistent with it */
+        for(int b = 0; b < STATS_NBUCKETS; b++){
+            if(hist[b] == 0)
+                continue;
+            calls += hist[b];
+            max = stats_bucket_low(b);
+        }
+        if(calls == 0)
+            continue;
+        len += snprintf((size_t) len < size ? buf + len : NULL, (size_t) len < size ? size - len : 0,
+                        "%-16s %12llu %8llu %14llu %10llu %10llu %10llu %10llu %10llu\n",
+                        stats_names[op], (unsigned long long) calls, (unsigned long long) errors,
+                        (unsigned long long) bytes, (unsigned long long) (sum / calls),
+                        (unsigned long long) stats_quantile(hist, calls, 0.50),
+                        (unsigned long long) stats_quantile(hist, calls, 0.90),
+                        (unsigned long long) stats_quantile(hist, calls, 0.99),
+                        (unsigned long long) max);
+    }
+    for(int i = 0; i < STATS_MAX_EXTRA && stats_extra[i] != NULL; i++)
+        len += stats_extra[i]((size_t) len < size ? buf + len : NULL, (size_t) len < size ? size - len : 0);
+    pthread_mutex_unlock(&format_lock);
+    return len;
+}
+
+/* text of /.myfs_stats, taken at open() so that reads see one consistent snapshot */
+struct stats_snapshot {
+    size_t len;
+    char text[];
+};
+
+static struct stats_snapshot *stats_snapshot(void)
+{
+    int len = stats_format(NULL, 0);
+    struct stats_snapshot *snap = malloc(sizeof(*snap) + len + 1);
+
+    if(snap == NULL)
+        return NULL;
+    stats_format(snap->text, len + 1); /* may have grown in between, then it is cut */
+    snap->len = strlen(snap->text);
+    return snap;
+}
+
+static void *stats_signal_thread(void *arg)
+{
+    sigset_t *set = arg;
+    int sig;
+
+    while(sigwait(set, &sig) == 0){
+        struct stats_snapshot *snap = stats_snapshot();
+        if(snap == NULL)
+            continue;
+        fwrite(snap->text, 1, snap->len, stderr);
+        fflush(stderr);
+        free(snap);
+    }
+    return NULL;
+}
+
+/*
+   Dump the statistics to stderr on SIGUSR1. The signal is blocked in the
+   calling thread and therefore in every thread it creates afterwards, and
+   picked up by a dedicated sigwait() thread, so the dump never runs inside
+   a signal handler. Must be called after fuse_daemonize(), which forks.
+*/
+static int stats_start_signal(void)
+{
+    static sigset_t set;
+    pthread_t tid;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    if(pthread_sigmask(SIG_BLOCK, &set, NULL) != 0)
+        return -1;
+    if(pthread_create(&tid, NULL, stats_signal_thread, &set) != 0)
+        return -1;
+    pthread_detach(tid);
+    return 0;
+}
@@ -0,0 +1,440 @@
+/*
+ * io_uring I/O engine for my_passthrough_ll
+ *
+ * With the default engine (--io=sync) a worker thread that gets a read,
+ * write, fsync or fallocate request makes the system call itself and only
+ * goes back to /dev/fuse once it has returned, so the number of requests
+ * in flight on the backing file system is the number of worker threads.
+ * With --io=uring the handler only prepares a submission queue entry and
+ * returns; a completion thread per ring reaps the results and sends the
+ * replies. A few threads can then keep hundreds of requests in flight.
+ *
+ * Every ring registers a pool of I/O buffers (READ_FIXED/WRITE_FIXED, no
+ * page pinning per request) and a sparse file table in which the slot of
+ * a file is its descriptor number, so fi->fh stays a plain fd and is also
+ * the fixed-file index. Requests larger than a pool buffer, or arriving
+ * while the pool is empty, use a malloc()ed buffer instead.
+ *
+ * 링을 만들 수 없거나 liburing 없이 컴파일하면 (HAVE_LIBURING 없음) 모든 요청은
+ * 기존의 blocking 경로로 처리된다. uring_*() 함수가 -1을 돌려주면 호출한 쪽이
+ * 직접 처리하면 된다.
+ */
+
+#include <fuse_lowlevel.h>
+
+static int uring_on; /* set by uring_start() */
+
+#ifdef HAVE_LIBURING
+
+#include <liburing.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#define URING_MAX_RINGS 16
+#define URING_BUFS 128              /* registered buffers per ring */
+#define URING_BUF_SIZE (128 * 1024) /* default max_pages of the kernel */
+#define URING_MAX_FILES 65536
+
+enum { URING_READ, URING_WRITE, URING_FSYNC, URING_FALLOCATE };
+
+struct uring_op {
+    fuse_req_t req;
+    int type;
+    int index;                      /* registered buffer, -1 for a malloc()ed one */
+    char *buf;
+};
+
+struct uring_ring {
+    struct io_uring ring;
+    pthread_mutex_t lock;           /* submission queue and free buffer list */
+    pthread_t thread;
+    atomic_int inflight;
+    int stopping;                   /* only touched by the completion thread */
+    char *bufs;
+    int nfree;
+    int free[URING_BUFS];
+};
+
+static struct uring_ring uring_rings[URING_MAX_RINGS];
+static int uring_nrings;
+static unsigned int uring_nfiles;   /* fds below this have a slot, 0 if registration failed */
+static atomic_uchar *uring_fixed;   /* by fd: 1 if every ring has it in its slot */
+static atomic_uint uring_next;
+static __thread struct uring_ring *this_ring;
+
+static struct uring_ring *uring_this_ring(void)
+{
+    if(this_ring == NULL)
+        this_ring = &uring_rings[atomic_fetch_add(&uring_next, 1) % uring_nrings];
+    return this_ring;
+}
+
+/* called with r->lock held */
+static int uring_get_buf(struct uring_ring *r, struct uring_op *op, size_t size)
+{
+    if(size <= URING_BUF_SIZE && r->nfree > 0){
+        op->index = r->free[--r->nfree];
+        op->buf = r->bufs + (size_t) op->index * URING_BUF_SIZE;
+        return 0;
+    }
+    op->index = -1;
+    op->buf = malloc(size ? size : 1);
+    return op->buf == NULL ? -1 : 0;
+}
+
+static void uring_put_buf(struct uring_ring *r, struct uring_op *op)
+{
+    if(op->index < 0){
+        free(op->buf);
+        return;
+    }
+    pthread_mutex_lock(&r->lock);
+    r->free[r->nfree++] = op->index;
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* fill in the parts every request shares and hand the entry to the kernel; called with r->lock held */
+static void uring_submit(struct uring_ring *r, struct io_uring_sqe *sqe, int fd, struct uring_op *op)
+{
+    if((unsigned int) fd < uring_nfiles && atomic_load_explicit(&uring_fixed[fd], memory_order_relaxed))
+        io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE); /* the slot number is the fd */
+    io_uring_sqe_set_data(sqe, op);
+    atomic_fetch_add(&r->inflight, 1);
+    /* on failure the entry stays in the queue and goes out with the next submit */
+    io_uring_submit(&r->ring);
+}
+
+/* called with r->lock held */
+static struct io_uring_sqe *uring_get_sqe(struct uring_ring *r)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&r->ring);
+
+    if(sqe == NULL){
+        io_uring_submit(&r->ring);
+        sqe = io_uring_get_sqe(&r->ring);
+    }
+    return sqe;
+}
+
+static void uring_complete(struct uring_ring *r, struct uring_op *op, int res)
+{
+    switch(op->type){
+    case URING_READ:
+        if(res < 0)
+            fuse_reply_err(op->req, -res);
+        else
+            fuse_reply_buf(op->req, op->buf, res);
+        break;
+    case URING_WRITE:
+        if(res < 0)
+            fuse_reply_err(op->req, -res);
+        else
+            fuse_reply_write(op->req, res);
+        break;
+    default:
+        fuse_reply_err(op->req, res < 0 ? -res : 0);
+        break;
+    }
+    if(op->buf != NULL)
+        uring_put_buf(r, op);
+    free(op);
+}
+
+static void *uring_thread(void *arg)
+{
+    struct uring_ring *r = arg;
+    struct io_uring_cqe *cqe;
+
+    for(;;){
+        struct uring_op *op;
+        int res;
+
+        if(io_uring_wait_cqe(&r->ring, &cqe) != 0)
+            continue;               /* EINTR */
+        op = io_uring_cqe_get_data(cqe);
+        res = cqe->res;
+        io_uring_cqe_seen(&r->ring, cqe);
+        if(op == NULL){             /* the nop from uring_stop() */
+            r->stopping = 1;
+            if(atomic_load(&r->inflight) == 0)
+                break;
+            continue;
+        }
+        uring_complete(r, op, res);
+        if(atomic_fetch_sub(&r->inflight, 1) == 1 && r->stopping)
+            break;
+    }
+    return NULL;
+}
+
+/*
+   Set up nrings rings of depth entries each and their completion threads.
+   Must run after fuse_daemonize(), which forks. Returns -1 if io_uring is
+   not usable, the caller then stays on the blocking engine.
+*/
+static int uring_start(int nrings, unsigned int depth)
+{
+    struct rlimit rl;
+
+    if(nrings < 1)
+        nrings = 1;
+    if(nrings > URING_MAX_RINGS)
+        nrings = URING_MAX_RINGS;
+    uring_nfiles = URING_MAX_FILES;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < uring_nfiles)
+        uring_nfiles = rl.rlim_cur;
+
+    for(uring_nrings = 0; uring_nrings < nrings; uring_nrings++){
+        struct uring_ring *r = &uring_rings[uring_nrings];
+        struct io_uring_params p;
+        struct iovec iov[URING_BUFS];
+
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = depth * 4;   /* replies may lag behind submissions */
+        if(io_uring_queue_init_params(depth, &r->ring, &p) < 0)
+            break;
+        pthread_mutex_init(&r->lock, NULL);
+
+        r->nfree = 0;
+        if(posix_memalign((void **) &r->bufs, 4096, (size_t) URING_BUFS * URING_BUF_SIZE) == 0){
+            for(int i = 0; i < URING_BUFS; i++){
+                iov[i].iov_base = r->bufs + (size_t) i * URING_BUF_SIZE;
+                iov[i].iov_len = URING_BUF_SIZE;
+            }
+            if(io_uring_register_buffers(&r->ring, iov, URING_BUFS) == 0){
+                for(int i = 0; i < URING_BUFS; i++)
+                    r->free[r->nfree++] = URING_BUFS - 1 - i;
+            } else {
+                free(r->bufs);
+                r->bufs = NULL;
+            }
+        }
+        /* the fd-as-slot scheme only works if every ring has the table */
+        if(uring_nfiles != 0 && io_uring_register_files_sparse(&r->ring, uring_nfiles) != 0)
+            uring_nfiles = 0;
+
+        if(pthread_create(&r->thread, NULL, uring_thread, r) != 0){
+            io_uring_queue_exit(&r->ring);
+            free(r->bufs);
+            break;
+        }
+    }
+    if(uring_nrings == 0)
+        return -1;
+    if(uring_nfiles != 0 && (uring_fixed = calloc(uring_nfiles, sizeof(*uring_fixed))) == NULL)
+        uring_nfiles = 0;
+    uring_on = 1;
+    return 0;
+}
+
+/* wait for the requests in flight, then tear the rings down */
+static void uring_stop(void)
+{
+    if(!uring_on)
+        return;
+    uring_on = 0;
+    for(int i = 0; i < uring_nrings; i++){
+        struct uring_ring *r = &uring_rings[i];
+        struct io_uring_sqe *sqe;
+
+        pthread_mutex_lock(&r->lock);
+        sqe = uring_get_sqe(r);
+        if(sqe != NULL){
+            io_uring_prep_nop(sqe);
+            io_uring_sqe_set_data(sqe, NULL);
+            io_uring_submit(&r->ring);
+        }
+        pthread_mutex_unlock(&r->lock);
+        if(sqe != NULL)
+            pthread_join(r->thread, NULL);
+        else
+            pthread_detach(r->thread);
+        io_uring_queue_exit(&r->ring);
+        free(r->bufs);
+    }
+    free(uring_fixed);
+    uring_fixed = NULL;
+    uring_nfiles = 0;
+}
+
+/* a file was opened: put fd into the fixed file table of every ring. If
+   a ring refuses it (ENOMEM), requests on fd go with the plain fd. */
+static void uring_add_fd(int fd)
+{
+    int fixed = 1;
+
+    if(!uring_on || (unsigned int) fd >= uring_nfiles)
+        return;
+    for(int i = 0; i < uring_nrings; i++)
+        if(io_uring_register_files_update(&uring_rings[i].ring, fd, &fd, 1) != 1)
+            fixed = 0;
+    atomic_store_explicit(&uring_fixed[fd], fixed, memory_order_relaxed);
+}
+
+/* before close(fd): empty its slot, so a later file with the same number is not confused with it */
+static void uring_del_fd(int fd)
+{
+    int nil = -1;
+
+    if(!uring_on || (unsigned int) fd >= uring_nfiles)
+        return;
+    atomic_store_explicit(&uring_fixed[fd], 0, memory_order_relaxed);
+    for(int i = 0; i < uring_nrings; i++)
+        io_uring_register_files_update(&uring_rings[i].ring, fd, &nil, 1);
+}
+
+static struct uring_op *uring_new_op(fuse_req_t req, int type)
+{
+    struct uring_op *op = malloc(sizeof(*op));
+
+    if(op != NULL){
+        op->req = req;
+        op->type = type;
+        op->index = -1;
+        op->buf = NULL;
+    }
+    return op;
+}
+
+/* read size bytes at off from fd and reply with them once they are there; -1 if not submitted */
+static int uring_read(fuse_req_t req, int fd, size_t size, off_t off)
+{
+    struct uring_ring *r;
+    struct io_uring_sqe *sqe;
+    struct uring_op *op;
+
+    if(!uring_on || (op = uring_new_op(req, URING_READ)) == NULL)
+        return -1;
+    r = uring_this_ring();
+    pthread_mutex_lock(&r->lock);
+    if(uring_get_buf(r, op, size) == -1 || (sqe = uring_get_sqe(r)) == NULL){
+        pthread_mutex_unlock(&r->lock);
+        if(op->buf != NULL)
+            uring_put_buf(r, op);
+        free(op);
+        return -1;
+    }
+    if(op->index >= 0)
+        io_uring_prep_read_fixed(sqe, fd, op->buf, size, off, op->index);
+    else
+        io_uring_prep_read(sqe, fd, op->buf, size, off);
+    uring_submit(r, sqe, fd, op);
+    pthread_mutex_unlock(&r->lock);
+    return 0;
+}
+
+/*
+   write the data of in_buf at off. The request's buffer belongs to the
+   session and is reused as soon as the handler returns, so the data is
+   copied into a ring buffer first.
+*/
+static int uring_write(fuse_req_t req, int fd, struct fuse_bufvec *in_buf, off_t off)
+{
+    size_t size = fuse_buf_size(in_buf);
+    struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+    struct uring_ring *r;
+    struct io_uring_sqe *sqe;
+    struct uring_op *op;
+    ssize_t res;
+
+    if(!uring_on || (op = uring_new_op(req, URING_WRITE)) == NULL)
+        return -1;
+    r = uring_this_ring();
+    pthread_mutex_lock(&r->lock);
+    res = uring_get_buf(r, op, size);
+    pthread_mutex_unlock(&r->lock);
+    if(res == -1){
+        free(op);
+        return -1;
+    }
+
+    /* copy outside the lock, other threads keep submitting meanwhile */
+    mem.buf[0].mem = op->buf;
+    res = fuse_buf_copy(&mem, in_buf, 0);
+    if(res < 0){
+        uring_put_buf(r, op);
+        free(op);
+        fuse_reply_err(req, -res);
+        return 0;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    sqe = uring_get_sqe(r);
+    if(sqe == NULL){
+        pthread_mutex_unlock(&r->lock);
+        uring_put_buf(r, op);
+        free(op);
+        return -1;                  /* the caller copies in_buf again, it is still valid */
+    }
+    if(op->index >= 0)
+        io_uring_prep_write_fixed(sqe, fd, op->buf, res, off, op->index);
+    else
+        io_uring_prep_write(sqe, fd, op->buf, res, off);
+    uring_submit(r, sqe, fd, op);
+    pthread_mutex_unlock(&r->lock);
+    return 0;
+}
+
+static int uring_fsync(fuse_req_t req, int fd, int datasync)
+{
+    struct uring_ring *r;
+    struct io_uring_sqe *sqe;
+    struct uring_op *op;
+
+    if(!uring_on || (op = uring_new_op(req, URING_FSYNC)) == NULL)
+        return -1;
+    r = uring_this_ring();
+    pthread_mutex_lock(&r->lock);
+    if((sqe = uring_get_sqe(r)) == NULL){
+        pthread_mutex_unlock(&r->lock);
+        free(op);
+        return -1;
+    }
+    io_uring_prep_fsync(sqe, fd, datasync ? IORING_FSYNC_DATASYNC : 0);
+    uring_submit(r, sqe, fd, op);
+    pthread_mutex_unlock(&r->lock);
+    return 0;
+}
+
+static int uring_fallocate(fuse_req_t req, int fd, int mode, off_t off, off_t len)
+{
+    struct uring_ring *r;
+    struct io_uring_sqe *sqe;
+    struct uring_op *op;
+
+    if(!uring_on || (op = uring_new_op(req, URING_FALLOCATE)) == NULL)
+        return -1;
+    r = uring_this_ring();
+    pthread_mutex_lock(&r->lock);
+    if((sqe = uring_get_sqe(r)) == NULL){
+        pthread_mutex_unlock(&r->lock);
+        free(op);
+        return -1;
+    }
+    io_uring_prep_fallocate(sqe, fd, mode, off, len);
+    uring_submit(r, sqe, fd, op);
+    pthread_mutex_unlock(&r->lock);
+    return 0;
+}
+
+#else /* !HAVE_LIBURING */
+
+static int uring_start(int nrings, unsigned int depth) { (void) nrings; (void) depth; return -1; }
+static void uring_stop(void) {}
+static void uring_add_fd(int fd) { (void) fd; }
+static void uring_del_fd(int fd) { (void) fd; }
+static int uring_read(fuse_req_t req, int fd, size_t size, off_t off)
+{ (void) req; (void) fd; (void) size; (void) off; return -1; }
+static int uring_write(fuse_req_t req, int fd, struct fuse_bufvec *in_buf, off_t off)
+{ (void) req; (void) fd; (void) in_buf; (void) off; return -1; }
+static int uring_fsync(fuse_req_t req, int fd, int datasync)
+{ (void) req; (void) fd; (void) datasync; return -1; }
+static int uring_fallocate(fuse_req_t req, int fd, int mode, off_t off, off_t len)
+{ (void) req; (void) fd; (void) mode; (void) off; (void) len; return -1; }
+
+#endif /* HAVE_LIBURING */
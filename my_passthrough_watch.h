@@ -0,0 +1,375 @@
+/*
+ * Invalidation of kernel caches for my_passthrough
+ *
+ * With non-zero entry/attr timeouts the kernel answers stat() and lookups
+ * from its own cache, so changes made to the backing tree behind the
+ * daemon's back would stay invisible until the timeouts expire.
+ *
+ * Every directory that the kernel learns about through the mount gets an
+ * inotify watch. Watches are added lazily from getattr()/readdir(), so
+ * only the part of the tree the kernel may actually have cached is
+ * watched, not the whole backing filesystem. A background thread turns
+ * inotify events into fuse_invalidate_path() calls for the changed entry
+ * and for the directory that contains it.
+ *
+ * Changes that come through the mount itself are already known to the
+ * kernel, so IN_MODIFY and IN_ATTRIB events for them would only throw
+ * away pages it just wrote. Files with writable handles open through the
+ * mount, and files the daemon changed by path in the last second, are
+ * remembered by dev/ino and such events for them are skipped.
+ *
+ * 커널 캐시를 켜더라도 하위 파일시스템의 변경 사항이 inotify를 통해 바로 반영되도록 한다.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#define WATCH_BUCKETS 4096
+#define WATCH_MASK (IN_ATTRIB | IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                    IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+#define WATCH_SELF_BUCKETS 256
+#define WATCH_SELF_NS 1000000000ULL /* how long after a change by path its events count as ours */
+
+struct watch_entry {
+    struct watch_entry *next; /* next entry in the same path bucket */
+    int wd;
+    char path[];
+};
+
+static int watch_fd = -1;
+static struct fuse *watch_fuse;
+static pthread_rwlock_t watch_lock = PTHREAD_RWLOCK_INITIALIZER; /* read-locked lookups, so stat() does not queue up */
+static struct watch_entry *watch_by_path[WATCH_BUCKETS];
+static struct watch_entry **watch_by_wd; /* indexed by watch descriptor */
+static size_t watch_nwd;
+
+/* a file changed through the mount, whose events the kernel does not need */
+struct watch_self {
+    struct watch_self *next;
+    dev_t dev;
+    ino_t ino;
+    int handles;        /* writable handles open through the mount */
+    uint64_t until;     /* CLOCK_MONOTONIC ns; events before this are ours too */
+};
+
+static struct watch_self *watch_self_tab[WATCH_SELF_BUCKETS];
+static pthread_mutex_t watch_self_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_size_t watch_self_count; /* entries in watch_self_tab, so events skip the lookup when there are none */
+
+static size_t watch_hash(const char *path)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for(; *path; path++){
+        h ^= (unsigned char) *path;
+        h *= 1099511628211ULL;
+    }
+    return h & (WATCH_BUCKETS - 1);
+}
+
+/* called with watch_lock held, for reading at least */
+static struct watch_entry *watch_find(const char *path)
+{
+    struct watch_entry *we = watch_by_path[watch_hash(path)];
+    for(; we != NULL; we = we->next)
+        if(strcmp(we->path, path) == 0)
+            return we;
+    return NULL;
+}
+
+/* called with watch_lock held for writing */
+static void watch_forget(int wd)
+{
+    if(wd < 0 || (size_t) wd >= watch_nwd || watch_by_wd[wd] == NULL)
+        return;
+    struct watch_entry *we = watch_by_wd[wd];
+    struct watch_entry **pp = &watch_by_path[watch_hash(we->path)];
+    while(*pp != we)
+        pp = &(*pp)->next;
+    *pp = we->next;
+    watch_by_wd[wd] = NULL;
+    free(we);
+}
+
+static uint64_t watch_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t watch_self_hash(dev_t dev, ino_t ino)
+{
+    return ((uint64_t) ino * 11400714819323198485ULL ^ dev) & (WATCH_SELF_BUCKETS - 1);
+}
+
+/*
+    adds handles to the entry of dev/ino and extends its grace period,
+    dropping expired entries of the same bucket on the way
+*/
+static void watch_self_update(dev_t dev, ino_t ino, int handles)
+{
+    uint64_t now = watch_now();
+    struct watch_self **pp = &watch_self_tab[watch_self_hash(dev, ino)];
+    struct watch_self *ws = NULL;
+
+    pthread_mutex_lock(&watch_self_lock);
+    while(*pp != NULL){
+        struct watch_self *e = *pp;
+        if(e->dev == dev && e->ino == ino){
+            ws = e;
+            pp = &e->next;
+        } else if(e->handles == 0 && e->until < now){
+            *pp = e->next;
+            free(e);
+            atomic_fetch_sub(&watch_self_count, 1);
+        } else {
+            pp = &e->next;
+        }
+    }
+    if(ws == NULL){
+        ws = calloc(1, sizeof(*ws));
+        if(ws == NULL){
+            pthread_mutex_unlock(&watch_self_lock);
+            return;
+        }
+        ws->dev = dev;
+        ws->ino = ino;
+        *pp = ws;
+        atomic_fetch_add(&watch_self_count, 1);
+    }
+    ws->handles += handles;
+    ws->until = now + WATCH_SELF_NS;
+    pthread_mutex_unlock(&watch_self_lock);
+}
+
+/* a writable handle to dev/ino was opened through the mount */
+static void watch_hold(dev_t dev, ino_t ino)
+{
+    if(watch_fd != -1)
+        watch_self_update(dev, ino, 1);
+}
+
+/* ...and released; events already queued for its writes are still ours */
+static void watch_unhold(dev_t dev, ino_t ino)
+{
+    if(watch_fd != -1)
+        watch_self_update(dev, ino, -1);
+}
+
+/* the daemon is about to change path without a writable handle */
+static void watch_touch(const char *path)
+{
+    struct stat st;
+
+    if(watch_fd != -1 && lstat(path, &st) == 0)
+        watch_self_update(st.st_dev, st.st_ino, 0);
+}
+
+/* whether dir/name is a file whose changes came through the mount */
+static int watch_is_self(const char *dir, const char *name)
+{
+    struct stat st;
+    char path[PATH_MAX];
+    int self = 0;
+
+    if(atomic_load(&watch_self_count) == 0)
+        return 0;
+    snprintf(path, sizeof(path), "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, name);
+    if(lstat(path, &st) == -1)
+        return 0;
+    uint64_t now = watch_now();
+    pthread_mutex_lock(&watch_self_lock);
+    for(struct watch_self *ws = watch_self_tab[watch_self_hash(st.st_dev, st.st_ino)]; ws != NULL; ws = ws->next)
+        if(ws->dev == st.st_dev && ws->ino == st.st_ino){
+            self = ws->handles > 0 || ws->until >= now;
+            break;
+        }
+    pthread_mutex_unlock(&watch_self_lock);
+    return self;
+}
+
+/* start watching directory dir unless it is watched already under this path */
+static void watch_dir(const char *dir)
+{
+    static int warned;
+
+    if(watch_fd == -1)
+        return;
+    pthread_rwlock_rdlock(&watch_lock);
+    int found = watch_find(dir) != NULL;
+    pthread_rwlock_unlock(&watch_lock);
+    if(found)
+        return;
+
+    int wd = inotify_add_watch(watch_fd, dir, WATCH_MASK);
+    if(wd == -1){
+        if(errno == ENOSPC && !warned){
+            warned = 1;
+            fprintf(stderr, "my_passthrough: out of inotify watches, "
+                "raise fs.inotify.max_user_watches; changes below %s "
+                "are visible only after the cache timeouts\n", dir);
+        }
+        return;
+    }
+
+    struct watch_entry *we = malloc(sizeof(*we) + strlen(dir) + 1);
+    if(we == NULL)
+        return;
+    we->wd = wd;
+    strcpy(we->path, dir);
+
+    pthread_rwlock_wrlock(&watch_lock);
+    if((size_t) wd >= watch_nwd){
+        size_t n = watch_nwd ? watch_nwd : 1024;
+        while(n <= (size_t) wd)
+            n *= 2;
+        struct watch_entry **tab = realloc(watch_by_wd, n * sizeof(*tab));
+        if(tab == NULL){
+            pthread_rwlock_unlock(&watch_lock);
+            free(we);
+            return;
+        }
+        memset(tab + watch_nwd, 0, (n - watch_nwd) * sizeof(*tab));
+        watch_by_wd = tab;
+        watch_nwd = n;
+    }
+    if(watch_by_wd[wd] != NULL){
+        if(strcmp(watch_by_wd[wd]->path, dir) == 0){
+            /* another thread won the race, inotify returned the same wd */
+            pthread_rwlock_unlock(&watch_lock);
+            free(we);
+            return;
+        }
+        /* the directory was renamed (or one of its parents was): events
+           for wd are about the new path from now on */
+        watch_forget(wd);
+    }
+    watch_by_wd[wd] = we;
+    size_t b = watch_hash(dir);
+    we->next = watch_by_path[b];
+    watch_by_path[b] = we;
+    pthread_rwlock_unlock(&watch_lock);
+}
+
+/* watch the directory that contains path, and path itself if it is one */
+static void watch_path(const char *path, mode_t mode)
+{
+    char dir[PATH_MAX];
+
+    if(watch_fd == -1)
+        return;
+    if(S_ISDIR(mode))
+        watch_dir(path);
+    const char *slash = strrchr(path, '/');
+    if(slash == NULL || (size_t) (slash - path) >= sizeof(dir))
+        return;
+    if(slash == path){
+        watch_dir("/");
+        return;
+    }
+    memcpy(dir, path, slash - path);
+    dir[slash - path] = '\0';
+    watch_dir(dir);
+}
+
+static void watch_invalidate(const char *dir, const char *name)
+{
+    char path[PATH_MAX];
+
+    if(name == NULL){
+        fuse_invalidate_path(watch_fuse, dir);
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, name);
+    fuse_invalidate_path(watch_fuse, path);
+}
+
+/* the kernel dropped events: every watched directory may be stale */
+static void watch_invalidate_all(void)
+{
+    pthread_rwlock_rdlock(&watch_lock);
+    for(size_t wd = 0; wd < watch_nwd; wd++)
+        if(watch_by_wd[wd] != NULL)
+            fuse_invalidate_path(watch_fuse, watch_by_wd[wd]->path);
+    pthread_rwlock_unlock(&watch_lock);
+}
+
+static void *watch_thread(void *arg)
+{
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char dir[PATH_MAX];
+    (void) arg;
+
+    for(;;){
+        ssize_t len = read(watch_fd, buf, sizeof(buf));
+        if(len == -1){
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+        for(char *p = buf; p < buf + len;){
+            struct inotify_event *ev = (struct inotify_event *) p;
+            p += sizeof(*ev) + ev->len;
+
+            if(ev->mask & IN_Q_OVERFLOW){
+                watch_invalidate_all();
+                continue;
+            }
+            if(ev->mask & IN_IGNORED)
+                pthread_rwlock_wrlock(&watch_lock);
+            else
+                pthread_rwlock_rdlock(&watch_lock);
+            if(ev->wd < 0 || (size_t) ev->wd >= watch_nwd || watch_by_wd[ev->wd] == NULL){
+                pthread_rwlock_unlock(&watch_lock);
+                continue;
+            }
+            strcpy(dir, watch_by_wd[ev->wd]->path);
+            if(ev->mask & IN_IGNORED)
+                watch_forget(ev->wd);
+            pthread_rwlock_unlock(&watch_lock);
+
+            if(ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)){
+                /* the watch no longer matches the path it was added for */
+                inotify_rm_watch(watch_fd, ev->wd);
+                watch_invalidate(dir, NULL);
+                continue;
+            }
+            if(ev->len != 0 && (ev->mask & ~(IN_MODIFY | IN_ATTRIB | IN_ISDIR)) == 0 &&
+               watch_is_self(dir, ev->name))
+                continue; /* the kernel made this change itself */
+            if(ev->len != 0)
+                watch_invalidate(dir, ev->name);
+            if(ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+                watch_invalidate(dir, NULL); /* size, mtime and listing of the directory */
+        }
+    }
+    return NULL;
+}
+
+/* must be called from init(), once the filesystem is mounted */
+static int watch_start(struct fuse *fuse)
+{
+    pthread_t tid;
+
+    watch_fuse = fuse;
+    watch_fd = inotify_init1(IN_CLOEXEC);
+    if(watch_fd == -1)
+        return -errno;
+    if(pthread_create(&tid, NULL, watch_thread, NULL) != 0){
+        close(watch_fd);
+        watch_fd = -1;
+        return -EAGAIN;
+    }
+    pthread_detach(tid);
+    return 0;
+}
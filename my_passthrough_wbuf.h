@@ -0,0 +1,387 @@
+/*
+ * Per-handle write coalescing for my_passthrough
+ *
+ * Without the kernel writeback cache every write(2) on the mount reaches
+ * the daemon as one request, and clients that append a log in 4-16 KiB
+ * pieces turn into just as many small pwrite()s on the backing file.
+ * With --write-buffer=KiB each open file gets a buffer that collects
+ * writes continuing where the previous one ended. The buffer is written
+ * out with one pwritev() when it reaches the next multiple of its size in
+ * the file, so batches after the first are aligned, and it is also
+ * written when
+ *   - a write does not continue the buffered range,
+ *   - a read or write through any other handle of the same file, or a
+ *     write without a handle, overlaps it,
+ *   - the handle is flushed (close), fsync'ed, truncated or released,
+ *   - another handle opens the same file, and
+ *   - it has been sitting longer than --write-flush-ms (flusher thread).
+ *
+ * A failed background write is reported by the next write, flush or
+ * fsync of the handle, like a delayed write error on a local filesystem.
+ *
+ * 버퍼에 쓰인 범위만큼 getattr이 돌려주는 크기도 늘려서(wbuf_stat()) 아직 하위 파일에
+ * 쓰이지 않은 데이터 때문에 파일 크기가 줄어 보이지 않게 한다.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+struct wbuf {
+    struct wbuf *next, *prev;   /* list of all buffers, for the flusher and wbuf_stat() */
+    pthread_mutex_t lock;
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    char *data;
+    off_t off;                  /* file offset of data[0] */
+    size_t len;                 /* bytes buffered */
+    uint64_t since;             /* CLOCK_MONOTONIC ns of the oldest buffered byte */
+    int error;                  /* errno of a failed background write, reported once */
+};
+
+static size_t wbuf_size;            /* --write-buffer, 0 = no buffering */
+static unsigned int wbuf_flush_ms = 50;
+static struct wbuf wbuf_list = { .next = &wbuf_list, .prev = &wbuf_list };
+static pthread_mutex_t wbuf_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_size_t wbuf_count;    /* buffers in wbuf_list, so reads skip the walk when there are none */
+
+/* coalescing counters, printed in /.myfs_stats */
+static atomic_uint_fast64_t wbuf_writes;    /* write requests taken into a buffer */
+static atomic_uint_fast64_t wbuf_direct;    /* write requests passed straight through */
+static atomic_uint_fast64_t wbuf_flushes;   /* pwritev() calls that emptied a buffer */
+static atomic_uint_fast64_t wbuf_bytes;     /* bytes written by those calls */
+
+static uint64_t wbuf_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* buffer for descriptor fd of the regular file st, or NULL if buffering
+   is off, fd is read-only or memory is short */
+static struct wbuf *wbuf_new(int fd, const struct stat *st)
+{
+    struct wbuf *wb;
+
+    if(wbuf_size == 0 || !S_ISREG(st->st_mode) || (fcntl(fd, F_GETFL) & O_ACCMODE) == O_RDONLY)
+        return NULL;
+    wb = calloc(1, sizeof(*wb));
+    if(wb == NULL)
+        return NULL;
+    wb->data = malloc(wbuf_size);
+    if(wb->data == NULL){
+        free(wb);
+        return NULL;
+    }
+    pthread_mutex_init(&wb->lock, NULL);
+    wb->fd = fd;
+    wb->dev = st->st_dev;
+    wb->ino = st->st_ino;
+
+    pthread_mutex_lock(&wbuf_list_lock);
+    wb->next = wbuf_list.next;
+    wb->prev = &wbuf_list;
+    wb->next->prev = wb;
+    wbuf_list.next = wb;
+    atomic_fetch_add(&wbuf_count, 1);
+    pthread_mutex_unlock(&wbuf_list_lock);
+    return wb;
+}
+
+/* write out the buffer followed by extra (may be empty); called with wb->lock held */
+static int wbuf_write_locked(struct wbuf *wb, const char *extra, size_t extra_len)
+{
+    struct iovec iov[2] = {
+        { wb->data, wb->len },
+        { (void *) extra, extra_len },
+    };
+    size_t total = wb->len + extra_len, done = 0;
+    int iovcnt = 2;
+    struct iovec *v = iov;
+
+    while(done < total){
+        ssize_t res = pwritev(wb->fd, v, iovcnt, wb->off + done);
+        if(res == -1){
+            if(errno == EINTR)
+                continue;
+            wb->len = 0;
+            return -errno;
+        }
+        if(res == 0){
+            wb->len = 0;
+            return -EIO;
+        }
+        done += res;
+        while(iovcnt > 0 && (size_t) res >= v->iov_len){   /* short write: skip what went out */
+            res -= v->iov_len;
+            v++;
+            iovcnt--;
+        }
+        if(iovcnt > 0){
+            v->iov_base = (char *) v->iov_base + res;
+            v->iov_len -= res;
+        }
+    }
+    if(total != 0){
+        atomic_fetch_add_explicit(&wbuf_flushes, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&wbuf_bytes, total, memory_order_relaxed);
+    }
+    wb->len = 0;
+    return 0;
+}
+
+static int wbuf_flush_locked(struct wbuf *wb)
+{
+    int res = 0;
+
+    if(wb->len != 0)
+        res = wbuf_write_locked(wb, NULL, 0);
+    if(res == 0 && wb->error != 0){
+        res = -wb->error;
+        wb->error = 0;
+    }
+    return res;
+}
+
+static int wbuf_flush(struct wbuf *wb)
+{
+    int res;
+
+    if(wb == NULL)
+        return 0;
+    pthread_mutex_lock(&wb->lock);
+    res = wbuf_flush_locked(wb);
+    pthread_mutex_unlock(&wb->lock);
+    return res;
+}
+
+/* flush every buffer of dev/ino except self that overlaps [off, off + size),
+   before a write elsewhere, so the older buffered data cannot land on top of it */
+static void wbuf_flush_others(struct wbuf *self, dev_t dev, ino_t ino, off_t off, size_t size)
+{
+    if(atomic_load(&wbuf_count) == (self != NULL))
+        return;     /* no buffer but self */
+    pthread_mutex_lock(&wbuf_list_lock);
+    for(struct wbuf *wb = wbuf_list.next; wb != &wbuf_list; wb = wb->next){
+        if(wb == self || wb->dev != dev || wb->ino != ino)
+            continue;
+        pthread_mutex_lock(&wb->lock);
+        if(wb->len != 0 && off < wb->off + (off_t) wb->len && wb->off < off + (off_t) size){
+            int res = wbuf_write_locked(wb, NULL, 0);
+            if(res < 0)
+                wb->error = -res;
+        }
+        pthread_mutex_unlock(&wb->lock);
+    }
+    pthread_mutex_unlock(&wbuf_list_lock);
+}
+
+/* same for all buffers, before a read through any handle: wbuf_stat()
+   already reports their data */
+static void wbuf_flush_range(dev_t dev, ino_t ino, off_t off, size_t size)
+{
+    wbuf_flush_others(NULL, dev, ino, off, size);
+}
+
+/* same for a descriptor that has no handle of its own */
+static void wbuf_flush_fd_range(int fd, off_t off, size_t size)
+{
+    struct stat st;
+
+    if(atomic_load(&wbuf_count) != 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        wbuf_flush_range(st.st_dev, st.st_ino, off, size);
+}
+
+/*
+   Take a write of size bytes at off. Returns size, or -errno if the write
+   or an earlier background write failed.
+*/
+static ssize_t wbuf_write(struct wbuf *wb, const char *buf, size_t size, off_t off)
+{
+    ssize_t res = size;
+    off_t limit;
+    int err;
+
+    pthread_mutex_lock(&wb->lock);
+    if(wb->error != 0){
+        res = -wb->error;
+        wb->error = 0;
+        goto out;
+    }
+    if(wb->len != 0 && off != wb->off + (off_t) wb->len){
+        /* does not continue the buffered range */
+        if((err = wbuf_write_locked(wb, NULL, 0)) < 0){
+            res = err;
+            goto out;
+        }
+    }
+    if(wb->len == 0){
+        if(size >= wbuf_size){  /* large enough on its own */
+            atomic_fetch_add_explicit(&wbuf_direct, 1, memory_order_relaxed);
+            pthread_mutex_unlock(&wb->lock);
+            res = pwrite(wb->fd, buf, size, off);
+            return res == -1 ? -errno : res;
+        }
+        wb->off = off;
+        wb->since = wbuf_now();
+    }
+    atomic_fetch_add_explicit(&wbuf_writes, 1, memory_order_relaxed);
+
+    /* the buffer ends at the next multiple of wbuf_size in the file */
+    limit = (wb->off / wbuf_size + 1) * wbuf_size;
+    if(wb->off + (off_t) (wb->len + size) < limit){
+        memcpy(wb->data + wb->len, buf, size);
+        wb->len += size;
+        goto out;
+    }
+    /* write the buffer and the head of this write up to the boundary in one go */
+    size_t head = limit - (wb->off + wb->len);
+    if((err = wbuf_write_locked(wb, buf, head)) < 0){
+        res = err;
+        goto out;
+    }
+    buf += head;
+    size -= head;
+    wb->off = limit;
+    wb->since = wbuf_now();
+    while(size >= wbuf_size){   /* whole aligned chunks go straight out */
+        ssize_t n = pwrite(wb->fd, buf, wbuf_size, wb->off);
+        if(n <= 0){
+            res = n == 0 ? -EIO : -errno;
+            goto out;
+        }
+        buf += n;
+        size -= n;
+        wb->off += n;
+    }
+    memcpy(wb->data, buf, size);
+    wb->len = size;
+out:
+    pthread_mutex_unlock(&wb->lock);
+    return res;
+}
+
+static void wbuf_free(struct wbuf *wb)
+{
+    if(wb == NULL)
+        return;
+    pthread_mutex_lock(&wbuf_list_lock);
+    wb->prev->next = wb->next;
+    wb->next->prev = wb->prev;
+    atomic_fetch_sub(&wbuf_count, 1);
+    pthread_mutex_unlock(&wbuf_list_lock);
+    pthread_mutex_destroy(&wb->lock);
+    free(wb->data);
+    free(wb);
+}
+
+/* another handle is opening or truncating dev/ino: make buffered data visible to it */
+static void wbuf_flush_inode(dev_t dev, ino_t ino)
+{
+    if(atomic_load(&wbuf_count) == 0)
+        return;
+    pthread_mutex_lock(&wbuf_list_lock);
+    for(struct wbuf *wb = wbuf_list.next; wb != &wbuf_list; wb = wb->next){
+        if(wb->dev != dev || wb->ino != ino)
+            continue;
+        pthread_mutex_lock(&wb->lock);
+        if(wb->len != 0){
+            int res = wbuf_write_locked(wb, NULL, 0);
+            if(res < 0)
+                wb->error = -res;
+        }
+        pthread_mutex_unlock(&wb->lock);
+    }
+    pthread_mutex_unlock(&wbuf_list_lock);
+}
+
+/* same for a path, before path based calls that must come after the buffered writes */
+static void wbuf_flush_path(const char *path)
+{
+    struct stat st;
+
+    if(wbuf_size != 0 && stat(path, &st) == 0 && S_ISREG(st.st_mode))
+        wbuf_flush_inode(st.st_dev, st.st_ino);
+}
+
+/* grow st_size of a regular file to cover data still sitting in buffers */
+static void wbuf_stat(struct stat *st)
+{
+    if(wbuf_size == 0 || !S_ISREG(st->st_mode))
+        return;
+    pthread_mutex_lock(&wbuf_list_lock);
+    for(struct wbuf *wb = wbuf_list.next; wb != &wbuf_list; wb = wb->next){
+        if(wb->dev != st->st_dev || wb->ino != st->st_ino)
+            continue;
+        pthread_mutex_lock(&wb->lock);
+        if(wb->len != 0 && wb->off + (off_t) wb->len > st->st_size)
+            st->st_size = wb->off + wb->len;
+        pthread_mutex_unlock(&wb->lock);
+    }
+    pthread_mutex_unlock(&wbuf_list_lock);
+}
+
+static void *wbuf_flusher(void *arg)
+{
+    uint64_t max_age = (uint64_t) wbuf_flush_ms * 1000000;
+    struct timespec ts = { wbuf_flush_ms / 2000, (long) (wbuf_flush_ms % 2000) * 500000 };
+    (void) arg;
+
+    for(;;){
+        nanosleep(&ts, NULL);
+        uint64_t now = wbuf_now();
+        pthread_mutex_lock(&wbuf_list_lock);
+        for(struct wbuf *wb = wbuf_list.next; wb != &wbuf_list; wb = wb->next){
+            if(pthread_mutex_trylock(&wb->lock) != 0)
+                continue;   /* busy, so not idle either */
+            if(wb->len != 0 && now - wb->since >= max_age){
+                int res = wbuf_write_locked(wb, NULL, 0);
+                if(res < 0)
+                    wb->error = -res;
+            }
+            pthread_mutex_unlock(&wb->lock);
+        }
+        pthread_mutex_unlock(&wbuf_list_lock);
+    }
+    return NULL;
+}
+
+static int wbuf_start(size_t size, unsigned int flush_ms)
+{
+    pthread_t tid;
+
+    wbuf_size = size;
+    wbuf_flush_ms = flush_ms ? flush_ms : 1;
+    if(wbuf_size == 0)
+        return 0;
+    if(pthread_create(&tid, NULL, wbuf_flusher, NULL) != 0){
+        wbuf_size = 0;
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+/* snprintf() style, for the stats file */
+static int wbuf_format(char *buf, size_t size)
+{
+    uint64_t writes = atomic_load(&wbuf_writes), flushes = atomic_load(&wbuf_flushes);
+
+    if(wbuf_size == 0)
+        return snprintf(buf, size, "%s", "");
+    return snprintf(buf, size, "write buffer: %llu writes in %llu batches (%.1f per batch, %llu bytes), "
+                    "%llu large writes passed through\n",
+                    (unsigned long long) writes, (unsigned long long) flushes,
+                    flushes ? (double) writes / flushes : 0.0,
+                    (unsigned long long) atomic_load(&wbuf_bytes),
+                    (unsigned long long) atomic_load(&wbuf_direct));
+}
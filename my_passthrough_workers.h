@@ -0,0 +1,71 @@
+/*
+ * Worker threads of the my_passthrough dispatcher
+ *
+ * libfuse's multi-threaded loop starts worker threads on demand. The first
+ * request a thread handles gives it a worker slot; with --pin-workers the
+ * thread is also pinned to one CPU (round robin), and every worker reads
+ * requests from its own /dev/fuse clone fd (clone_fd), so parallel clients
+ * are spread over the cores instead of queueing behind one reader.
+ *
+ * 각 worker가 처리한 요청 수를 센다. counter는 cache line 단위로 떨어뜨려서
+ * worker끼리 같은 cache line을 두고 다투지 않게 한다.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define MAX_WORKERS 256 /* workers beyond this share the last slot */
+
+struct worker_slot {
+    atomic_uint_fast64_t requests;
+    int cpu; /* -1 if the worker is not pinned */
+} __attribute__((aligned(64)));
+
+static struct worker_slot workers[MAX_WORKERS];
+static atomic_int nworkers;
+static int pin_workers;
+static __thread struct worker_slot *this_worker;
+
+/* slow path of worker_count(): first request on this thread */
+static struct worker_slot *worker_register(void)
+{
+    int id = atomic_fetch_add(&nworkers, 1);
+    struct worker_slot *w = &workers[id < MAX_WORKERS ? id : MAX_WORKERS - 1];
+
+    w->cpu = -1;
+    if(pin_workers){
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(id % (ncpu > 0 ? ncpu : 1), &set);
+        if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0)
+            w->cpu = id % (ncpu > 0 ? ncpu : 1);
+    }
+    return w;
+}
+
+/* called at the start of every request */
+static inline void worker_count(void)
+{
+    if(this_worker == NULL)
+        this_worker = worker_register();
+    atomic_fetch_add_explicit(&this_worker->requests, 1, memory_order_relaxed);
+}
+
+static void worker_report(FILE *out)
+{
+    int n = atomic_load(&nworkers);
+
+    if(n > MAX_WORKERS)
+        n = MAX_WORKERS;
+    for(int i = 0; i < n; i++){
+        fprintf(out, "worker %3d", i);
+        if(workers[i].cpu >= 0)
+            fprintf(out, " (cpu %d)", workers[i].cpu);
+        fprintf(out, ": %llu requests\n",
+                (unsigned long long) atomic_load(&workers[i].requests));
+    }
+}
@@ -1,12 +1,16 @@
 /*
    Simple File system in User Space
 
-   Name: Han Yejin 
+   Name: Han Yejin
    Email : hyj97225@gmail.com
  */
 
 #define FUSE_USE_VERSION 31
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include <fuse.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -15,217 +19,954 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stddef.h>
-/* each array can store 256 strings and each string has the maximum length of 256 bytes. */
-char dir_list[256][256]; //maintains the names of directories that have been created by the user
-int curr_dir_idx = -1; //current index of each array
+#include <limits.h>
+#include <sys/statvfs.h>
+
+#include "myfs_inode.h"
+#include "myfs_journal.h"
+#include "myfs_snapshot.h"
+#include "myfs_trace.h"
+
+#define STATS_PATH "/.myfs_stats" //read-only file with the allocator counters
+#define CTL_PATH "/.myfs_ctl" //write-only file taking snapshot and clone commands
 
-char files_list[256][256]; //maintains the names of files that have been created by the user
-int curr_file_idx = -1;
+/* command line options, parsed with fuse_opt_parse() */
+static struct options {
+	const char *max_memory; //cap on all memory used for the filesystem, e.g. 512M or 4G
+	int trace; //trace level of myfs_trace.h, SIGUSR2 changes it at runtime
+	const char *trace_file; //where trace records go, stderr by default
+	const char *store; //directory with the journal and checkpoint of myfs_journal.h, none by default
+	int commit_ms; //the journal is written out at least this often
+	int checkpoint_secs; //a new checkpoint image at most this often, 0: no periodic images
+	const char *compress; //lz4 or zstd[:LEVEL] for extents that went cold, none by default
+	int compress_secs; //how often the packer visits every file
+	const char *compress_cache; //decompressed extents kept for reads
+	int dedup; //store identical extents once (myfs_dedup.h)
+} options = {
+	.commit_ms = 5,
+	.checkpoint_secs = 300,
+	.compress_secs = 30,
+};
+
+static FILE *trace_file;
 
-char files_content[256][256]; //maintains the contents of the files
-int curr_file_content_idx = -1;
+#define OPTION(t, p) { t, offsetof(struct options, p), 1 }
+static const struct fuse_opt option_spec[] = {
+	OPTION("--max-memory=%s", max_memory),
+	OPTION("--trace=%d", trace),
+	OPTION("--trace-file=%s", trace_file),
+	OPTION("--store=%s", store),
+	OPTION("--commit-ms=%d", commit_ms),
+	OPTION("--checkpoint-secs=%d", checkpoint_secs),
+	OPTION("--compress=%s", compress),
+	OPTION("--compress-secs=%d", compress_secs),
+	OPTION("--compress-cache=%s", compress_cache),
+	OPTION("--dedup", dedup),
+	FUSE_OPT_END
+};
 
-void add_dir( const char *dir_name){
-	printf("[add_dir] Called\n");
-	printf("\tAttributes of %s requested\n", dir_name);
-	curr_dir_idx++;
-	//store the names of the objects instead of their paths
-	strcpy(dir_list[curr_dir_idx], dir_name); 
-	printf("[add_dir] Complete!!\n");
+/* parse a size with an optional K, M or G suffix; 0 on error */
+static size_t parse_size(const char *str){
+	char *end;
+	unsigned long long size = strtoull(str, &end, 10);
+	switch(*end){
+	case 'G': case 'g': size <<= 10; /* fall through */
+	case 'M': case 'm': size <<= 10; /* fall through */
+	case 'K': case 'k': size <<= 10; end++; break;
+	case '\0': break;
+	default: return 0;
+	}
+	return *end == '\0' ? size : 0;
 }
 
+/* without --max-memory the filesystem may use half of the physical memory */
+static size_t default_max_memory(void){
+	return (size_t) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 2;
+}
 
-/*check if this path is a directory available in the filesystem
-  by trying to find the name of directory in the "dir_list"*/
+static int is_stats(const char *path){
+	return strcmp(path, STATS_PATH) == 0;
+}
 
-int is_dir( const char * path){
-	path++;	//Eliminating "/" in the path, root-level-only objects
-	for(int curr_idx = 0; curr_idx <=curr_dir_idx; curr_idx++)
-		if( strcmp(path, dir_list[ curr_idx] ) == 0)
-			return 1;
-	return 0;
+static int is_ctl(const char *path){
+	return strcmp(path, CTL_PATH) == 0;
 }
 
-void add_file( const char *filename){
-	printf("[add_file] Called\n");
-	printf("\tAttributes of %s requested\n", filename);
-	curr_file_idx++;
-	strcpy( files_list[ curr_file_idx], filename);
+/* snprintf() style text of the stats file */
+static int format_stats(char *buf, size_t size){
+	int len = slab_format_stats(buf, size);
+	len += journal_format(buf && (size_t) len < size ? buf + len : NULL, (size_t) len < size ? size - len : 0);
+	len += pack_format(buf && (size_t) len < size ? buf + len : NULL, (size_t) len < size ? size - len : 0);
+	len += dedup_format(buf && (size_t) len < size ? buf + len : NULL, (size_t) len < size ? size - len : 0);
+	len += snapshot_format(buf && (size_t) len < size ? buf + len : NULL, (size_t) len < size ? size - len : 0);
+	return len;
+}
 
-	curr_file_content_idx++;
-	strcpy( files_content[ curr_file_content_idx], ""); //initialize the content of this file to be an empty string
-	printf("[add_file] Complete!!\n");
+/* the stats file as it was at open: every read of one open sees the same
+   text, and direct_io lets it end where the text does */
+struct stats_text {
+	size_t len;
+	char text[];
+};
+
+static struct stats_text *stats_text_new(void){
+	int len = format_stats(NULL, 0);
+	struct stats_text *t = malloc(sizeof(*t) + len + 1);
+	if(t == NULL)
+		return NULL;
+	format_stats(t->text, len + 1); //may have grown in between, then it is cut
+	t->len = strlen(t->text);
+	return t;
 }
 
-// see if there is a file with the same name exists in the filesystem.
-int is_file(const char *path){
-	printf("[is_file] Called\n");
-	printf("\tAttributes of %s requested\n", path);
-	path++;	//Eliminating "/" in the path
-	for(int curr_idx = 0; curr_idx <= curr_file_idx; curr_idx++)
-		if( strcmp( path, files_list[curr_idx] ) == 0)
-			return 1;
-	return 0;
+/* create a new object named by the last component of path.
+   Objects live in the per-directory hash tables of myfs_inode.h,
+   so nested directories work and there is no limit on their number. */
+static int add_inode( const char *path, mode_t mode){
+	const char *name;
+	size_t len;
+	int res;
+	struct myfs_inode *parent = path_private_parent(path, &name, &len, &res);
+	if(parent == NULL)
+		return res;
+	if(is_stats(path) || is_ctl(path))
+		return -EEXIST;
+
+	struct myfs_inode *inode = inode_new(mode);
+	if(inode == NULL)
+		return -ENOSPC;
+	dir_lock(parent);
+	res = parent->nlink == 0 ? -ENOENT : dir_add(parent, name, len, inode); //removed since the lookup
+	dir_unlock(parent);
+	if(res != 0)
+		inode_free(inode); //never visible to anyone else
+	return res;
 }
 
-int get_file_index(const char *path){
-	path++; //Eliminating "/" in the path
+static int add_dir( const char *path, mode_t mode){
+	return add_inode(path, S_IFDIR | (mode & 07777));
+}
 
-	for(int curr_idx = 0; curr_idx <= curr_file_idx; curr_idx++){
-		if( strcmp( path, files_list[curr_idx] ) ==0)
-			return curr_idx;
-	}
-	return -1;
+static int add_file( const char *path, mode_t mode){
+	return add_inode(path, S_IFREG | (mode & 07777));
 }
 
-static int  write_to_file( const char *path, const char *new_content){
-	printf("yejin's write_to_file start\n");
-	int file_idx = get_file_index(path);
+/* write size bytes at offset; the file grows as needed and any gap
+   between the old end of file and offset becomes a hole.
+   Writers share the file's lock and hold only their byte range, so
+   writes to disjoint parts of one file run in parallel. */
+static int write_to_file( const char *path, const char *buffer, size_t size, off_t offset){
+	int err;
+	struct myfs_inode *inode = path_private(path, &err);
 
-	if( file_idx == -1)
+	if(inode == NULL)
+		return err;
+	if(S_ISDIR(inode->mode))
+		return -EISDIR;
+	if(size == 0)
 		return 0;
-	strcpy(files_content[file_idx], new_content);
-	int ret = sizeof(new_content);
-	return ret;
+	range_lock(inode, offset, offset + size);
+	pthread_rwlock_rdlock(&inode->lock);
+	size_t last = (offset + size - 1) >> MYFS_EXTENT_SHIFT;
+	if(last >= inode->data.nmap){
+		/* the map has to be replaced: wait for the readers and writers using it */
+		pthread_rwlock_unlock(&inode->lock);
+		pthread_rwlock_wrlock(&inode->lock);
+		err = filedata_reserve(&inode->data, last);
+		pthread_rwlock_unlock(&inode->lock);
+		pthread_rwlock_rdlock(&inode->lock); //the map never shrinks, it is still large enough
+		if(err != 0){
+			pthread_rwlock_unlock(&inode->lock);
+			range_unlock(inode, offset, offset + size);
+			return err;
+		}
+	}
+	ssize_t res = filedata_write(&inode->data, buffer, size, offset);
+	if(res > 0){
+		off_t end = offset + res, cur = __atomic_load_n(&inode->size, __ATOMIC_RELAXED);
+		while(end > cur && !__atomic_compare_exchange_n(&inode->size, &cur, end, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			;
+		inode_touch(inode);
+	}
+	pthread_rwlock_unlock(&inode->lock);
+	range_unlock(inode, offset, offset + size);
+	return res;
 }
 
-/*
-void write_to_file ( const char *path, const char *new_content){
-	printf("yejin's write_to_file start!\n");
-	int file_idx = get_file_index(path);
+/* lock extent idx of a file as a write would and hand it to fn if it
+   still holds slot; fn is one of the filedata_* steps of the packer */
+static void on_extent(struct myfs_inode *inode, size_t idx, uintptr_t slot,
+		void (*fn)(struct myfs_filedata *fd, size_t idx, uintptr_t slot)){
+	off_t start = (off_t) idx << MYFS_EXTENT_SHIFT;
 
-	if( file_idx == -1) // No such file
-		return;
-	strcpy(files_content[file_idx], new_content);
+	range_lock(inode, start, start + MYFS_EXTENT_SIZE);
+	pthread_rwlock_rdlock(&inode->lock);
+	if(__atomic_load_n(&inode->data.map[idx], __ATOMIC_ACQUIRE) == slot)
+		fn(&inode->data, idx, slot);
+	pthread_rwlock_unlock(&inode->lock);
+	range_unlock(inode, start, start + MYFS_EXTENT_SIZE);
+}
+
+/* --dedup: share the plain extents in [first, end) of a file right away
+   instead of on the packer's next pass */
+static void dedup_extents(struct myfs_inode *inode, size_t first, size_t end){
+	for(size_t idx = first; idx < end; idx++){
+		pthread_rwlock_rdlock(&inode->lock);
+		if(idx >= inode->data.nmap){
+			pthread_rwlock_unlock(&inode->lock);
+			return;
+		}
+		uintptr_t slot = __atomic_load_n(&inode->data.map[idx], __ATOMIC_ACQUIRE);
+		pthread_rwlock_unlock(&inode->lock);
+		if(slot != 0 && !(slot & (EXTENT_PACKED | EXTENT_SHARED)))
+			on_extent(inode, idx, slot, filedata_dedup);
+	}
 }
-*/
-// will be executed when the system asks for attributes of a file or a directory that 
+
+// will be executed when the system asks for attributes of a file or a directory that
 // were stored in the mount point
 
 static int do_getattr(const char *path, struct stat *st, struct fuse_file_info *fi){
-	printf("[getattr] Called\n");
-	printf("\tAttributes of %s requested\n", path);
 	(void) fi;
-	st->st_uid = getuid(); // The owner of the file/directory is the user who mounted the filesystem
-	st->st_gid = getgid(); // The group of the file/directory is the same as the group of the user who mounted filesystem
-	st->st_atime = st->st_mtime = time(NULL);
-	if(strcmp(path, "/") == 0){
-		st->st_mode = S_IFDIR | 0755;
-		st->st_nlink = 2;
-	}
-	else if(is_dir(path) == 1){
-		st->st_mode = S_IFDIR | 0755;
-		st->st_nlink = 2;
-	}
-	else if(is_file(path) == 1)
-	{
-		st->st_mode = S_IFREG | 0644;
+	if(is_stats(path)){
+		memset(st, 0, sizeof(*st));
+		st->st_mode = S_IFREG | 0444;
 		st->st_nlink = 1;
-		st->st_size = 1024;
+		st->st_uid = getuid();
+		st->st_gid = getgid();
+		st->st_size = format_stats(NULL, 0);
+		return 0;
 	}
-	else{
-		return -ENOENT;
+	if(is_ctl(path)){
+		memset(st, 0, sizeof(*st));
+		st->st_mode = S_IFREG | 0200;
+		st->st_nlink = 1;
+		st->st_uid = getuid();
+		st->st_gid = getgid();
+		return 0;
 	}
+	struct myfs_inode *inode = path_lookup(path);
+	if(inode == NULL)
+		return -ENOENT;
+	inode_stat(inode, st);
+	st->st_ino = snapshot_ino(path, st->st_ino); //a snapshot's view is not the live file
 	return 0;
 }
 
 // will be executed when the system asks for a list of files that were stored in the mount point
-static int do_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, 
+static int do_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset,
 		struct fuse_file_info *fi, enum fuse_readdir_flags flags){
-	printf("--> readdir: Getting The List of Files of %s\n", path);
 	(void) offset;
 	(void) fi;
 	(void) flags;
-	
-	if(strcmp ( path, "/" ) != 0)
-		return 0;
+
+	struct myfs_inode *dir = path_lookup(path);
+	if(dir == NULL)
+		return -ENOENT;
+	if(!S_ISDIR(dir->mode))
+		return -ENOTDIR;
 	filler(buffer, ".", NULL, 0, 0); //Current Directory
 	filler(buffer, "..", NULL, 0, 0); //Parent Directory
-	
-// if the user is trying to show the files/directories of the root directory show the following
-		for(int curr_idx = 0; curr_idx <= curr_dir_idx; curr_idx++)
-			filler(buffer, dir_list[curr_idx], NULL, 0, 0);
-		for(int curr_idx = 0; curr_idx <= curr_file_idx; curr_idx++)
-			filler(buffer, files_list[curr_idx], NULL, 0, 0);
+
+	pthread_rwlock_rdlock(&dir->lock); //keeps changes, and dir_grow() in particular, out
+	for(size_t b = 0; b < dir->nbuckets; b++)
+		for(struct myfs_dirent *de = dir->buckets[b]; de != NULL; de = de->next)
+			filler(buffer, de->name, NULL, 0, 0);
+	pthread_rwlock_unlock(&dir->lock);
 	return 0;
 }
 
-static int do_read( const char *path, char *buffer, size_t size, off_t offset, 
+static int do_read( const char *path, char *buffer, size_t size, off_t offset,
 		struct fuse_file_info *fi){
-	printf("-->Trying to read %s, %lu, %lu\n", path, offset, size);
 	(void) fi;
 
-	if(is_file(path) != 1)
+	if(is_stats(path)){
+		struct stats_text *t = (struct stats_text *) (uintptr_t) fi->fh;
+		if((size_t) offset >= t->len)
+			return 0;
+		if(size > t->len - offset)
+			size = t->len - offset;
+		memcpy(buffer, t->text + offset, size);
+		return size;
+	}
+	if(is_ctl(path))
+		return 0;
+	struct myfs_inode *inode = path_lookup(path);
+	if(inode == NULL)
 		return -ENOENT;
-	int file_idx = get_file_index(path);
-	if(file_idx == -1)
-		return -1;
-	char *content = files_content[file_idx];
+	if(S_ISDIR(inode->mode))
+		return -EISDIR;
+	pthread_rwlock_rdlock(&inode->lock);
+	int res = filedata_read(&inode->data, __atomic_load_n(&inode->size, __ATOMIC_RELAXED), buffer, size, offset);
+	pthread_rwlock_unlock(&inode->lock);
+	return res;
+}
+
+/* around every change: the snapshot gate, shared or exclusive, then the journal.
+   Fails once the journal could not be written, see journal_lock(). */
+static int change_lock(int exclusive){
+	if(exclusive)
+		snapshot_lock();
+	else
+		snapshot_lock_shared();
+	int res = journal_lock();
+	if(res != 0)
+		snapshot_unlock();
+	return res;
+}
+
+static void change_unlock(void){
+	journal_unlock();
+	snapshot_unlock();
+}
+
+/* make dst a snapshot (read-only, in /.snapshots) or a clone (SNAPSHOT_CLONE) of src */
+static int do_snapshot(const char *src, const char *dst, int flags){
+	if(snapshot_depth(dst) != ((flags & SNAPSHOT_CLONE) ? 0 : 2))
+		return -EROFS; //snapshots go right into /.snapshots, clones anywhere else
+	int res = change_lock(1);
+	if(res != 0)
+		return res;
+	res = flags & SNAPSHOT_CLONE ? snapshot_take(src, dst, flags) : snapshot_create(src, dst);
+	if(res == 0)
+		journal_log(JOURNAL_SNAPSHOT, flags, 0, src, dst, strlen(dst));
+	change_unlock();
+	return res;
+}
+
+/* mkdir /.snapshots/NAME takes a snapshot of the whole tree */
+static int do_mkdir(const char *path, mode_t mode)
+{
+	switch(snapshot_depth(path)){
+	case 0: break;
+	case 2: return do_snapshot("/", path, 0);
+	default: return -EROFS;
+	}
+	int res = change_lock(0);
+	if(res != 0)
+		return res;
+	res = add_dir(path, mode);
+	if(res == 0)
+		journal_log(JOURNAL_MKDIR, mode, 0, path, NULL, 0);
+	change_unlock();
+	return res;
+}
+
+static int do_mknod(const char *path, mode_t mode, dev_t rdev){
+	(void) rdev;
+	if(!S_ISREG(mode))
+		return -EPERM;
+	if(snapshot_depth(path) != 0)
+		return -EROFS;
+	int res = change_lock(0);
+	if(res != 0)
+		return res;
+	res = add_file(path, mode);
+	if(res == 0)
+		journal_log(JOURNAL_MKNOD, mode, 0, path, NULL, 0);
+	change_unlock();
+	return res;
+}
+
+static int remove_file(const char *path){
+	const char *name;
 	size_t len;
-	len = strlen(content);
+	int res = 0;
+	struct myfs_inode *parent = path_private_parent(path, &name, &len, &res);
+	if(parent == NULL)
+		return res;
+	dir_lock(parent);
+	struct myfs_inode *inode = dir_lookup(parent, name, len);
+	if(inode == NULL)
+		res = -ENOENT;
+	else if(S_ISDIR(inode->mode))
+		res = -EISDIR;
+	else {
+		dir_remove(parent, name, len);
+		if(!inode_shared(inode)) //a snapshot still has it
+			__atomic_store_n(&inode->nlink, 0, __ATOMIC_RELAXED);
+	}
+	dir_unlock(parent);
+	if(res == 0)
+		inode_put(inode); //a request that looked it up before may still be using it
+	return res;
+}
+
+/* unlink /.snapshots/NAME deletes a snapshot of a file */
+static int do_unlink(const char *path){
+	int depth = snapshot_depth(path), res;
+	if(depth != 0 && depth != 2)
+		return -EROFS;
+	if((res = change_lock(depth == 2)) != 0)
+		return res;
+	res = depth == 2 ? snapshot_delete(path, 0) : remove_file(path);
+	if(res == 0)
+		journal_log(JOURNAL_UNLINK, 0, 0, path, NULL, 0);
+	change_unlock();
+	return res;
+}
 
-	if(offset < len){
-		if(offset + size > len){
-			size = len-offset;
-			memcpy(buffer, content + offset, size);
+static int remove_dir(const char *path){
+	const char *name;
+	size_t len;
+	int res = 0;
+	struct myfs_inode *parent = path_private_parent(path, &name, &len, &res);
+	if(parent == NULL)
+		return res == -ENOENT ? -EBUSY : res; //the root
+	dir_lock(parent);
+	struct myfs_inode *inode = dir_lookup(parent, name, len);
+	if(inode == NULL)
+		res = -ENOENT;
+	else if(!S_ISDIR(inode->mode))
+		res = -ENOTDIR;
+	else {
+		/* a create in it that resolved the path before now finds nlink == 0 */
+		dir_lock(inode);
+		if(inode->nentries != 0)
+			res = -ENOTEMPTY;
+		else {
+			if(!inode_shared(inode))
+				__atomic_store_n(&inode->nlink, 0, __ATOMIC_RELAXED);
+			dir_remove(parent, name, len);
 		}
-		memcpy(buffer, content + offset, size);
-	} else{
-		size = 0;
+		dir_unlock(inode);
 	}
-	return size;
+	dir_unlock(parent);
+	if(res == 0)
+		inode_put(inode);
+	return res;
 }
-/*
-static int do_read( const char *path, char *buffer, size_t size, off_t offset,
-		struct fuse_file_info *fi){
-	printf("-->Trying to read %s, %lu, %lu\n", path, offset, size);
-	(void) fi;
 
-	int file_idx = get_file_index(path);
+/* rmdir /.snapshots/NAME deletes a snapshot, empty or not */
+static int do_rmdir(const char *path){
+	int depth = snapshot_depth(path), res;
+	if(depth != 0 && depth != 2)
+		return -EROFS;
+	if((res = change_lock(depth == 2)) != 0)
+		return res;
+	res = depth == 2 ? snapshot_delete(path, 1) : remove_dir(path);
+	if(res == 0)
+		journal_log(JOURNAL_RMDIR, 0, 0, path, NULL, 0);
+	change_unlock();
+	return res;
+}
 
-	if ( file_idx == -1)
-		return -1;
-	char *content = files_content[ file_idx ];
-	memcpy(buffer, content + offset, size);
+/* one rename at a time, like the kernel's rename mutex: while it runs no
+   other change can make one of its directories an ancestor of the other */
+static pthread_mutex_t rename_lock = PTHREAD_MUTEX_INITIALIZER;
 
-	return strlen(content) - offset;
+static int path_contains(const char *dir, size_t dir_len, const char *path, size_t path_len){
+	return dir_len < path_len && memcmp(dir, path, dir_len) == 0;
 }
-*/
-static int do_mkdir(const char *path, mode_t mode)
-{
-	printf("yejin's do_mkdir start!!\n");
-	path++;
-	add_dir(path);
-	printf("yejin's do_mkdir complete!!\n");
+
+/* replace old, the entry to_name of to_dir, by inode; both directories are locked */
+static int move_over(struct myfs_inode *from_dir, const char *from_name, size_t from_len,
+		struct myfs_inode *to_dir, const char *to_name, size_t to_len,
+		struct myfs_inode *inode, struct myfs_inode *old){
+	int res = 0;
+
+	if(S_ISDIR(old->mode) && !S_ISDIR(inode->mode))
+		return -EISDIR;
+	if(!S_ISDIR(old->mode) && S_ISDIR(inode->mode))
+		return -ENOTDIR;
+	if(S_ISDIR(old->mode)){
+		/* an empty directory cannot be an ancestor of from_dir, so locking
+		   it after its parent keeps the lock order */
+		if(__atomic_load_n(&old->nentries, __ATOMIC_RELAXED) != 0)
+			return -ENOTEMPTY;
+		dir_lock(old);
+		if(old->nentries != 0)
+			res = -ENOTEMPTY;
+		else if(!inode_shared(old))
+			__atomic_store_n(&old->nlink, 0, __ATOMIC_RELAXED);
+		dir_unlock(old);
+		if(res != 0)
+			return res;
+	} else if(!inode_shared(old))
+		__atomic_store_n(&old->nlink, 0, __ATOMIC_RELAXED);
+	dir_replace(to_dir, to_name, to_len, inode);
+	dir_remove(from_dir, from_name, from_len);
 	return 0;
 }
 
-static int do_mknod(const char *path, mode_t mode, dev_t rdev){
-	printf("yejin's do_mknod start\n");
-	path++;
-	add_file(path);
-	printf("yejin's do_mknod complete!!\n");
-	return 0;
+static int move(const char *from, const char *to){
+	const char *from_name, *to_name;
+	size_t from_len, to_len;
+	struct myfs_inode *inode, *old = NULL;
+	int res;
+
+	// a directory cannot be moved below itself
+	size_t from_plen = strlen(from);
+	if(strncmp(from, to, from_plen) == 0 && to[from_plen] == '/')
+		return -EINVAL;
+
+	pthread_mutex_lock(&rename_lock);
+	struct myfs_inode *from_dir = path_private_parent(from, &from_name, &from_len, &res);
+	struct myfs_inode *to_dir = from_dir ? path_private_parent(to, &to_name, &to_len, &res) : NULL;
+	if(from_dir == NULL || to_dir == NULL){
+		pthread_mutex_unlock(&rename_lock);
+		return res;
+	}
+	/* the directory that contains the other one first, as rmdir does; unrelated ones by address */
+	struct myfs_inode *first = from_dir, *second = to_dir;
+	if(path_contains(to, to_name - to, from, from_name - from) ||
+			(!path_contains(from, from_name - from, to, to_name - to) && to_dir < from_dir)){
+		first = to_dir;
+		second = from_dir;
+	}
+	dir_lock(first);
+	if(second != first)
+		dir_lock(second);
+
+	if(from_dir->nlink == 0 || to_dir->nlink == 0 || (inode = dir_lookup(from_dir, from_name, from_len)) == NULL)
+		res = -ENOENT;
+	else if((old = dir_lookup(to_dir, to_name, to_len)) == inode){
+		old = NULL;
+		res = 0;
+	} else if(old != NULL){
+		res = move_over(from_dir, from_name, from_len, to_dir, to_name, to_len, inode, old);
+		if(res != 0)
+			old = NULL;
+	} else {
+		/* the new name first: a lookup finds the inode under one name or the other throughout */
+		res = dir_add(to_dir, to_name, to_len, inode);
+		if(res == 0)
+			dir_remove(from_dir, from_name, from_len);
+	}
+
+	if(second != first)
+		dir_unlock(second);
+	dir_unlock(first);
+	pthread_mutex_unlock(&rename_lock);
+	if(old != NULL)
+		inode_put(old);
+	return res;
+}
+
+static int do_rename(const char *from, const char *to, unsigned int flags){
+	if(flags)
+		return -EINVAL;
+	if(snapshot_depth(from) != 0 || snapshot_depth(to) != 0)
+		return -EROFS;
+	int res = change_lock(0);
+	if(res != 0)
+		return res;
+	res = move(from, to);
+	if(res == 0)
+		journal_log(JOURNAL_RENAME, 0, 0, from, to, strlen(to));
+	change_unlock();
+	return res;
+}
+
+/* a write to the control file: "snapshot SRC NAME" makes /.snapshots/NAME,
+   "clone SRC DST" a writable DST, both of what SRC is now */
+static int run_ctl(const char *buffer, size_t size){
+	char line[3 * PATH_MAX], cmd[16], src[PATH_MAX], dst[PATH_MAX];
+
+	if(size >= sizeof(line))
+		return -EINVAL;
+	memcpy(line, buffer, size);
+	line[size] = '\0';
+	if(sscanf(line, "%15s %4095s %4095s", cmd, src, dst) != 3 || src[0] != '/')
+		return -EINVAL;
+	if(strcmp(cmd, "clone") == 0 && dst[0] == '/')
+		return do_snapshot(src, dst, SNAPSHOT_CLONE);
+	if(strcmp(cmd, "snapshot") != 0 || strchr(dst, '/') != NULL)
+		return -EINVAL;
+	char name[PATH_MAX + sizeof("/" SNAPSHOT_DIR "/")];
+	snprintf(name, sizeof(name), "/" SNAPSHOT_DIR "/%s", dst);
+	return do_snapshot(src, name, 0);
 }
 
 static int do_write(const char *path, const char *buffer, size_t size,
 		off_t offset, struct fuse_file_info *info){
-	
+
 	(void) info;
-	write_to_file(path, buffer);
-	return size;
+	if(is_ctl(path)){
+		int res = run_ctl(buffer, size);
+		return res == 0 ? (int) size : res;
+	}
+	if(snapshot_depth(path) != 0)
+		return -EROFS;
+	int res = change_lock(0);
+	if(res != 0)
+		return res;
+	res = write_to_file(path, buffer, size, offset);
+	if(res > 0)
+		journal_log(JOURNAL_WRITE, 0, offset, path, buffer, res);
+	change_unlock();
+	if(res > 0 && dedup_enabled){
+		/* the extents this write reached the end of; a sequential writer is done with them */
+		struct myfs_inode *inode = path_lookup(path);
+		if(inode != NULL && S_ISREG(inode->mode))
+			dedup_extents(inode, offset >> MYFS_EXTENT_SHIFT, (offset + res) >> MYFS_EXTENT_SHIFT);
+	}
+	return res;
 }
 
+static int do_open(const char *path, struct fuse_file_info *fi){
+	if(!is_stats(path))
+		return 0;
+	if((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+	struct stats_text *t = stats_text_new();
+	if(t == NULL)
+		return -ENOMEM;
+	fi->fh = (uintptr_t) t;
+	fi->direct_io = 1; //the size getattr reported may be off by now
+	return 0;
+}
+
+/* closing a file that was written: with --dedup its last, partly filled
+   extent (and whatever else a random writer left) is shared now */
+static int do_release(const char *path, struct fuse_file_info *fi){
+	if(path != NULL && is_stats(path)){
+		free((struct stats_text *) (uintptr_t) fi->fh);
+		return 0;
+	}
+	if(!dedup_enabled || path == NULL || (fi->flags & O_ACCMODE) == O_RDONLY)
+		return 0;
+	struct myfs_inode *inode = path_lookup(path);
+	if(inode != NULL && S_ISREG(inode->mode))
+		dedup_extents(inode, 0, SIZE_MAX);
+	return 0;
+}
+
+static int truncate_file(const char *path, off_t size){
+	int res;
+	struct myfs_inode *inode = path_private(path, &res);
+	if(inode == NULL)
+		return res;
+	if(S_ISDIR(inode->mode))
+		return -EISDIR;
+	if(size < 0)
+		return -EINVAL;
+	pthread_rwlock_wrlock(&inode->lock); //no reader or writer may be inside the extents it frees
+	res = filedata_truncate(&inode->data, inode->size, size);
+	if(res == 0){
+		__atomic_store_n(&inode->size, size, __ATOMIC_RELAXED);
+		inode_touch(inode);
+	}
+	pthread_rwlock_unlock(&inode->lock);
+	return res;
+}
+
+static int do_truncate(const char *path, off_t size, struct fuse_file_info *fi){
+	(void) fi;
+	if(is_ctl(path))
+		return 0; //opened with O_TRUNC, as echo does
+	if(snapshot_depth(path) != 0)
+		return -EROFS;
+	int res = change_lock(0);
+	if(res != 0)
+		return res;
+	res = truncate_file(path, size);
+	if(res == 0)
+		journal_log(JOURNAL_TRUNCATE, 0, size, path, NULL, 0);
+	change_unlock();
+	return res;
+}
+
+/* with --store the changes so far are on disk when this returns (group commit in myfs_journal.h);
+   without it there is nothing to write */
+static int do_fsync(const char *path, int datasync, struct fuse_file_info *fi){
+	(void) path;
+	(void) datasync;
+	(void) fi;
+	return journal_fsync();
+}
+
+static int do_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi){
+	return do_fsync(path, datasync, fi);
+}
+
+static int do_statfs(const char *path, struct statvfs *st){
+	(void) path;
+	slab_statfs(st, 4096);
+	size_t inode_size = slab_classes[slab_class_of(sizeof(struct myfs_inode))].size;
+	st->f_files = __atomic_load_n(&myfs_ninodes, __ATOMIC_RELAXED) + st->f_bfree * st->f_bsize / inode_size;
+	st->f_ffree = st->f_favail = st->f_bfree * st->f_bsize / inode_size;
+	st->f_namemax = 255;
+	return 0;
+}
+
+/* the packer (--compress, myfs_compress.h, and --dedup, myfs_dedup.h):
+   every --compress-secs it visits every file and shares, then compresses,
+   the extents nobody used since its last visit */
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int running;
+	int stop;
+} packer = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+};
+
+static int packer_stopping(void){
+	pthread_mutex_lock(&packer.lock);
+	int stop = packer.stop;
+	pthread_mutex_unlock(&packer.lock);
+	return stop;
+}
+
+/* inside an epoch: the inode cannot be freed while the packer looks at it */
+static void pack_file(struct myfs_inode *inode){
+	for(size_t idx = 0; ; idx++){
+		pthread_rwlock_rdlock(&inode->lock); //the map is replaced under the write lock
+		if(idx >= inode->data.nmap){
+			pthread_rwlock_unlock(&inode->lock);
+			return;
+		}
+		uintptr_t slot = __atomic_load_n(&inode->data.map[idx], __ATOMIC_ACQUIRE);
+		if(slot & EXTENT_REFERENCED) //second chance
+			__atomic_fetch_and(&inode->data.map[idx], ~EXTENT_REFERENCED, __ATOMIC_RELAXED);
+		pthread_rwlock_unlock(&inode->lock);
+		if(!slot_settled(slot))
+			on_extent(inode, idx, slot, filedata_settle);
+	}
+}
+
+/* visit the files below path (len bytes of a PATH_MAX buffer). The names
+   of a directory are copied out inside one epoch and every entry is then
+   looked up again in its own, so no epoch is held for a whole pass. */
+static void pack_tree(char *path, size_t len){
+	char *names = NULL;
+	size_t used = 0, cap = 0;
+
+	epoch_enter();
+	struct myfs_inode *dir = path_lookup(path);
+	if(dir != NULL && S_ISDIR(dir->mode)){
+		pthread_rwlock_rdlock(&dir->lock);
+		for(size_t b = 0; b < dir->nbuckets; b++)
+			for(struct myfs_dirent *de = dir->buckets[b]; de != NULL; de = de->next){
+				if(used + de->len + 1 > cap){
+					char *more = realloc(names, cap = (used + de->len + 1) * 2);
+					if(more == NULL)
+						break;
+					names = more;
+				}
+				memcpy(names + used, de->name, de->len + 1);
+				used += de->len + 1;
+			}
+		pthread_rwlock_unlock(&dir->lock);
+	}
+	epoch_exit();
+
+	for(size_t off = 0; off < used && !packer_stopping(); off += strlen(names + off) + 1){
+		size_t n = strlen(names + off);
+		if(len + 1 + n >= PATH_MAX)
+			continue;
+		path[len] = '/';
+		memcpy(path + len + 1, names + off, n + 1);
+
+		epoch_enter();
+		struct myfs_inode *inode = path_lookup(path);
+		int is_dir = inode != NULL && S_ISDIR(inode->mode);
+		if(inode != NULL && S_ISREG(inode->mode))
+			pack_file(inode);
+		epoch_exit();
+		if(is_dir)
+			pack_tree(path, len + 1 + n);
+	}
+	path[len] = '\0';
+	free(names);
+}
+
+static void *packer_main(void *arg){
+	(void) arg;
+	char path[PATH_MAX];
+
+	pthread_mutex_lock(&packer.lock);
+	while(!packer.stop){
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += options.compress_secs;
+		if(pthread_cond_timedwait(&packer.wake, &packer.lock, &ts) != ETIMEDOUT)
+			continue;
+		pthread_mutex_unlock(&packer.lock);
+		path[0] = '\0';
+		pack_tree(path, 0); //"" is the root for path_lookup()
+		pthread_mutex_lock(&packer.lock);
+	}
+	pthread_mutex_unlock(&packer.lock);
+	return NULL;
+}
+
+static void *do_init(struct fuse_conn_info *conn, struct fuse_config *cfg){
+	(void) conn;
+	cfg->use_ino = 1; // report the inode numbers of myfs_inode.h
+	// here and not in main(): fuse_main() forks into the background before init
+	if(trace_start(options.trace, trace_file) != 0)
+		fprintf(stderr, "myfs: cannot start tracing\n");
+	if(journal_start() != 0)
+		fprintf(stderr, "myfs: cannot start the journal threads, changes are written on fsync only\n");
+	if(pack_codec != PACK_OFF || dedup_enabled){
+		if(pthread_create(&packer.thread, NULL, packer_main, NULL) == 0)
+			packer.running = 1;
+		else
+			fprintf(stderr, "myfs: cannot start the packer, extents are shared on writes only and nothing is compressed\n");
+	}
+	return NULL;
+}
+
+static void do_destroy(void *private_data){
+	(void) private_data;
+	if(packer.running){
+		pthread_mutex_lock(&packer.lock);
+		packer.stop = 1;
+		pthread_cond_signal(&packer.wake);
+		pthread_mutex_unlock(&packer.lock);
+		pthread_join(packer.thread, NULL);
+	}
+	journal_close();
+	inode_free_tree(myfs_root);
+	epoch_drain();
+	journal_unmap();
+	slab_flush();
+}
+
+/* redo one journal record while the store is opened; the handlers do the
+   work, the journal does not log them again and gives them the record's time */
+static void journal_apply(const struct journal_rec *r, const char *payload){
+	char path[PATH_MAX], second[PATH_MAX];
+	size_t extra = r->len - r->nlen;
+	int res = 0;
+
+	if(r->nlen >= sizeof(path))
+		return;
+	memcpy(path, payload, r->nlen);
+	path[r->nlen] = '\0';
+	switch(r->type){
+	case JOURNAL_MKNOD: res = do_mknod(path, r->mode, 0); break;
+	case JOURNAL_MKDIR: res = do_mkdir(path, r->mode); break;
+	case JOURNAL_UNLINK: res = do_unlink(path); break;
+	case JOURNAL_RMDIR: res = do_rmdir(path); break;
+	case JOURNAL_RENAME:
+		if(extra >= sizeof(second))
+			return;
+		memcpy(second, payload + r->nlen, extra);
+		second[extra] = '\0';
+		res = do_rename(path, second, 0);
+		break;
+	case JOURNAL_WRITE: res = do_write(path, payload + r->nlen, extra, r->off, NULL); break;
+	case JOURNAL_TRUNCATE: res = do_truncate(path, r->off, NULL); break;
+	case JOURNAL_SNAPSHOT:
+		if(extra >= sizeof(second))
+			return;
+		memcpy(second, payload + r->nlen, extra);
+		second[extra] = '\0';
+		res = do_snapshot(path, second, r->mode);
+		break;
+	}
+	if(res < 0)
+		fprintf(stderr, "myfs: journal record %u for %s failed: %s\n", r->type, path, strerror(-res));
+}
+
+/* every request goes through a wrapper that records it in the trace ring
+   (myfs_trace.h); with tracing off this costs one load. The request runs
+   inside an epoch (myfs_epoch.h), so nothing it looked up is freed under it. */
+#define TRACE_PATH(path, ...) path
+#define TRACED(name, params, args, off, size) \
+static int traced_##name params{ \
+	uint64_t start = trace_begin(); \
+	epoch_enter(); \
+	int res = do_##name args; \
+	epoch_exit(); \
+	trace_op(#name, TRACE_PATH args, (off), (size), start, res); \
+	return res; \
+}
+
+TRACED(getattr, (const char *path, struct stat *st, struct fuse_file_info *fi), (path, st, fi), 0, 0)
+TRACED(readdir, (const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset,
+		struct fuse_file_info *fi, enum fuse_readdir_flags flags),
+		(path, buffer, filler, offset, fi, flags), offset, 0)
+TRACED(open, (const char *path, struct fuse_file_info *fi), (path, fi), 0, 0)
+TRACED(read, (const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi),
+		(path, buffer, size, offset, fi), offset, res > 0 ? res : 0)
+TRACED(mkdir, (const char *path, mode_t mode), (path, mode), 0, 0)
+TRACED(mknod, (const char *path, mode_t mode, dev_t rdev), (path, mode, rdev), 0, 0)
+TRACED(unlink, (const char *path), (path), 0, 0)
+TRACED(rmdir, (const char *path), (path), 0, 0)
+TRACED(rename, (const char *from, const char *to, unsigned int flags), (from, to, flags), 0, 0)
+TRACED(write, (const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi),
+		(path, buffer, size, offset, fi), offset, res > 0 ? res : 0)
+TRACED(truncate, (const char *path, off_t size, struct fuse_file_info *fi), (path, size, fi), size, 0)
+TRACED(statfs, (const char *path, struct statvfs *st), (path, st), 0, 0)
+TRACED(fsync, (const char *path, int datasync, struct fuse_file_info *fi), (path, datasync, fi), 0, 0)
+TRACED(fsyncdir, (const char *path, int datasync, struct fuse_file_info *fi), (path, datasync, fi), 0, 0)
+TRACED(release, (const char *path, struct fuse_file_info *fi), (path, fi), 0, 0)
+
 static const struct fuse_operations operations ={
-	.getattr 	= do_getattr,
-	.readdir 	= do_readdir,
-	.read 		= do_read,
-	.mkdir 		= do_mkdir,
-	.mknod 		= do_mknod,
-	.write 		= do_write,
+	.init		= do_init,
+	.destroy	= do_destroy,
+	.getattr 	= traced_getattr,
+	.readdir 	= traced_readdir,
+	.open		= traced_open,
+	.read 		= traced_read,
+	.mkdir 		= traced_mkdir,
+	.mknod 		= traced_mknod,
+	.unlink		= traced_unlink,
+	.rmdir		= traced_rmdir,
+	.rename		= traced_rename,
+	.write 		= traced_write,
+	.truncate	= traced_truncate,
+	.statfs		= traced_statfs,
+	.fsync		= traced_fsync,
+	.fsyncdir	= traced_fsyncdir,
+	.release	= traced_release,
 };
 
 int main(int argc, char * argv[]){
-	return fuse_main(argc, argv, &operations, NULL);
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	size_t max_memory = default_max_memory();
+
+	if(fuse_opt_parse(&args, &options, option_spec, NULL) == -1)
+		return 1;
+	if(options.max_memory != NULL && (max_memory = parse_size(options.max_memory)) == 0){
+		fprintf(stderr, "invalid --max-memory: %s\n", options.max_memory);
+		return 1;
+	}
+	if(options.trace_file != NULL && (trace_file = fopen(options.trace_file, "a")) == NULL){
+		perror(options.trace_file);
+		return 1;
+	}
+	if(myfs_table_init(max_memory) != 0)
+		return 1;
+	snapshot_init();
+	if(options.compress != NULL){
+		size_t cache = 32UL << 20;
+		if(pack_parse(options.compress) != 0)
+			return 1;
+		if(options.compress_cache != NULL && (cache = parse_size(options.compress_cache)) == 0){
+			fprintf(stderr, "invalid --compress-cache: %s\n", options.compress_cache);
+			return 1;
+		}
+		if(pack_init(MYFS_EXTENT_SIZE, cache) != 0){
+			fprintf(stderr, "myfs: no memory for the decompression cache\n");
+			return 1;
+		}
+	}
+	if(options.dedup && dedup_init(MYFS_EXTENT_SIZE, max_memory) != 0){
+		fprintf(stderr, "myfs: no memory for the dedup table\n");
+		return 1;
+	}
+	if(options.compress_secs <= 0)
+		options.compress_secs = 1;
+	if(options.store != NULL){
+		journal.commit_ms = options.commit_ms > 0 ? options.commit_ms : 1;
+		journal.checkpoint_secs = options.checkpoint_secs > 0 ? options.checkpoint_secs : 0;
+		int err = journal_open(options.store, journal_apply);
+		if(err != 0){
+			fprintf(stderr, "%s: %s\n", options.store, strerror(-err));
+			return 1;
+		}
+	}
+	int ret = fuse_main(args.argc, args.argv, &operations, NULL);
+	fuse_opt_free_args(&args);
+	return ret;
 }
@@ -0,0 +1,327 @@
+/*
+   Compressed extents for myfs
+
+   With --compress=lz4 or --compress=zstd[:LEVEL] a background thread of
+   myfs.c (the packer) visits every file every --compress-secs and
+   replaces the extents that were neither read nor written since its last
+   visit by a compressed copy: a myfs_packed object sized to the
+   compressed data, from the slab like everything else, so the memory cap
+   and statfs() see the saving. Extents that do not shrink below
+   PACK_MAX_SIZE are marked and left alone until they are written again.
+
+   Reads of a compressed extent go through a small direct mapped cache of
+   decompressed extents (--compress-cache, keyed by the packed object), so
+   a hot extent that was compressed is decompressed once and then read at
+   memory speed. A write decompresses the extent back into a plain one and
+   the packer may compress it again once it has gone cold.
+
+   The packer is the only thread that compresses; any thread may
+   decompress. zstd keeps a decompression context per thread. The
+   compression ratio and the decompression latency are shown in
+   .myfs_stats.
+ */
+
+#ifndef MYFS_COMPRESS_H
+#define MYFS_COMPRESS_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "myfs_slab.h"
+
+#define PACK_MAX_SIZE(size) ((size) * 3 / 4) //keep a compressed copy only if it is at most this large
+#define PACK_MIN_CACHE 16 //decompressed extents the cache holds at least
+
+enum { PACK_OFF, PACK_LZ4, PACK_ZSTD };
+
+struct myfs_packed {
+	uint32_t len; //bytes of compressed data
+	uint32_t codec;
+	char data[];
+};
+
+struct pack_cache_entry {
+	pthread_rwlock_t lock;
+	const struct myfs_packed *key; //whose decompressed data is in data, NULL if none
+	char *data;
+};
+
+static int pack_codec; //PACK_OFF: extents are never compressed
+static size_t pack_extent_size;
+static char *pack_buf; //the packer's output buffer
+static struct pack_cache_entry *pack_cache;
+static size_t pack_cache_mask;
+
+/* counters, printed in /.myfs_stats */
+static atomic_size_t pack_extents; //compressed extents right now
+static atomic_size_t pack_bytes; //and the bytes they take
+static atomic_uint_fast64_t pack_incompressible; //extents the packer gave up on
+static atomic_uint_fast64_t pack_unpacked; //compressed extents made plain again by a write or truncate
+static atomic_uint_fast64_t pack_hits, pack_misses; //reads of compressed extents, by cache outcome
+static atomic_uint_fast64_t pack_dec_count, pack_dec_ns, pack_dec_max_ns;
+
+#ifdef HAVE_ZSTD
+static int pack_level = 3;
+static ZSTD_CCtx *pack_cctx;
+static __thread ZSTD_DCtx *pack_dctx;
+static pthread_key_t pack_dctx_key;
+
+static void pack_dctx_free(void *dctx)
+{
+	ZSTD_freeDCtx(dctx);
+}
+#endif
+
+/* "lz4", "zstd" or "zstd:LEVEL"; -1 if unknown or not built in */
+static int pack_parse(const char *spec)
+{
+	if (strcmp(spec, "lz4") == 0) {
+#ifdef HAVE_LZ4
+		pack_codec = PACK_LZ4;
+		return 0;
+#endif
+	} else if (strncmp(spec, "zstd", 4) == 0 && (spec[4] == '\0' || spec[4] == ':')) {
+#ifdef HAVE_ZSTD
+		if (spec[4] == ':')
+			pack_level = atoi(spec + 5);
+		pack_codec = PACK_ZSTD;
+		return 0;
+#endif
+	}
+	fprintf(stderr, "unknown or unsupported compression: %s (built with:%s%s)\n", spec,
+#ifdef HAVE_LZ4
+			" lz4",
+#else
+			"",
+#endif
+#ifdef HAVE_ZSTD
+			" zstd"
+#else
+			""
+#endif
+			);
+	return -1;
+}
+
+/* after pack_parse() and slab_init(); cache_size bytes of decompressed extents */
+static int pack_init(size_t extent_size, size_t cache_size)
+{
+	if (pack_codec == PACK_OFF)
+		return 0;
+	pack_extent_size = extent_size;
+	pack_buf = malloc(extent_size);
+	if (pack_buf == NULL)
+		return -ENOMEM;
+#ifdef HAVE_ZSTD
+	if (pack_codec == PACK_ZSTD) {
+		pack_cctx = ZSTD_createCCtx();
+		if (pack_cctx == NULL || pthread_key_create(&pack_dctx_key, pack_dctx_free) != 0)
+			return -ENOMEM;
+	}
+#endif
+
+	size_t n = PACK_MIN_CACHE;
+	while (n * 2 * extent_size <= cache_size)
+		n *= 2;
+	pack_cache = calloc(n, sizeof(*pack_cache));
+	if (pack_cache == NULL)
+		return -ENOMEM;
+	for (size_t i = 0; i < n; i++) {
+		pthread_rwlock_init(&pack_cache[i].lock, NULL);
+		pack_cache[i].data = slab_alloc(extent_size);
+		if (pack_cache[i].data == NULL)
+			return -ENOSPC;
+	}
+	pack_cache_mask = n - 1;
+	return 0;
+}
+
+static size_t pack_size(const struct myfs_packed *p)
+{
+	return sizeof(*p) + p->len;
+}
+
+/* compress one extent; -EAGAIN if it does not shrink enough, -ENOSPC.
+   Only the packer calls this. */
+static int pack_new(const char *src, struct myfs_packed **out)
+{
+	size_t cap = PACK_MAX_SIZE(pack_extent_size);
+	size_t len = 0;
+
+	(void) src; //unused when built without any codec
+	(void) cap;
+
+	switch (pack_codec) {
+#ifdef HAVE_LZ4
+	case PACK_LZ4:
+		len = LZ4_compress_default(src, pack_buf, pack_extent_size, cap); //0 if it does not fit
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case PACK_ZSTD:
+		len = ZSTD_compressCCtx(pack_cctx, pack_buf, cap, src, pack_extent_size, pack_level);
+		if (ZSTD_isError(len))
+			len = 0;
+		break;
+#endif
+	}
+	if (len == 0) {
+		atomic_fetch_add_explicit(&pack_incompressible, 1, memory_order_relaxed);
+		return -EAGAIN;
+	}
+
+	struct myfs_packed *p = slab_alloc(sizeof(*p) + len);
+	if (p == NULL)
+		return -ENOSPC;
+	p->len = len;
+	p->codec = pack_codec;
+	memcpy(p->data, pack_buf, len);
+	atomic_fetch_add_explicit(&pack_extents, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&pack_bytes, pack_size(p), memory_order_relaxed);
+	*out = p;
+	return 0;
+}
+
+/* a copy of p for another file; NULL without memory */
+static struct myfs_packed *pack_dup(const struct myfs_packed *p)
+{
+	struct myfs_packed *q = slab_alloc(pack_size(p));
+
+	if (q == NULL)
+		return NULL;
+	memcpy(q, p, pack_size(p));
+	atomic_fetch_add_explicit(&pack_extents, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&pack_bytes, pack_size(q), memory_order_relaxed);
+	return q;
+}
+
+/* call before fork() when the child is going to decompress: it must not allocate */
+static void pack_prepare(void)
+{
+#ifdef HAVE_ZSTD
+	if (pack_codec == PACK_ZSTD && pack_dctx == NULL && (pack_dctx = ZSTD_createDCtx()) != NULL)
+		pthread_setspecific(pack_dctx_key, pack_dctx);
+#endif
+}
+
+/* decompress p into dst, pack_extent_size bytes; -EIO if it is damaged */
+static int pack_unpack(const struct myfs_packed *p, char *dst)
+{
+	struct timespec t0, t1;
+	long long n = -1;
+
+	(void) dst;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	switch (p->codec) {
+#ifdef HAVE_LZ4
+	case PACK_LZ4:
+		n = LZ4_decompress_safe(p->data, dst, p->len, pack_extent_size);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case PACK_ZSTD:
+		pack_prepare();
+		if (pack_dctx == NULL)
+			return -ENOMEM;
+		n = ZSTD_decompressDCtx(pack_dctx, dst, pack_extent_size, p->data, p->len);
+		if (ZSTD_isError(n))
+			n = -1;
+		break;
+#endif
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	uint_fast64_t ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+	uint_fast64_t max = atomic_load_explicit(&pack_dec_max_ns, memory_order_relaxed);
+	while (ns > max && !atomic_compare_exchange_weak(&pack_dec_max_ns, &max, ns))
+		;
+	atomic_fetch_add_explicit(&pack_dec_count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&pack_dec_ns, ns, memory_order_relaxed);
+	return n == (long long) pack_extent_size ? 0 : -EIO;
+}
+
+static struct pack_cache_entry *pack_cache_of(const struct myfs_packed *p)
+{
+	return &pack_cache[(((uintptr_t) p >> 4) * 0x9e3779b97f4a7c15ULL >> 32) & pack_cache_mask];
+}
+
+/* copy n bytes at in of the extent p is the compressed copy of */
+static int pack_read(const struct myfs_packed *p, char *buf, size_t in, size_t n)
+{
+	struct pack_cache_entry *c = pack_cache_of(p);
+
+	pthread_rwlock_rdlock(&c->lock);
+	if (c->key == p) {
+		memcpy(buf, c->data + in, n);
+		pthread_rwlock_unlock(&c->lock);
+		atomic_fetch_add_explicit(&pack_hits, 1, memory_order_relaxed);
+		return 0;
+	}
+	pthread_rwlock_unlock(&c->lock);
+
+	pthread_rwlock_wrlock(&c->lock);
+	if (c->key != p) { //nobody filled it in the meantime
+		c->key = NULL;
+		int err = pack_unpack(p, c->data);
+		if (err != 0) {
+			pthread_rwlock_unlock(&c->lock);
+			return err;
+		}
+		c->key = p;
+		atomic_fetch_add_explicit(&pack_misses, 1, memory_order_relaxed);
+	} else
+		atomic_fetch_add_explicit(&pack_hits, 1, memory_order_relaxed);
+	memcpy(buf, c->data + in, n);
+	pthread_rwlock_unlock(&c->lock);
+	return 0;
+}
+
+/* no reader can still use p: drop it and whatever the cache holds for it */
+static void pack_free(struct myfs_packed *p)
+{
+	struct pack_cache_entry *c = pack_cache_of(p);
+
+	pthread_rwlock_wrlock(&c->lock);
+	if (c->key == p)
+		c->key = NULL; //the address may come back for another extent
+	pthread_rwlock_unlock(&c->lock);
+	atomic_fetch_sub_explicit(&pack_extents, 1, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&pack_bytes, pack_size(p), memory_order_relaxed);
+	slab_free(p, pack_size(p));
+}
+
+/* snprintf() style, for the stats file */
+static int pack_format(char *buf, size_t size)
+{
+	if (pack_codec == PACK_OFF)
+		return snprintf(buf, size, "%s", "");
+	size_t extents = atomic_load(&pack_extents), bytes = atomic_load(&pack_bytes);
+	uint_fast64_t count = atomic_load(&pack_dec_count);
+	return snprintf(buf, size, "compression: %s, %zu extents in %zu bytes, ratio %.2f, "
+			"%llu incompressible, %llu unpacked by writes, cache %llu hits %llu misses, "
+			"decompression avg %.1f us max %.1f us\n",
+			pack_codec == PACK_LZ4 ? "lz4" : "zstd", extents, bytes,
+			bytes ? (double) extents * pack_extent_size / bytes : 0.0,
+			(unsigned long long) atomic_load(&pack_incompressible),
+			(unsigned long long) atomic_load(&pack_unpacked),
+			(unsigned long long) atomic_load(&pack_hits),
+			(unsigned long long) atomic_load(&pack_misses),
+			count ? atomic_load(&pack_dec_ns) / 1e3 / count : 0.0,
+			atomic_load(&pack_dec_max_ns) / 1e3);
+}
+
+#endif /* MYFS_COMPRESS_H */
@@ -0,0 +1,265 @@
+/*
+   Content addressed extents for myfs
+
+   With --dedup an extent whose bytes another file already holds is stored
+   once. An extent is hashed when a write finishes it (reaches its end),
+   when a file opened for writing is closed and on every pass of the
+   packer of myfs.c; the hash picks a chain of the block table below and
+   a block on it with the same bytes (compared with memcmp(), so a hash
+   collision costs a comparison, never data) takes one more reference.
+   Otherwise the extent itself becomes a new block. An extent of zeros
+   turns into a hole instead.
+
+   A map slot pointing to a block (EXTENT_SHARED in myfs_extent.h) is read
+   like a plain extent. The first write copies the block into an extent
+   of its own, or simply takes it over when no other slot refers to it,
+   so memory grows with the unique data and not with the logical size.
+
+   Snapshots (myfs_snapshot.h) share the extents of a file the same way,
+   through blocks that are not in the table: they are never looked up,
+   only counted.
+
+   The hash is XXH3 when built with libxxhash, otherwise a four lane
+   multiply-rotate hash in the style of xxh64 that the compiler keeps in
+   registers; both run at memory speed. The dedup ratio and the memory it
+   saved are shown in .myfs_stats.
+ */
+
+#ifndef MYFS_DEDUP_H
+#define MYFS_DEDUP_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_XXHASH
+#include <xxhash.h>
+#endif
+
+#include "myfs_slab.h"
+
+#define DEDUP_LOCKS 64 //chain locks, chosen by the hash
+#define DEDUP_MIN_CHAINS 1024
+
+struct myfs_block {
+	struct myfs_block *next; //in its hash chain
+	uint64_t hash;
+	uint32_t refs; //map slots pointing to it, changed under the chain's lock
+	uint32_t hashed; //in the table; 0 for the blocks of snapshots
+	char *data; //the extent, never written while it is shared
+};
+
+static int dedup_enabled;
+static size_t dedup_extent_size;
+static struct myfs_block **dedup_table;
+static size_t dedup_mask;
+static pthread_mutex_t dedup_locks[DEDUP_LOCKS] = {
+	[0 ... DEDUP_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* counters, printed in /.myfs_stats */
+static atomic_size_t dedup_blocks; //blocks in the table right now
+static atomic_size_t dedup_refs; //and the slots pointing to them
+static atomic_uint_fast64_t dedup_hashed; //extents looked up in the table
+static atomic_uint_fast64_t dedup_hits; //of those, found there
+static atomic_uint_fast64_t dedup_zeros; //extents of zeros made holes
+static atomic_uint_fast64_t dedup_copies; //shared blocks copied by a write
+static atomic_uint_fast64_t dedup_snapshot_copies; //the same for blocks of snapshots
+
+/* after slab_init(): one chain per extent the memory cap has room for */
+static int dedup_init(size_t extent_size, size_t limit)
+{
+	size_t n = DEDUP_MIN_CHAINS;
+
+	while (n < limit / extent_size && n < (1UL << 24))
+		n *= 2;
+	dedup_table = calloc(n, sizeof(*dedup_table));
+	if (dedup_table == NULL)
+		return -ENOMEM;
+	dedup_mask = n - 1;
+	dedup_extent_size = extent_size;
+	dedup_enabled = 1;
+	return 0;
+}
+
+#ifndef HAVE_XXHASH
+static inline uint64_t dedup_round(uint64_t acc, uint64_t in)
+{
+	acc += in * 0xc2b2ae3d27d4eb4fULL;
+	acc = (acc << 31) | (acc >> 33);
+	return acc * 0x9e3779b185ebca87ULL;
+}
+#endif
+
+/* hash of one extent; the extent size is a multiple of 32 */
+static uint64_t dedup_hash(const char *data)
+{
+#ifdef HAVE_XXHASH
+	return XXH3_64bits(data, dedup_extent_size);
+#else
+	uint64_t a = 1, b = 2, c = 3, d = 4, w[4];
+
+	for (size_t i = 0; i < dedup_extent_size; i += sizeof(w)) {
+		memcpy(w, data + i, sizeof(w));
+		a = dedup_round(a, w[0]);
+		b = dedup_round(b, w[1]);
+		c = dedup_round(c, w[2]);
+		d = dedup_round(d, w[3]);
+	}
+	uint64_t h = ((a << 1) | (a >> 63)) + ((b << 7) | (b >> 57)) +
+			((c << 12) | (c >> 52)) + ((d << 18) | (d >> 46));
+	h ^= h >> 29;
+	h *= 0x165667b19e3779f9ULL;
+	return h ^ (h >> 32);
+#endif
+}
+
+static int dedup_is_zero(const char *data)
+{
+	return data[0] == 0 && memcmp(data, data + 1, dedup_extent_size - 1) == 0;
+}
+
+static pthread_mutex_t *dedup_lock_of(uint64_t hash)
+{
+	return &dedup_locks[hash & (DEDUP_LOCKS - 1)]; //a lock covers whole chains
+}
+
+/* a reference to the block with the same bytes as data, or a new block
+   that owns data if there is none (b->data == data); NULL without memory */
+static struct myfs_block *dedup_get(char *data, uint64_t hash)
+{
+	pthread_mutex_t *lock = dedup_lock_of(hash);
+	struct myfs_block **chain = &dedup_table[hash & dedup_mask], *b;
+
+	atomic_fetch_add_explicit(&dedup_hashed, 1, memory_order_relaxed);
+	pthread_mutex_lock(lock);
+	for (b = *chain; b != NULL; b = b->next)
+		if (b->hash == hash && memcmp(b->data, data, dedup_extent_size) == 0)
+			break;
+	if (b != NULL) {
+		__atomic_fetch_add(&b->refs, 1, __ATOMIC_RELAXED);
+		atomic_fetch_add_explicit(&dedup_hits, 1, memory_order_relaxed);
+	} else if ((b = slab_alloc(sizeof(*b))) != NULL) {
+		b->hash = hash;
+		b->refs = 1;
+		b->hashed = 1;
+		b->data = data;
+		b->next = *chain;
+		*chain = b;
+		atomic_fetch_add_explicit(&dedup_blocks, 1, memory_order_relaxed);
+	}
+	pthread_mutex_unlock(lock);
+	if (b != NULL)
+		atomic_fetch_add_explicit(&dedup_refs, 1, memory_order_relaxed);
+	return b;
+}
+
+/* a block of refs references for data that stays out of the table; NULL without memory */
+static struct myfs_block *dedup_wrap(char *data, uint32_t refs)
+{
+	struct myfs_block *b = slab_alloc(sizeof(*b));
+
+	if (b == NULL)
+		return NULL;
+	b->next = NULL;
+	b->hash = (uintptr_t) data >> 16; //only picks the lock
+	b->refs = refs;
+	b->hashed = 0;
+	b->data = data;
+	return b;
+}
+
+static size_t dedup_refs_of(const struct myfs_block *b)
+{
+	return __atomic_load_n(&b->refs, __ATOMIC_RELAXED);
+}
+
+/* one more slot points to b */
+static void dedup_ref(struct myfs_block *b)
+{
+	pthread_mutex_t *lock = dedup_lock_of(b->hash);
+
+	pthread_mutex_lock(lock); //against dedup_claim() seeing a single reference
+	__atomic_fetch_add(&b->refs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(lock);
+	if (b->hashed)
+		atomic_fetch_add_explicit(&dedup_refs, 1, memory_order_relaxed);
+}
+
+/* take b out of its chain, if it is in the table; under the chain's lock */
+static void dedup_unlink(struct myfs_block *b)
+{
+	if (!b->hashed)
+		return;
+	struct myfs_block **pp = &dedup_table[b->hash & dedup_mask];
+
+	while (*pp != b)
+		pp = &(*pp)->next;
+	*pp = b->next;
+	atomic_fetch_sub_explicit(&dedup_blocks, 1, memory_order_relaxed);
+}
+
+/* drop a reference; 1 if it was the last one: b is out of the table and
+   the caller frees it and its data */
+static int dedup_put(struct myfs_block *b)
+{
+	pthread_mutex_t *lock = dedup_lock_of(b->hash);
+	int last;
+
+	pthread_mutex_lock(lock);
+	last = __atomic_sub_fetch(&b->refs, 1, __ATOMIC_RELAXED) == 0;
+	if (last)
+		dedup_unlink(b);
+	pthread_mutex_unlock(lock);
+	if (b->hashed)
+		atomic_fetch_sub_explicit(&dedup_refs, 1, memory_order_relaxed);
+	return last;
+}
+
+/* if *slot, which holds old, is the only reference to b, replace it by
+   new and take b out of the table; 1 if done: b's data now belongs to
+   the caller, and so does freeing b */
+static int dedup_claim(struct myfs_block *b, uintptr_t *slot, uintptr_t old, uintptr_t new)
+{
+	pthread_mutex_t *lock = dedup_lock_of(b->hash);
+	int done = 0;
+
+	pthread_mutex_lock(lock); //no dedup_get() can find b meanwhile
+	if (dedup_refs_of(b) == 1 && __atomic_compare_exchange_n(slot, &old, new, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&b->refs, 0, __ATOMIC_RELAXED);
+		dedup_unlink(b);
+		done = 1;
+	}
+	pthread_mutex_unlock(lock);
+	if (done && b->hashed)
+		atomic_fetch_sub_explicit(&dedup_refs, 1, memory_order_relaxed);
+	return done;
+}
+
+static void dedup_block_free(struct myfs_block *b)
+{
+	slab_free(b, sizeof(*b));
+}
+
+/* snprintf() style, for the stats file */
+static int dedup_format(char *buf, size_t size)
+{
+	if (!dedup_enabled)
+		return snprintf(buf, size, "%s", "");
+	size_t blocks = atomic_load(&dedup_blocks), refs = atomic_load(&dedup_refs);
+	uint_fast64_t hashed = atomic_load(&dedup_hashed), hits = atomic_load(&dedup_hits);
+	return snprintf(buf, size, "dedup: %zu blocks for %zu extents, %zu bytes saved, "
+			"hit rate %.1f%% (%llu of %llu), %llu zero extents made holes, %llu copies on write\n",
+			blocks, refs, refs > blocks ? (refs - blocks) * dedup_extent_size : 0,
+			hashed ? 100.0 * hits / hashed : 0.0,
+			(unsigned long long) hits, (unsigned long long) hashed,
+			(unsigned long long) atomic_load(&dedup_zeros),
+			(unsigned long long) atomic_load(&dedup_copies));
+}
+
+#endif /* MYFS_DEDUP_H */
@@ -0,0 +1,214 @@
+/*
+   Epoch based reclamation for myfs
+
+   Path lookups walk the directory hash tables of myfs_inode.h without
+   taking a lock, so an entry, an inode or a bucket array that a change
+   has unlinked may still be in use by a lookup on another thread. It is
+   not freed right away but retired: put on the retiring thread's limbo
+   list together with the global epoch at that moment.
+
+   Every request runs between epoch_enter() and epoch_exit(), which
+   publish the epoch the thread has seen. The global epoch only moves from
+   e to e + 1 once every thread inside a request has seen e, so when it
+   has reached e + 2 no request that could have found an object retired
+   in e is still running and the object can be freed. A thread tries to
+   advance the epoch and frees what has become safe each EPOCH_BATCH
+   retirements. Threads outside a request never hold the epoch back.
+   Nested epoch_enter() calls are counted; only the outermost pair
+   publishes the epoch. When a thread exits, its limbo list moves to an
+   orphan list that the other threads free.
+ */
+
+#ifndef MYFS_EPOCH_H
+#define MYFS_EPOCH_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define EPOCH_BATCH 64 //retirements between two attempts to advance the epoch
+
+struct epoch_item {
+	struct epoch_item *next;
+	void (*fn)(void *p, size_t size);
+	void *p;
+	size_t size;
+	uint64_t epoch; //global epoch when it was retired
+};
+
+struct epoch_thread {
+	_Atomic uint64_t active; //epoch seen by epoch_enter(), 0 outside a request
+	unsigned int depth;
+	atomic_int in_use; //records of exited threads are reused
+	struct epoch_item *limbo; //newest first, so epochs are descending
+	size_t pending; //retirements since the last attempt to advance
+	struct epoch_thread *next;
+};
+
+static _Atomic uint64_t epoch_global = 1;
+static struct epoch_thread *_Atomic epoch_threads; //never shrinks
+static pthread_mutex_t epoch_orphan_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct epoch_item *epoch_orphans;
+static __thread struct epoch_thread *epoch_self;
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+
+/* unlink the items of *list whose epoch is old enough and return them */
+static struct epoch_item *epoch_ready(struct epoch_item **list, uint64_t global)
+{
+	struct epoch_item *ready = NULL, **pp = list;
+
+	while (*pp != NULL) {
+		struct epoch_item *it = *pp;
+		if (it->epoch + 2 > global) {
+			pp = &it->next;
+			continue;
+		}
+		*pp = it->next;
+		it->next = ready;
+		ready = it;
+	}
+	return ready;
+}
+
+/* free what epoch_ready() returned. The lists are consistent again by now,
+   so a free function may retire further objects (an inode its extents). */
+static int epoch_free(struct epoch_item *ready)
+{
+	int n = 0;
+
+	while (ready != NULL) {
+		struct epoch_item *it = ready;
+		ready = it->next;
+		it->fn(it->p, it->size);
+		free(it);
+		n++;
+	}
+	return n;
+}
+
+static void epoch_thread_exit(void *arg)
+{
+	struct epoch_thread *t = arg;
+
+	if (t->limbo != NULL) {
+		struct epoch_item *last = t->limbo;
+		while (last->next != NULL)
+			last = last->next;
+		pthread_mutex_lock(&epoch_orphan_lock);
+		last->next = epoch_orphans;
+		epoch_orphans = t->limbo;
+		pthread_mutex_unlock(&epoch_orphan_lock);
+		t->limbo = NULL;
+	}
+	atomic_store(&t->in_use, 0);
+}
+
+static void epoch_setup(void)
+{
+	pthread_key_create(&epoch_key, epoch_thread_exit);
+}
+
+static struct epoch_thread *epoch_register(void)
+{
+	struct epoch_thread *t;
+
+	pthread_once(&epoch_once, epoch_setup);
+	for (t = atomic_load(&epoch_threads); t != NULL; t = t->next) {
+		int idle = 0;
+		if (atomic_compare_exchange_strong(&t->in_use, &idle, 1))
+			break;
+	}
+	if (t == NULL) {
+		t = calloc(1, sizeof(*t));
+		if (t == NULL)
+			abort(); //no way to tell the caller, and nothing can be freed safely without it
+		atomic_store(&t->in_use, 1);
+		t->next = atomic_load(&epoch_threads);
+		while (!atomic_compare_exchange_weak(&epoch_threads, &t->next, t))
+			;
+	}
+	pthread_setspecific(epoch_key, t);
+	return epoch_self = t;
+}
+
+static inline void epoch_enter(void)
+{
+	struct epoch_thread *t = epoch_self ? epoch_self : epoch_register();
+
+	if (t->depth++ == 0) {
+		/* seq_cst: the store must be visible before this thread reads any shared pointer */
+		atomic_store(&t->active, atomic_load(&epoch_global));
+	}
+}
+
+static inline void epoch_exit(void)
+{
+	struct epoch_thread *t = epoch_self;
+
+	if (--t->depth == 0)
+		atomic_store_explicit(&t->active, 0, memory_order_release);
+}
+
+/* move the global epoch on if every thread in a request has seen it; returns the epoch */
+static uint64_t epoch_advance(void)
+{
+	uint64_t g = atomic_load(&epoch_global);
+
+	for (struct epoch_thread *t = atomic_load(&epoch_threads); t != NULL; t = t->next) {
+		uint64_t a = atomic_load(&t->active);
+		if (a != 0 && a != g)
+			return g;
+	}
+	if (atomic_compare_exchange_strong(&epoch_global, &g, g + 1))
+		return g + 1;
+	return g; //someone else did it
+}
+
+/* free p with fn(p, size) once no request can still see it */
+static void epoch_retire(void (*fn)(void *p, size_t size), void *p, size_t size)
+{
+	struct epoch_thread *t = epoch_self ? epoch_self : epoch_register();
+	struct epoch_item *it = malloc(sizeof(*it));
+
+	if (it == NULL)
+		return; //leak rather than free something a reader may hold
+	it->fn = fn;
+	it->p = p;
+	it->size = size;
+	it->epoch = atomic_load(&epoch_global);
+	it->next = t->limbo;
+	t->limbo = it;
+	if (++t->pending < EPOCH_BATCH)
+		return;
+
+	t->pending = 0;
+	uint64_t g = epoch_advance();
+	struct epoch_item *ready = epoch_ready(&t->limbo, g), *orphans = NULL;
+	if (pthread_mutex_trylock(&epoch_orphan_lock) == 0) {
+		orphans = epoch_ready(&epoch_orphans, g);
+		pthread_mutex_unlock(&epoch_orphan_lock);
+	}
+	epoch_free(ready);
+	epoch_free(orphans);
+}
+
+/* free everything that was retired; only when no other thread is in a request */
+static void epoch_drain(void)
+{
+	uint64_t all = UINT64_MAX - 2; //older than any epoch
+	int n;
+
+	do { //until freeing retires nothing new
+		n = 0;
+		for (struct epoch_thread *t = atomic_load(&epoch_threads); t != NULL; t = t->next)
+			n += epoch_free(epoch_ready(&t->limbo, all));
+		pthread_mutex_lock(&epoch_orphan_lock);
+		struct epoch_item *orphans = epoch_ready(&epoch_orphans, all);
+		pthread_mutex_unlock(&epoch_orphan_lock);
+		n += epoch_free(orphans);
+	} while (n != 0);
+}
+
+#endif /* MYFS_EPOCH_H */
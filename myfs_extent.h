@@ -0,0 +1,546 @@
+/*
+   Extent based file content for myfs
+
+   A file is an array of pointers to fixed-size extents indexed by
+   offset / MYFS_EXTENT_SIZE. A NULL slot is a hole and reads back as
+   zeros, so sparse files cost nothing for the ranges never written.
+   Reads and writes touch only the extents that overlap the request,
+   which keeps a 4 KiB write into a multi-GB file O(1) instead of a copy
+   of the whole file. Content is binary safe: sizes come from the write
+   requests, never from strlen().
+
+   Extents come from the extent class of the slab allocator in
+   myfs_slab.h, so they count against the memory cap and a write that
+   cannot get one fails with ENOSPC.
+
+   Several writers may run on one file at once (myfs.c holds the file's
+   lock for reading while it writes): an empty slot is filled with a
+   compare-and-swap, so two writers into the same hole agree on one
+   extent. Growing the map replaces it and needs the lock for writing.
+   Overlapping writes are ordered by the range locks below, which writes
+   to disjoint ranges of a file never wait for.
+
+   A slot is a tagged pointer. With EXTENT_PACKED it points to the
+   compressed copy of the extent (myfs_compress.h), which is read through
+   the decompression cache and turned back into a plain extent by the
+   first write. EXTENT_REFERENCED is the second chance bit of the packer:
+   reads and writes set it, the packer clears it, and an extent found
+   without it has not been used for a whole pass. With EXTENT_SHARED it
+   points to a block of myfs_dedup.h whose bytes other slots share; it is
+   read like a plain extent and made private by the first write. Both
+   dedup and the snapshots of myfs_snapshot.h share extents this way.
+ */
+
+#ifndef MYFS_EXTENT_H
+#define MYFS_EXTENT_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "myfs_compress.h"
+#include "myfs_dedup.h"
+#include "myfs_epoch.h"
+#include "myfs_slab.h"
+
+#define MYFS_EXTENT_SHIFT 16
+#define MYFS_EXTENT_SIZE (1UL << MYFS_EXTENT_SHIFT) //64 KiB
+#define RANGE_STRIPES 64 //range lock tables, chosen by the owner's address
+#define RANGE_MAX 16 //ranges held at once in one table
+
+#define EXTENT_PACKED 1UL //the slot points to a struct myfs_packed
+#define EXTENT_REFERENCED 2UL //read or written since the packer last looked
+#define EXTENT_INCOMPRESSIBLE 4UL //the packer leaves it alone until it is written
+#define EXTENT_SHARED 8UL //the slot points to a struct myfs_block
+#define EXTENT_TAGS 15UL //extents, packed copies and blocks are at least 16 byte aligned
+
+struct myfs_extent {
+	char data[MYFS_EXTENT_SIZE];
+};
+
+struct myfs_filedata {
+	uintptr_t *map; //map[i] covers [i * MYFS_EXTENT_SIZE, (i + 1) * MYFS_EXTENT_SIZE), 0 for a hole
+	size_t nmap; //number of slots in map
+	size_t nextents; //number of slots that are not holes
+};
+
+static struct myfs_extent *slot_extent(uintptr_t slot)
+{
+	return (struct myfs_extent *) (slot & ~EXTENT_TAGS);
+}
+
+static struct myfs_packed *slot_packed(uintptr_t slot)
+{
+	return (struct myfs_packed *) (slot & ~EXTENT_TAGS);
+}
+
+static struct myfs_block *slot_block(uintptr_t slot)
+{
+	return (struct myfs_block *) (slot & ~EXTENT_TAGS);
+}
+
+/* the bytes of a plain or shared extent */
+static char *slot_data(uintptr_t slot)
+{
+	return slot & EXTENT_SHARED ? slot_block(slot)->data : slot_extent(slot)->data;
+}
+
+static struct myfs_extent *extent_alloc(void)
+{
+	return slab_zalloc(sizeof(struct myfs_extent));
+}
+
+/* extents loaded from a checkpoint image (myfs_journal.h) live in its
+   private mapping, not in the slab: releasing one drops its pages */
+static const char *extent_mapped_lo, *extent_mapped_hi;
+
+static void extent_release(struct myfs_extent *e)
+{
+	if ((const char *) e >= extent_mapped_lo && (const char *) e < extent_mapped_hi) {
+		madvise(e, sizeof(*e), MADV_DONTNEED);
+		return;
+	}
+	slab_free(e, sizeof(*e));
+}
+
+static void extent_release_retired(void *p, size_t size)
+{
+	(void) size;
+	extent_release(p);
+}
+
+static void pack_free_retired(void *p, size_t size)
+{
+	(void) size;
+	pack_free(p);
+}
+
+/* a block that left the table, and its extent */
+static void block_free_retired(void *p, size_t size)
+{
+	struct myfs_block *b = p;
+
+	(void) size;
+	extent_release((struct myfs_extent *) b->data);
+	dedup_block_free(b);
+}
+
+/* only the block: its extent went on as a plain one */
+static void block_header_retired(void *p, size_t size)
+{
+	(void) size;
+	dedup_block_free(p);
+}
+
+/* drop a slot's reference to b; readers that found b through another
+   slot may still be copying from it when this was the last one */
+static void block_put(struct myfs_block *b)
+{
+	if (dedup_put(b))
+		epoch_retire(block_free_retired, b, 0);
+}
+
+static void slot_release(uintptr_t slot)
+{
+	if (slot & EXTENT_PACKED)
+		pack_free(slot_packed(slot));
+	else if (slot & EXTENT_SHARED)
+		block_put(slot_block(slot));
+	else
+		extent_release(slot_extent(slot));
+}
+
+/* the packer of myfs.c looks for extents nobody used */
+static int slot_tracking(void)
+{
+	return pack_codec != PACK_OFF || dedup_enabled;
+}
+
+/* mark slot idx used for the packer: one atomic OR per pass at most */
+static void slot_reference(struct myfs_filedata *fd, size_t idx, uintptr_t slot)
+{
+	if (slot_tracking() && !(slot & EXTENT_REFERENCED))
+		__atomic_fetch_or(&fd->map[idx], EXTENT_REFERENCED, __ATOMIC_RELAXED);
+}
+
+/* make sure slot idx exists in the map; doubling keeps appends amortized O(1) */
+static int filedata_reserve(struct myfs_filedata *fd, size_t idx)
+{
+	if (idx < fd->nmap)
+		return 0;
+	size_t n = fd->nmap ? fd->nmap : 1;
+	while (n <= idx)
+		n *= 2;
+	uintptr_t *map = slab_alloc(n * sizeof(*map));
+	if (map == NULL)
+		return -ENOSPC;
+	if (fd->nmap != 0)
+		memcpy(map, fd->map, fd->nmap * sizeof(*map));
+	memset(map + fd->nmap, 0, (n - fd->nmap) * sizeof(*map));
+	slab_free(fd->map, fd->nmap * sizeof(*map));
+	fd->map = map;
+	fd->nmap = n;
+	return 0;
+}
+
+/* copy out [off, off + size) of a file that is file_size bytes long */
+static ssize_t filedata_read(struct myfs_filedata *fd, off_t file_size,
+		char *buf, size_t size, off_t off)
+{
+	if (off >= file_size)
+		return 0;
+	if (size > (size_t) (file_size - off))
+		size = file_size - off;
+
+	size_t done = 0;
+	while (done < size) {
+		size_t idx = (off + done) >> MYFS_EXTENT_SHIFT;
+		size_t in = (off + done) & (MYFS_EXTENT_SIZE - 1);
+		size_t n = MYFS_EXTENT_SIZE - in;
+		if (n > size - done)
+			n = size - done;
+		uintptr_t slot = idx < fd->nmap ? __atomic_load_n(&fd->map[idx], __ATOMIC_ACQUIRE) : 0;
+		if (slot == 0)
+			memset(buf + done, 0, n); //hole
+		else if (slot & EXTENT_PACKED) {
+			if (pack_read(slot_packed(slot), buf + done, in, n) != 0)
+				return done ? (ssize_t) done : -EIO;
+		} else {
+			memcpy(buf + done, slot_data(slot) + in, n);
+			slot_reference(fd, idx, slot);
+		}
+		done += n;
+	}
+	return size;
+}
+
+/* make the shared extent in slot idx, which held *slot, private to the
+   file: take the block over if no other slot refers to it, copy it
+   otherwise. *slot is what the slot holds afterwards. */
+static int filedata_unshare(struct myfs_filedata *fd, size_t idx, uintptr_t *slot)
+{
+	struct myfs_block *b = slot_block(*slot);
+
+	if (dedup_claim(b, &fd->map[idx], *slot, (uintptr_t) b->data)) {
+		*slot = (uintptr_t) b->data;
+		epoch_retire(block_header_retired, b, 0); //readers may still go through b
+		return 0;
+	}
+	struct myfs_extent *fresh = slab_alloc(sizeof(*fresh));
+	if (fresh == NULL)
+		return -ENOSPC;
+	memcpy(fresh->data, b->data, sizeof(*fresh));
+	if (__atomic_compare_exchange_n(&fd->map[idx], slot, (uintptr_t) fresh, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		*slot = (uintptr_t) fresh;
+		atomic_fetch_add_explicit(b->hashed ? &dedup_copies : &dedup_snapshot_copies, 1,
+				memory_order_relaxed);
+		block_put(b);
+	} else
+		extent_release(fresh); //another writer made it private, or a reader tagged it
+	return 0;
+}
+
+static ssize_t filedata_write(struct myfs_filedata *fd, const char *buf,
+		size_t size, off_t off)
+{
+	if (size == 0)
+		return 0;
+	if (filedata_reserve(fd, (off + size - 1) >> MYFS_EXTENT_SHIFT) != 0)
+		return -ENOSPC;
+
+	size_t done = 0;
+	while (done < size) {
+		size_t idx = (off + done) >> MYFS_EXTENT_SHIFT;
+		size_t in = (off + done) & (MYFS_EXTENT_SIZE - 1);
+		size_t n = MYFS_EXTENT_SIZE - in;
+		if (n > size - done)
+			n = size - done;
+		uintptr_t slot = __atomic_load_n(&fd->map[idx], __ATOMIC_ACQUIRE);
+		while (slot & EXTENT_SHARED)
+			if (filedata_unshare(fd, idx, &slot) != 0)
+				return done ? (ssize_t) done : -ENOSPC;
+		if (slot == 0 || (slot & EXTENT_PACKED)) {
+			/* a hole or a compressed extent: install a plain one */
+			struct myfs_extent *fresh = slot ? slab_alloc(sizeof(*fresh)) : extent_alloc();
+			if (fresh == NULL)
+				return done ? (ssize_t) done : -ENOSPC;
+			if ((slot & EXTENT_PACKED) && pack_unpack(slot_packed(slot), fresh->data) != 0) {
+				extent_release(fresh);
+				return done ? (ssize_t) done : -EIO;
+			}
+			if (__atomic_compare_exchange_n(&fd->map[idx], &slot, (uintptr_t) fresh, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				if (slot == 0)
+					__atomic_fetch_add(&fd->nextents, 1, __ATOMIC_RELAXED);
+				else {
+					epoch_retire(pack_free_retired, slot_packed(slot), 0); //readers may be decompressing it
+					atomic_fetch_add_explicit(&pack_unpacked, 1, memory_order_relaxed);
+				}
+				slot = (uintptr_t) fresh;
+			} else
+				extent_release(fresh); //another writer got there first, slot is its extent
+		}
+		/* written: referenced, and worth another try at compressing */
+		while (slot_tracking() && (slot & EXTENT_TAGS) != EXTENT_REFERENCED &&
+				!__atomic_compare_exchange_n(&fd->map[idx], &slot,
+					(slot & ~EXTENT_TAGS) | EXTENT_REFERENCED, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			;
+		memcpy(slot_extent(slot)->data + in, buf + done, n);
+		done += n;
+	}
+	return done;
+}
+
+/* shrink or extend a file of old_size bytes to size bytes.
+   Extending only moves the size: the new range is a hole.
+   Called with the file locked for writing; -ENOSPC leaves it unchanged. */
+static int filedata_truncate(struct myfs_filedata *fd, off_t old_size, off_t size)
+{
+	if (size >= old_size)
+		return 0;
+
+	size_t keep = (size + MYFS_EXTENT_SIZE - 1) >> MYFS_EXTENT_SHIFT;
+	size_t in = size & (MYFS_EXTENT_SIZE - 1);
+	uintptr_t last = in != 0 && keep - 1 < fd->nmap ? fd->map[keep - 1] : 0;
+	while (last & EXTENT_SHARED) //its tail is zeroed below
+		if (filedata_unshare(fd, keep - 1, &last) != 0)
+			return -ENOSPC;
+	if (last & EXTENT_PACKED) {
+		/* the tail to zero is compressed: the extent has to be plain first */
+		struct myfs_extent *e = slab_alloc(sizeof(*e));
+		if (e == NULL)
+			return -ENOSPC;
+		if (pack_unpack(slot_packed(last), e->data) != 0) {
+			extent_release(e);
+			return -EIO;
+		}
+		pack_free(slot_packed(last));
+		atomic_fetch_add_explicit(&pack_unpacked, 1, memory_order_relaxed);
+		fd->map[keep - 1] = last = (uintptr_t) e;
+	}
+
+	for (size_t i = keep; i < fd->nmap; i++) {
+		if (fd->map[i] != 0) {
+			slot_release(fd->map[i]);
+			fd->map[i] = 0;
+			__atomic_fetch_sub(&fd->nextents, 1, __ATOMIC_RELAXED);
+		}
+	}
+	/* zero the tail of the last extent so a later extension reads zeros */
+	if (last != 0)
+		memset(slot_extent(last)->data + in, 0, MYFS_EXTENT_SIZE - in);
+	return 0;
+}
+
+/* replace the plain extent in slot idx by a compressed copy if the slot
+   still holds slot. Called by the packer with the file locked for reading
+   and the extent's range locked, so no write changes it meanwhile; a
+   reader that sets EXTENT_REFERENCED first makes it keep the extent.
+   A shared extent is compressed only if no other slot refers to it. */
+static void filedata_pack(struct myfs_filedata *fd, size_t idx, uintptr_t slot)
+{
+	struct myfs_packed *p;
+	int err = pack_new(slot_data(slot), &p);
+
+	if (err == -EAGAIN) {
+		__atomic_compare_exchange_n(&fd->map[idx], &slot, slot | EXTENT_INCOMPRESSIBLE, 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		return;
+	}
+	if (err != 0)
+		return;
+	if (slot & EXTENT_SHARED) {
+		if (dedup_claim(slot_block(slot), &fd->map[idx], slot, (uintptr_t) p | EXTENT_PACKED))
+			epoch_retire(block_free_retired, slot_block(slot), 0);
+		else
+			pack_free(p);
+		return;
+	}
+	if (__atomic_compare_exchange_n(&fd->map[idx], &slot, (uintptr_t) p | EXTENT_PACKED, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		epoch_retire(extent_release_retired, slot_extent(slot), 0); //readers may be copying from it
+	else
+		pack_free(p);
+}
+
+/* share the plain extent in slot idx with the identical extents of other
+   files, or make it a hole if it is all zeros. Called like filedata_pack();
+   only readers can change the slot meanwhile, and only its tags. */
+static void filedata_dedup(struct myfs_filedata *fd, size_t idx, uintptr_t slot)
+{
+	struct myfs_extent *e = slot_extent(slot);
+
+	if (dedup_is_zero(e->data)) {
+		while (!__atomic_compare_exchange_n(&fd->map[idx], &slot, 0, 1,
+				__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			;
+		__atomic_fetch_sub(&fd->nextents, 1, __ATOMIC_RELAXED);
+		epoch_retire(extent_release_retired, e, 0);
+		atomic_fetch_add_explicit(&dedup_zeros, 1, memory_order_relaxed);
+		return;
+	}
+	struct myfs_block *b = dedup_get(e->data, dedup_hash(e->data));
+	if (b == NULL)
+		return;
+	while (!__atomic_compare_exchange_n(&fd->map[idx], &slot,
+			(uintptr_t) b | EXTENT_SHARED | (slot & (EXTENT_REFERENCED | EXTENT_INCOMPRESSIBLE)),
+			1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		;
+	if (b->data != e->data)
+		epoch_retire(extent_release_retired, e, 0); //readers may be copying from it
+}
+
+/* would filedata_settle() leave slot as it is: a hole, compressed, used
+   since the last pass, or neither to share nor to compress */
+static int slot_settled(uintptr_t slot)
+{
+	if (slot == 0 || (slot & (EXTENT_PACKED | EXTENT_REFERENCED)))
+		return 1;
+	if (dedup_enabled && !(slot & EXTENT_SHARED))
+		return 0;
+	return pack_codec == PACK_OFF || (slot & EXTENT_INCOMPRESSIBLE) ||
+			((slot & EXTENT_SHARED) && dedup_refs_of(slot_block(slot)) != 1);
+}
+
+/* what the packer does with an extent nobody used for a pass: share it,
+   then compress what is left. Called like filedata_pack(). */
+static void filedata_settle(struct myfs_filedata *fd, size_t idx, uintptr_t slot)
+{
+	if (dedup_enabled && !(slot & EXTENT_SHARED)) {
+		filedata_dedup(fd, idx, slot);
+		slot = __atomic_load_n(&fd->map[idx], __ATOMIC_ACQUIRE);
+	}
+	if (!slot_settled(slot & ~EXTENT_REFERENCED))
+		filedata_pack(fd, idx, slot);
+}
+
+/* slots that are not holes, counted from the map: nextents lags behind
+   it for a moment when the packer makes an extent of zeros a hole */
+static size_t filedata_count(const struct myfs_filedata *fd)
+{
+	size_t n = 0;
+
+	for (size_t i = 0; i < fd->nmap; i++)
+		n += __atomic_load_n(&fd->map[i], __ATOMIC_RELAXED) != 0;
+	return n;
+}
+
+static void filedata_free(struct myfs_filedata *fd)
+{
+	filedata_truncate(fd, (off_t) fd->nmap << MYFS_EXTENT_SHIFT, 0);
+	slab_free(fd->map, fd->nmap * sizeof(*fd->map));
+	fd->map = NULL;
+	fd->nmap = 0;
+}
+
+/* give dst, an empty file, the content of src without copying it: each
+   extent ends up in a block both maps point to, a write to either file
+   copies it. Compressed extents are small and simply duplicated. Called
+   with src locked for writing; -ENOSPC leaves dst empty. */
+static int filedata_share(struct myfs_filedata *dst, struct myfs_filedata *src)
+{
+	if (src->nmap == 0)
+		return 0;
+	uintptr_t *map = slab_zalloc(src->nmap * sizeof(*map));
+	if (map == NULL)
+		return -ENOSPC;
+	dst->map = map;
+	dst->nmap = src->nmap;
+	for (size_t i = 0; i < src->nmap; i++) {
+		uintptr_t slot = src->map[i];
+		if (slot == 0)
+			continue;
+		if (slot & EXTENT_PACKED) {
+			struct myfs_packed *p = pack_dup(slot_packed(slot));
+			if (p == NULL)
+				goto nospc;
+			map[i] = (uintptr_t) p | (slot & EXTENT_TAGS & ~EXTENT_REFERENCED);
+		} else if (slot & EXTENT_SHARED) {
+			dedup_ref(slot_block(slot));
+			map[i] = slot & ~EXTENT_REFERENCED;
+		} else {
+			struct myfs_block *b = dedup_wrap(slot_extent(slot)->data, 2);
+			if (b == NULL)
+				goto nospc;
+			src->map[i] = (uintptr_t) b | EXTENT_SHARED | (slot & EXTENT_TAGS);
+			map[i] = (uintptr_t) b | EXTENT_SHARED | (slot & EXTENT_INCOMPRESSIBLE);
+		}
+		dst->nextents++;
+	}
+	return 0;
+nospc:
+	filedata_free(dst); //src keeps whatever it got wrapped in blocks, same bytes
+	return -ENOSPC;
+}
+
+/*
+ ** range locks **
+    A writer holds [start, end) of a file for the duration of its write;
+    one that overlaps a held range waits. Held ranges live in a small
+    table per stripe rather than in the inode, so a file that is never
+    written concurrently costs no memory for them.
+*/
+struct range_table {
+	pthread_mutex_t lock;
+	pthread_cond_t released;
+	unsigned int n;
+	struct {
+		const void *owner;
+		off_t start;
+		off_t end;
+	} held[RANGE_MAX];
+} __attribute__((aligned(64)));
+
+static struct range_table range_tables[RANGE_STRIPES] = {
+	[0 ... RANGE_STRIPES - 1] = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, {{0}} },
+};
+
+static struct range_table *range_table_of(const void *owner)
+{
+	return &range_tables[((uintptr_t) owner >> 8) % RANGE_STRIPES]; //inodes are 256 byte slab objects
+}
+
+static int range_busy(const struct range_table *t, const void *owner, off_t start, off_t end)
+{
+	if (t->n == RANGE_MAX)
+		return 1;
+	for (unsigned int i = 0; i < t->n; i++)
+		if (t->held[i].owner == owner && t->held[i].start < end && start < t->held[i].end)
+			return 1;
+	return 0;
+}
+
+static void range_lock(const void *owner, off_t start, off_t end)
+{
+	struct range_table *t = range_table_of(owner);
+
+	pthread_mutex_lock(&t->lock);
+	while (range_busy(t, owner, start, end))
+		pthread_cond_wait(&t->released, &t->lock);
+	t->held[t->n].owner = owner;
+	t->held[t->n].start = start;
+	t->held[t->n].end = end;
+	t->n++;
+	pthread_mutex_unlock(&t->lock);
+}
+
+static void range_unlock(const void *owner, off_t start, off_t end)
+{
+	struct range_table *t = range_table_of(owner);
+
+	pthread_mutex_lock(&t->lock);
+	for (unsigned int i = 0; i < t->n; i++)
+		if (t->held[i].owner == owner && t->held[i].start == start && t->held[i].end == end) {
+			t->held[i] = t->held[--t->n];
+			break;
+		}
+	pthread_cond_broadcast(&t->released);
+	pthread_mutex_unlock(&t->lock);
+}
+
+#endif /* MYFS_EXTENT_H */
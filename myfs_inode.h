@@ -0,0 +1,515 @@
+/*
+   In-memory inode table for myfs
+
+   Every directory owns a hash table that maps the name of a child to its
+   inode, so resolving a path costs one hash lookup per path component
+   instead of a strcmp() scan over every object in the filesystem.
+   Tables grow by doubling, so there is no fixed limit on the number of
+   entries and lookups stay O(1) expected. Inodes, entries and tables are
+   allocated from the slab allocator (myfs_slab.h) and count against its
+   memory cap; running out of it is reported as ENOSPC.
+
+   Lookups take no lock. A change to a directory holds the directory's
+   lock for writing, links a fully built entry in with a release store of
+   the bucket head and unlinks one with a store to its predecessor, so a
+   concurrent lookup sees the entry or does not but never a half-built
+   one. Only dir_grow() moves entries between chains; it makes the
+   directory's sequence count odd while it does, and a lookup that ran
+   into a resize (the count was odd or changed) simply starts over.
+   Removed entries, inodes and old bucket arrays are retired through
+   myfs_epoch.h instead of being freed while a lookup may hold them.
+
+   An inode may be the child of several entries: a snapshot
+   (myfs_snapshot.h) shares a subtree instead of copying it. refs counts
+   those entries; a shared inode (refs > 1) is never changed, a change
+   below it first replaces it in its parent by a private copy
+   (inode_copy()), and the last entry to go frees it.
+
+   Lock order: the snapshot gate and the rename lock of myfs.c, then
+   directories ancestor first (unrelated ones by address), then the lock
+   of a file's content.
+
+   This header does not depend on FUSE so it can be reused by the
+   benchmarks in bench/.
+ */
+
+#ifndef MYFS_INODE_H
+#define MYFS_INODE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "myfs_epoch.h"
+#include "myfs_extent.h"
+
+#define MYFS_MIN_BUCKETS 8
+
+struct myfs_dirent;
+
+struct myfs_inode {
+	ino_t ino;
+	mode_t mode;
+	unsigned int seq; //directories: odd while dir_grow() relinks the entries
+	nlink_t nlink; //0 once removed: a change that looked the inode up before that must not use it
+	off_t size;
+	struct timespec atime;
+	struct timespec mtime;
+	struct timespec ctime;
+
+	/* directories: hashed name -> inode map */
+	struct myfs_dirent **buckets;
+	size_t nbuckets;
+	size_t nentries;
+
+	/* regular files: extent map, see myfs_extent.h */
+	struct myfs_filedata data;
+
+	unsigned int refs; //entries pointing to it; changes to it and to them exclude each other
+	unsigned int ckpt_pass; //the checkpoint writer's mark (myfs_journal.h)
+
+	/* directories: held for writing by changes to the entries;
+	   regular files: held for reading by reads and writes, for writing by
+	   truncate and by writes that have to grow the extent map.
+	   Last, so that what lookups and stat() read fits in the first 128 bytes. */
+	pthread_rwlock_t lock;
+};
+
+struct myfs_dirent {
+	struct myfs_dirent *next; //next entry in the same bucket
+	uint64_t hash;
+	struct myfs_inode *inode;
+	size_t len;
+	char name[]; //NUL-terminated so readdir can hand it to filler() directly
+};
+
+static struct myfs_inode *myfs_root;
+/* numbers are handed out by dir_add() once the entry is sure to be made,
+   so a create that fails takes none and a replayed journal, which makes
+   the same entries in the same order, hands out the same ones */
+static ino_t myfs_next_ino = 1; //atomic
+static size_t myfs_ninodes; //live inodes, for statfs; atomic
+
+/* where timestamps come from: the clock, or the time of the change being
+   journaled or replayed (myfs_journal.h), so a replayed tree has the times
+   of the original one */
+static const struct timespec *myfs_time;
+
+static void myfs_now(struct timespec *ts)
+{
+	if (myfs_time != NULL)
+		*ts = *myfs_time;
+	else
+		clock_gettime(CLOCK_REALTIME, ts);
+}
+
+/* FNV-1a, good enough for short file names and cheap to compute */
+static uint64_t name_hash(const char *name, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char) name[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static struct myfs_inode *inode_new(mode_t mode)
+{
+	struct myfs_inode *inode = slab_zalloc(sizeof(*inode));
+	if (inode == NULL)
+		return NULL;
+	__atomic_fetch_add(&myfs_ninodes, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_init(&inode->lock, NULL);
+	inode->mode = mode;
+	inode->nlink = S_ISDIR(mode) ? 2 : 1;
+	inode->refs = 1;
+	myfs_now(&inode->mtime);
+	inode->atime = inode->ctime = inode->mtime;
+	return inode;
+}
+
+static size_t dirent_size(size_t len)
+{
+	return sizeof(struct myfs_dirent) + len + 1;
+}
+
+static void inode_put(struct myfs_inode *inode);
+
+/* the entries a directory still has drop their children with it */
+static void inode_free(struct myfs_inode *inode)
+{
+	for (size_t b = 0; b < inode->nbuckets; b++) {
+		struct myfs_dirent *de = inode->buckets[b], *next;
+		for (; de != NULL; de = next) {
+			next = de->next;
+			inode_put(de->inode);
+			slab_free(de, dirent_size(de->len));
+		}
+	}
+	slab_free(inode->buckets, inode->nbuckets * sizeof(*inode->buckets));
+	filedata_free(&inode->data);
+	pthread_rwlock_destroy(&inode->lock);
+	slab_free(inode, sizeof(*inode));
+	__atomic_fetch_sub(&myfs_ninodes, 1, __ATOMIC_RELAXED);
+}
+
+static void inode_free_retired(void *p, size_t size)
+{
+	(void) size;
+	inode_free(p);
+}
+
+/* drop the reference of an entry that was unlinked; the last one frees
+   the inode once no lookup can still hold it */
+static void inode_put(struct myfs_inode *inode)
+{
+	if (__atomic_sub_fetch(&inode->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		epoch_retire(inode_free_retired, inode, 0);
+}
+
+static int inode_shared(const struct myfs_inode *inode)
+{
+	return __atomic_load_n(&inode->refs, __ATOMIC_RELAXED) > 1;
+}
+
+/* set mtime and ctime; stat() reads them without a lock */
+static void inode_touch(struct myfs_inode *inode)
+{
+	struct timespec ts;
+	myfs_now(&ts);
+	__atomic_store_n(&inode->mtime.tv_sec, ts.tv_sec, __ATOMIC_RELAXED);
+	__atomic_store_n(&inode->mtime.tv_nsec, ts.tv_nsec, __ATOMIC_RELAXED);
+	__atomic_store_n(&inode->ctime.tv_sec, ts.tv_sec, __ATOMIC_RELAXED);
+	__atomic_store_n(&inode->ctime.tv_nsec, ts.tv_nsec, __ATOMIC_RELAXED);
+}
+
+/* release a whole subtree and return its memory to the slab in bulk;
+   what a snapshot still shares stays until its last entry goes */
+static void inode_free_tree(struct myfs_inode *inode)
+{
+	if (--inode->refs != 0)
+		return;
+	for (size_t b = 0; b < inode->nbuckets; b++) {
+		struct myfs_dirent *de = inode->buckets[b], *next;
+		for (; de != NULL; de = next) {
+			next = de->next;
+			inode_free_tree(de->inode);
+			slab_free(de, dirent_size(de->len));
+		}
+		inode->buckets[b] = NULL;
+	}
+	inode_free(inode);
+}
+
+/* lock free: the fields a change can move are read with atomic loads */
+static void inode_stat(const struct myfs_inode *inode, struct stat *st)
+{
+	st->st_ino = inode->ino;
+	st->st_mode = inode->mode;
+	st->st_nlink = __atomic_load_n(&inode->nlink, __ATOMIC_RELAXED);
+	st->st_size = __atomic_load_n(&inode->size, __ATOMIC_RELAXED);
+	st->st_blksize = MYFS_EXTENT_SIZE;
+	st->st_blocks = __atomic_load_n(&inode->data.nextents, __ATOMIC_RELAXED) * (MYFS_EXTENT_SIZE / 512); //holes take no space
+	st->st_uid = getuid(); // The owner of the file/directory is the user who mounted the filesystem
+	st->st_gid = getgid(); // The group of the file/directory is the same as the group of the user who mounted filesystem
+	st->st_atim = inode->atime;
+	st->st_mtim.tv_sec = __atomic_load_n(&inode->mtime.tv_sec, __ATOMIC_RELAXED);
+	st->st_mtim.tv_nsec = __atomic_load_n(&inode->mtime.tv_nsec, __ATOMIC_RELAXED);
+	st->st_ctim.tv_sec = __atomic_load_n(&inode->ctime.tv_sec, __ATOMIC_RELAXED);
+	st->st_ctim.tv_nsec = __atomic_load_n(&inode->ctime.tv_nsec, __ATOMIC_RELAXED);
+}
+
+/* lock free, inside epoch_enter()/epoch_exit() */
+static struct myfs_inode *dir_lookup(const struct myfs_inode *dir, const char *name, size_t len)
+{
+	uint64_t h = name_hash(name, len);
+
+	for (;;) {
+		unsigned int seq = __atomic_load_n(&dir->seq, __ATOMIC_ACQUIRE);
+		/* nbuckets before buckets: dir_grow() publishes them the other way round,
+		   so the count read here is never larger than the array */
+		size_t n = __atomic_load_n(&dir->nbuckets, __ATOMIC_ACQUIRE);
+		struct myfs_dirent **b = __atomic_load_n(&dir->buckets, __ATOMIC_ACQUIRE);
+		struct myfs_inode *found = NULL;
+
+		if (seq & 1)
+			continue; //a resize is relinking the entries
+		if (n == 0)
+			return NULL;
+		struct myfs_dirent *de = __atomic_load_n(&b[h & (n - 1)], __ATOMIC_ACQUIRE);
+		for (; de != NULL; de = __atomic_load_n(&de->next, __ATOMIC_ACQUIRE))
+			if (de->hash == h && de->len == len && memcmp(de->name, name, len) == 0) {
+				found = __atomic_load_n(&de->inode, __ATOMIC_ACQUIRE);
+				break;
+			}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&dir->seq, __ATOMIC_RELAXED) == seq)
+			return found;
+	}
+}
+
+static void dir_free_buckets(void *p, size_t size)
+{
+	slab_free(p, size);
+}
+
+/* double the bucket array and rehash; the dirents themselves do not move.
+   Called with the directory locked. */
+static int dir_grow(struct myfs_inode *dir)
+{
+	size_t n = dir->nbuckets ? dir->nbuckets * 2 : MYFS_MIN_BUCKETS;
+	struct myfs_dirent **b = slab_zalloc(n * sizeof(*b));
+	struct myfs_dirent **old = dir->buckets;
+	size_t nold = dir->nbuckets;
+
+	if (b == NULL)
+		return -ENOSPC;
+	__atomic_store_n(&dir->seq, dir->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for (size_t i = 0; i < nold; i++) {
+		struct myfs_dirent *de = old[i], *next;
+		for (; de != NULL; de = next) {
+			next = de->next;
+			__atomic_store_n(&de->next, b[de->hash & (n - 1)], __ATOMIC_RELAXED);
+			b[de->hash & (n - 1)] = de;
+		}
+	}
+	__atomic_store_n(&dir->buckets, b, __ATOMIC_RELEASE);
+	__atomic_store_n(&dir->nbuckets, n, __ATOMIC_RELEASE);
+	__atomic_store_n(&dir->seq, dir->seq + 1, __ATOMIC_RELEASE);
+	if (old != NULL)
+		epoch_retire(dir_free_buckets, old, nold * sizeof(*b));
+	return 0;
+}
+
+/* called with the directory locked */
+static int dir_add(struct myfs_inode *dir, const char *name, size_t len, struct myfs_inode *child)
+{
+	if (dir_lookup(dir, name, len) != NULL)
+		return -EEXIST;
+	if (dir->nentries >= dir->nbuckets && dir_grow(dir) != 0)
+		return -ENOSPC;
+
+	struct myfs_dirent *de = slab_alloc(dirent_size(len));
+	if (de == NULL)
+		return -ENOSPC;
+	de->hash = name_hash(name, len);
+	de->inode = child;
+	de->len = len;
+	memcpy(de->name, name, len);
+	de->name[len] = '\0';
+	if (child->ino == 0) //new, see myfs_next_ino
+		child->ino = __atomic_fetch_add(&myfs_next_ino, 1, __ATOMIC_RELAXED);
+
+	size_t b = de->hash & (dir->nbuckets - 1);
+	de->next = dir->buckets[b];
+	__atomic_store_n(&dir->buckets[b], de, __ATOMIC_RELEASE); //publishes the filled in entry
+	__atomic_store_n(&dir->nentries, dir->nentries + 1, __ATOMIC_RELAXED);
+	if (S_ISDIR(child->mode))
+		__atomic_store_n(&dir->nlink, dir->nlink + 1, __ATOMIC_RELAXED);
+	inode_touch(dir);
+	return 0;
+}
+
+static struct myfs_dirent **dir_find(struct myfs_inode *dir, const char *name, size_t len)
+{
+	if (dir->nbuckets == 0)
+		return NULL;
+	uint64_t h = name_hash(name, len);
+	struct myfs_dirent **pp = &dir->buckets[h & (dir->nbuckets - 1)];
+	for (; *pp != NULL; pp = &(*pp)->next) {
+		struct myfs_dirent *de = *pp;
+		if (de->hash == h && de->len == len && memcmp(de->name, name, len) == 0)
+			return pp;
+	}
+	return NULL;
+}
+
+static void dir_free_dirent(void *p, size_t size)
+{
+	slab_free(p, size);
+}
+
+/* unlink the entry and return the inode it pointed to, or NULL.
+   Called with the directory locked; the inode is left to the caller. */
+static struct myfs_inode *dir_remove(struct myfs_inode *dir, const char *name, size_t len)
+{
+	struct myfs_dirent **pp = dir_find(dir, name, len);
+	if (pp == NULL)
+		return NULL;
+	struct myfs_dirent *de = *pp;
+	struct myfs_inode *child = de->inode;
+	__atomic_store_n(pp, de->next, __ATOMIC_RELEASE);
+	epoch_retire(dir_free_dirent, de, dirent_size(len)); //a lookup may be standing on it
+	__atomic_store_n(&dir->nentries, dir->nentries - 1, __ATOMIC_RELAXED);
+	if (S_ISDIR(child->mode))
+		__atomic_store_n(&dir->nlink, dir->nlink - 1, __ATOMIC_RELAXED);
+	inode_touch(dir);
+	return child;
+}
+
+/* point an existing entry at another inode of the same type, for rename
+   over an existing name: lookups see the old or the new inode, never
+   neither. Returns the old inode. Called with the directory locked. */
+static struct myfs_inode *dir_replace(struct myfs_inode *dir, const char *name, size_t len,
+		struct myfs_inode *inode)
+{
+	struct myfs_dirent **pp = dir_find(dir, name, len);
+	if (pp == NULL)
+		return NULL;
+	struct myfs_inode *old = (*pp)->inode;
+	__atomic_store_n(&(*pp)->inode, inode, __ATOMIC_RELEASE);
+	inode_touch(dir);
+	return old;
+}
+
+/* a private copy of a shared inode, same number and times: a directory
+   gets entries of its own pointing to the same children, a file the
+   same extents (filedata_share()). Files are copied with their lock held
+   for writing, directories need none: nothing changes a shared one.
+   What a snapshot still shares is told apart in getattr, see
+   snapshot_ino(). */
+static struct myfs_inode *inode_copy(struct myfs_inode *src)
+{
+	struct myfs_inode *inode = slab_zalloc(sizeof(*inode));
+	if (inode == NULL)
+		return NULL;
+	pthread_rwlock_init(&inode->lock, NULL);
+	inode->ino = src->ino;
+	inode->mode = src->mode;
+	inode->nlink = src->nlink;
+	inode->size = src->size;
+	inode->atime = src->atime;
+	inode->mtime = src->mtime;
+	inode->ctime = src->ctime;
+	inode->refs = 1;
+	__atomic_fetch_add(&myfs_ninodes, 1, __ATOMIC_RELAXED);
+
+	if (S_ISREG(src->mode)) {
+		pthread_rwlock_wrlock(&src->lock); //the packer may be changing how extents are kept
+		int err = filedata_share(&inode->data, &src->data);
+		pthread_rwlock_unlock(&src->lock);
+		if (err != 0) {
+			inode_free(inode);
+			return NULL;
+		}
+		return inode;
+	}
+	if (src->nbuckets != 0 && (inode->buckets = slab_zalloc(src->nbuckets * sizeof(*inode->buckets))) == NULL) {
+		inode_free(inode);
+		return NULL;
+	}
+	inode->nbuckets = src->nbuckets;
+	for (size_t b = 0; b < src->nbuckets; b++)
+		for (struct myfs_dirent *de = src->buckets[b]; de != NULL; de = de->next) {
+			struct myfs_dirent *copy = slab_alloc(dirent_size(de->len));
+			if (copy == NULL) {
+				inode_free(inode); //drops the children taken so far
+				return NULL;
+			}
+			memcpy(copy, de, dirent_size(de->len));
+			copy->next = inode->buckets[b];
+			inode->buckets[b] = copy;
+			inode->nentries++;
+			__atomic_fetch_add(&de->inode->refs, 1, __ATOMIC_RELAXED);
+		}
+	return inode;
+}
+
+/* point the entry name of dir, which holds a shared inode, at its private
+   copy; unlike dir_replace() the directory does not change for stat().
+   Called with the directory locked. */
+static void dir_swap(struct myfs_inode *dir, const char *name, size_t len, struct myfs_inode *copy)
+{
+	struct myfs_dirent **pp = dir_find(dir, name, len);
+	struct myfs_inode *old = (*pp)->inode;
+
+	__atomic_store_n(&(*pp)->inode, copy, __ATOMIC_RELEASE);
+	inode_put(old); //still referenced by the snapshots that share it
+}
+
+static void dir_lock(struct myfs_inode *dir)
+{
+	pthread_rwlock_wrlock(&dir->lock);
+}
+
+static void dir_unlock(struct myfs_inode *dir)
+{
+	pthread_rwlock_unlock(&dir->lock);
+}
+
+/* mem_limit caps everything allocated for the filesystem, in bytes */
+static int myfs_table_init(size_t mem_limit)
+{
+	slab_init(mem_limit, sizeof(struct myfs_extent));
+	myfs_root = inode_new(S_IFDIR | 0755);
+	if (myfs_root == NULL)
+		return -ENOMEM;
+	myfs_root->ino = myfs_next_ino++;
+	return 0;
+}
+
+/* walk an absolute path one component at a time; lock free, inside epoch_enter()/epoch_exit() */
+static struct myfs_inode *path_lookup(const char *path)
+{
+	struct myfs_inode *inode = myfs_root;
+
+	while (inode != NULL) {
+		while (*path == '/')
+			path++;
+		if (*path == '\0')
+			return inode;
+		if (!S_ISDIR(inode->mode))
+			return NULL;
+		const char *end = strchr(path, '/');
+		if (end == NULL)
+			end = path + strlen(path);
+		inode = dir_lookup(inode, path, end - path);
+		path = end;
+	}
+	return NULL;
+}
+
+/* resolve the directory containing the last component of path.
+   *name and *len are set to that last component. For lookups; a change
+   uses path_private_parent() of myfs_snapshot.h. */
+static inline struct myfs_inode *path_parent(const char *path, const char **name, size_t *len)
+{
+	const char *end = path + strlen(path);
+	while (end > path && end[-1] == '/')
+		end--;
+	const char *base = end;
+	while (base > path && base[-1] != '/')
+		base--;
+	if (base == end)
+		return NULL; //the root has no parent
+
+	*name = base;
+	*len = end - base;
+
+	struct myfs_inode *inode = myfs_root;
+	const char *p = path;
+	while (inode != NULL) {
+		while (p < base && *p == '/')
+			p++;
+		if (p >= base)
+			break;
+		if (!S_ISDIR(inode->mode))
+			return NULL;
+		const char *slash = memchr(p, '/', base - p);
+		inode = dir_lookup(inode, p, slash - p);
+		p = slash;
+	}
+	if (inode != NULL && !S_ISDIR(inode->mode))
+		return NULL;
+	return inode;
+}
+
+#endif /* MYFS_INODE_H */
@@ -0,0 +1,958 @@
+/*
+   Write-ahead journal and checkpoint image for myfs
+
+   With --store=DIR the tree survives a restart. Every namespace or
+   content change that succeeded is appended to an in-memory log buffer as
+   a redo record (the operation, its path(s), the data of a write and the
+   time of the change) while journal_lock() still serializes it against
+   the other changes, so the log order is the order the tree was changed
+   in. The buffer goes to DIR/journal.<seq> and is fdatasync()ed in
+   groups: a flusher thread does it every --commit-ms, and fsync() on the
+   mount waits for the group that holds its records. The first waiter
+   that finds no flush in progress writes out everything appended so far
+   and the others sleep until it is done, so N concurrent fsyncs cost one
+   disk flush.
+
+   Every --checkpoint-secs, if anything changed, the journal moves on to a
+   new segment and the daemon forks. The child writes the tree as it was
+   at the fork to DIR/checkpoint.tmp, fsyncs it and renames it over
+   DIR/checkpoint, so changes are held up for the fork only. When the
+   child has exited successfully the segments covered by the image are
+   deleted. The image holds the inodes in preorder with their names and
+   extent tables, followed by the extents themselves, page aligned. An
+   inode that snapshots share (myfs_snapshot.h) is written once, its
+   other entries refer back to it, so the sharing survives a restart;
+   extents shared between two files are written for each of them. The
+   child sees memory only as it was at the fork, where another thread may
+   have held a lock or been inside malloc(), so it takes no lock and does
+   not allocate.
+
+   At startup the image is mmap()ed and the tree is rebuilt from the
+   metadata in one pass; file extents point straight into the mapping
+   (MAP_PRIVATE, so a write copies only the page it touches) and file
+   data is read in by the page cache when it is first used. Only the
+   segments written after the image are replayed, and replay of a segment
+   stops at the first record whose checksum does not match: the torn tail
+   left by a crash.
+ */
+
+#ifndef MYFS_JOURNAL_H
+#define MYFS_JOURNAL_H
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+
+#include "myfs_inode.h"
+
+#define JOURNAL_MAX_BUFFER (64UL << 20) //a change waits for the disk when this much is not written yet
+#define CKPT_REPLAY_LIMIT (256UL << 20) //unmount writes an image when more log than this would be replayed
+#define CKPT_MAGIC "MYFSCKP2"
+#define CKPT_MAGIC_V1 "MYFSCKP1" //images without shared inodes, still loaded
+#define CKPT_ALIGN 4096 //extents start page aligned so they can be used in place
+#define CKPT_BUFFER (1UL << 20)
+
+enum journal_type {
+	JOURNAL_MKNOD = 1,
+	JOURNAL_MKDIR,
+	JOURNAL_UNLINK,
+	JOURNAL_RMDIR,
+	JOURNAL_RENAME,
+	JOURNAL_WRITE,
+	JOURNAL_TRUNCATE,
+	JOURNAL_SNAPSHOT, //mode: SNAPSHOT_CLONE or 0
+};
+
+/* payload: the path, then the second path of a rename or snapshot or the data of a write */
+struct journal_rec {
+	uint32_t crc; //CRC-32C of the rest of the header and the payload
+	uint32_t len; //payload bytes
+	uint16_t type;
+	uint16_t nlen; //length of the path at the start of the payload
+	uint32_t mode;
+	int64_t off; //write offset, truncate size
+	int64_t sec; //time of the change
+	int64_t nsec;
+};
+
+struct ckpt_header {
+	char magic[8];
+	uint64_t seq; //first journal segment that is not in the image
+	uint64_t next_ino;
+	uint64_t ninodes;
+	uint64_t meta_size; //this header and the inode records; extents follow, CKPT_ALIGN aligned
+};
+
+#define CKPT_SHARED 0x10000000 //in mode: other entries refer to this inode
+#define CKPT_LINK 0x20000000 //in mode: one of them, for the nentries-th CKPT_SHARED inode
+
+/* followed by the name (8 byte padded) and nextents struct ckpt_extent */
+struct ckpt_inode {
+	uint64_t ino;
+	uint32_t mode;
+	uint32_t namelen; //0 for the root
+	int64_t size;
+	int64_t times[6]; //atime, mtime, ctime as sec, nsec
+	uint64_t nentries; //directories: children that follow in preorder
+	uint64_t nextents;
+};
+
+struct ckpt_extent {
+	uint64_t idx; //slot in the file's extent map
+	uint64_t off; //position of the data in the image
+};
+
+struct journal_buf {
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+static struct journal {
+	int enabled;
+	int replaying;
+	int dirfd;
+	int fd; //current segment
+	uint64_t seq; //its number
+	pthread_mutex_t order; //held from a change until its record is appended
+	struct timespec now; //time of the change made under order
+	unsigned int commit_ms;
+	unsigned int checkpoint_secs;
+
+	pthread_mutex_t lock; //protects everything below
+	pthread_cond_t flushed;
+	pthread_cond_t wake;
+	struct journal_buf buf; //records not handed to a flush yet
+	struct journal_buf spare; //the buffer being written by the flush in progress
+	uint64_t appended; //bytes of log ever appended: the log sequence number
+	uint64_t durable; //bytes of log known to be on disk
+	uint64_t checkpointed; //appended when the last image was taken
+	int flushing;
+	int error; //a failed log write; journal_lock() refuses changes from then on
+	int stop;
+	pthread_t flusher;
+	pthread_t checkpointer;
+	uint64_t records, flushes, fsyncs, checkpoints;
+
+	char *image; //the mmap()ed checkpoint the tree was loaded from
+	size_t image_size;
+} journal = {
+	.dirfd = -1,
+	.fd = -1,
+	.order = PTHREAD_MUTEX_INITIALIZER,
+	.commit_ms = 5,
+	.checkpoint_secs = 300,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.flushed = PTHREAD_COND_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+};
+
+static uint32_t crc32c_table[256];
+
+static void crc32c_init(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++)
+			c = c & 1 ? 0x82f63b78 ^ (c >> 1) : c >> 1;
+		crc32c_table[i] = c;
+	}
+}
+
+static uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	crc = ~crc;
+#ifdef __SSE4_2__
+	for (; len >= 8; len -= 8, p += 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		crc = (uint32_t) _mm_crc32_u64(crc, v);
+	}
+#endif
+	while (len--)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static uint32_t journal_crc(const struct journal_rec *r, const char *payload)
+{
+	uint32_t crc = crc32c(0, (const char *) r + sizeof(r->crc), sizeof(*r) - sizeof(r->crc));
+	return crc32c(crc, payload, r->len);
+}
+
+/* a change to the tree: journal_lock(), change, journal_log() if it worked,
+   journal_unlock(). -EROFS, and no lock, once a log write has failed: a
+   change made now would be lost at the next mount. */
+static int journal_lock(void)
+{
+	if (!journal.enabled)
+		return 0;
+	pthread_mutex_lock(&journal.order);
+	if (__atomic_load_n(&journal.error, __ATOMIC_RELAXED) != 0) {
+		pthread_mutex_unlock(&journal.order);
+		return -EROFS;
+	}
+	if (!journal.replaying) {
+		clock_gettime(CLOCK_REALTIME, &journal.now);
+		myfs_time = &journal.now; //the record carries the time the inodes got
+	}
+	return 0;
+}
+
+static void journal_unlock(void)
+{
+	if (!journal.enabled)
+		return;
+	if (!journal.replaying)
+		myfs_time = NULL;
+	pthread_mutex_unlock(&journal.order);
+}
+
+static int journal_write(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += n;
+		len -= n;
+	}
+	return fdatasync(fd) == -1 ? -errno : 0;
+}
+
+/* wait until the log is on disk up to lsn; group commit, see the top of the file */
+static int journal_sync(uint64_t lsn)
+{
+	int err;
+
+	pthread_mutex_lock(&journal.lock);
+	while (journal.durable < lsn && journal.error == 0) {
+		if (journal.flushing) {
+			pthread_cond_wait(&journal.flushed, &journal.lock);
+			continue;
+		}
+		struct journal_buf out = journal.buf;
+		uint64_t end = journal.appended;
+		int fd = journal.fd;
+
+		journal.buf = journal.spare;
+		journal.spare = out;
+		journal.flushing = 1;
+		pthread_mutex_unlock(&journal.lock);
+		err = journal_write(fd, out.data, out.len);
+		pthread_mutex_lock(&journal.lock);
+		journal.spare.len = 0;
+		journal.flushing = 0;
+		if (err != 0)
+			__atomic_store_n(&journal.error, -err, __ATOMIC_RELAXED);
+		else {
+			journal.durable = end;
+			journal.flushes++;
+		}
+		pthread_cond_broadcast(&journal.flushed);
+	}
+	err = -journal.error;
+	pthread_mutex_unlock(&journal.lock);
+	return err;
+}
+
+/* append the record of a change made under journal_lock() */
+static void journal_log(int type, mode_t mode, off_t off, const char *path,
+		const char *extra, size_t extra_len)
+{
+	if (!journal.enabled || journal.replaying)
+		return;
+
+	size_t nlen = strlen(path);
+	struct journal_rec r = {
+		.len = nlen + extra_len,
+		.type = type,
+		.nlen = nlen,
+		.mode = mode,
+		.off = off,
+		.sec = journal.now.tv_sec,
+		.nsec = journal.now.tv_nsec,
+	};
+	uint32_t crc = crc32c(0, (const char *) &r + sizeof(r.crc), sizeof(r) - sizeof(r.crc));
+	crc = crc32c(crc, path, nlen);
+	r.crc = crc32c(crc, extra, extra_len);
+
+	size_t need = sizeof(r) + r.len;
+	pthread_mutex_lock(&journal.lock);
+	struct journal_buf *b = &journal.buf;
+	if (b->len + need > b->cap) {
+		size_t cap = b->cap ? b->cap : 65536;
+		while (cap < b->len + need)
+			cap *= 2;
+		char *data = realloc(b->data, cap);
+		if (data == NULL) {
+			__atomic_store_n(&journal.error, ENOMEM, __ATOMIC_RELAXED); //this change is not durable and fsync() says so
+			pthread_mutex_unlock(&journal.lock);
+			return;
+		}
+		b->data = data;
+		b->cap = cap;
+	}
+	memcpy(b->data + b->len, &r, sizeof(r));
+	memcpy(b->data + b->len + sizeof(r), path, nlen);
+	if (extra_len)
+		memcpy(b->data + b->len + sizeof(r) + nlen, extra, extra_len);
+	b->len += need;
+	journal.appended += need;
+	journal.records++;
+	uint64_t lsn = journal.appended;
+	int full = b->len >= JOURNAL_MAX_BUFFER;
+	pthread_mutex_unlock(&journal.lock);
+	if (full)
+		journal_sync(lsn); //back pressure: the log may not run ahead of the disk without bound
+}
+
+/* fsync() and fsyncdir() on the mount */
+static int journal_fsync(void)
+{
+	if (!journal.enabled)
+		return 0;
+	pthread_mutex_lock(&journal.lock);
+	uint64_t lsn = journal.appended;
+	journal.fsyncs++;
+	pthread_mutex_unlock(&journal.lock);
+	return journal_sync(lsn);
+}
+
+static int journal_open_segment(uint64_t seq)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "journal.%llu", (unsigned long long) seq);
+	int fd = openat(journal.dirfd, name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return -errno;
+	fsync(journal.dirfd); //the new name itself has to survive a crash
+	return fd;
+}
+
+/* the segment numbers in the store, ascending; *n is set to their count */
+static uint64_t *journal_segments(size_t *n)
+{
+	int fd = dup(journal.dirfd);
+	DIR *dp = fd == -1 ? NULL : fdopendir(fd);
+	uint64_t *seqs = NULL;
+	size_t cap = 0;
+	struct dirent *de;
+
+	*n = 0;
+	if (dp == NULL) {
+		if (fd != -1)
+			close(fd);
+		return NULL;
+	}
+	rewinddir(dp);
+	while ((de = readdir(dp)) != NULL) {
+		char *end;
+		if (strncmp(de->d_name, "journal.", 8) != 0)
+			continue;
+		unsigned long long seq = strtoull(de->d_name + 8, &end, 10);
+		if (end == de->d_name + 8 || *end != '\0')
+			continue;
+		if (*n == cap) {
+			cap = cap ? cap * 2 : 16;
+			uint64_t *s = realloc(seqs, cap * sizeof(*s));
+			if (s == NULL)
+				break;
+			seqs = s;
+		}
+		seqs[(*n)++] = seq;
+	}
+	closedir(dp);
+	/* insertion sort: there are only a few segments at a time */
+	for (size_t i = 1; i < *n; i++)
+		for (size_t j = i; j > 0 && seqs[j - 1] > seqs[j]; j--) {
+			uint64_t t = seqs[j];
+			seqs[j] = seqs[j - 1];
+			seqs[j - 1] = t;
+		}
+	return seqs;
+}
+
+/* delete the segments an image made on disk has made redundant */
+static void journal_trim(uint64_t seq)
+{
+	size_t n;
+	uint64_t *seqs = journal_segments(&n);
+
+	for (size_t i = 0; i < n && seqs[i] < seq; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "journal.%llu", (unsigned long long) seqs[i]);
+		unlinkat(journal.dirfd, name, 0);
+	}
+	free(seqs);
+}
+
+/* redo the records of one segment; returns the number applied */
+static uint64_t journal_replay_segment(uint64_t seq,
+		void (*apply)(const struct journal_rec *r, const char *payload))
+{
+	char name[32];
+	struct stat st;
+	uint64_t applied = 0;
+
+	snprintf(name, sizeof(name), "journal.%llu", (unsigned long long) seq);
+	int fd = openat(journal.dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return 0;
+	if (fstat(fd, &st) == -1 || st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	size_t pos = 0;
+	while (pos + sizeof(struct journal_rec) <= (size_t) st.st_size) {
+		struct journal_rec r;
+		memcpy(&r, map + pos, sizeof(r));
+		if (r.len > st.st_size - pos - sizeof(r) || r.nlen > r.len)
+			break;
+		const char *payload = map + pos + sizeof(r);
+		if (journal_crc(&r, payload) != r.crc)
+			break; //torn write: nothing after it made it to disk
+		journal.now.tv_sec = r.sec;
+		journal.now.tv_nsec = r.nsec;
+		apply(&r, payload);
+		applied++;
+		pos += sizeof(r) + r.len;
+	}
+	if (pos != (size_t) st.st_size)
+		fprintf(stderr, "myfs: %s: ignoring %zu bytes after the last complete record\n",
+				name, (size_t) st.st_size - pos);
+	munmap(map, st.st_size);
+	return applied;
+}
+
+/* load the image, if there is one, into the empty tree; *seq is the first segment it does not cover */
+static int ckpt_load(uint64_t *seq)
+{
+	struct stat st;
+	struct ckpt_header hdr;
+	struct ckpt_frame {
+		struct myfs_inode *dir;
+		uint64_t left;
+		struct timespec mtime;
+		struct timespec ctime;
+	} *stack = NULL;
+	struct myfs_inode **shared = NULL;
+	size_t depth = 0, cap = 0, nshared = 0, shared_cap = 0;
+	int err = -EINVAL;
+
+	*seq = 0;
+	int fd = openat(journal.dirfd, "checkpoint", O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return errno == ENOENT ? 0 : -errno;
+	if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(hdr)) {
+		close(fd);
+		return -EINVAL;
+	}
+	char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -errno;
+	memcpy(&hdr, map, sizeof(hdr));
+	if ((memcmp(hdr.magic, CKPT_MAGIC, 8) != 0 && memcmp(hdr.magic, CKPT_MAGIC_V1, 8) != 0) ||
+			hdr.meta_size > (uint64_t) st.st_size)
+		goto out;
+	journal.image = map;
+	journal.image_size = st.st_size;
+	extent_mapped_lo = map;
+	extent_mapped_hi = map + st.st_size;
+
+	const char *p = map + sizeof(hdr), *end = map + hdr.meta_size;
+	for (uint64_t i = 0; i < hdr.ninodes; i++) {
+		struct ckpt_inode ci;
+		struct myfs_inode *inode;
+
+		if (end - p < (ptrdiff_t) sizeof(ci))
+			goto out;
+		memcpy(&ci, p, sizeof(ci));
+		p += sizeof(ci);
+		const char *name = p;
+		p += (ci.namelen + 7) & ~7UL;
+		if (p > end || (uint64_t) (end - p) / sizeof(struct ckpt_extent) < ci.nextents)
+			goto out;
+
+		if (i == 0) {
+			inode = myfs_root;
+		} else {
+			/* the next child of the innermost directory that still has some */
+			while (depth > 0 && stack[depth - 1].left == 0) {
+				stack[depth - 1].dir->mtime = stack[depth - 1].mtime;
+				stack[depth - 1].dir->ctime = stack[depth - 1].ctime;
+				depth--;
+			}
+			if (depth == 0 || ci.namelen == 0)
+				goto out;
+			if (ci.mode & CKPT_LINK) {
+				if (ci.nentries >= nshared || dir_add(stack[depth - 1].dir, name, ci.namelen,
+						inode = shared[ci.nentries]) != 0)
+					goto out;
+				inode->refs++;
+				stack[depth - 1].left--;
+				continue;
+			}
+			inode = inode_new(ci.mode & ~CKPT_SHARED);
+			if (inode == NULL || dir_add(stack[depth - 1].dir, name, ci.namelen, inode) != 0) {
+				err = -ENOSPC;
+				goto out;
+			}
+			stack[depth - 1].left--;
+		}
+		if (ci.mode & CKPT_SHARED) {
+			if (nshared == shared_cap) {
+				shared_cap = shared_cap ? shared_cap * 2 : 64;
+				struct myfs_inode **s = realloc(shared, shared_cap * sizeof(*s));
+				if (s == NULL) {
+					err = -ENOMEM;
+					goto out;
+				}
+				shared = s;
+			}
+			shared[nshared++] = inode;
+		}
+		inode->ino = ci.ino;
+		inode->mode = ci.mode & ~CKPT_SHARED;
+		inode->size = ci.size;
+		inode->atime = (struct timespec) { ci.times[0], ci.times[1] };
+		inode->mtime = (struct timespec) { ci.times[2], ci.times[3] };
+		inode->ctime = (struct timespec) { ci.times[4], ci.times[5] };
+
+		for (uint64_t e = 0; e < ci.nextents; e++) {
+			struct ckpt_extent ce;
+			memcpy(&ce, p, sizeof(ce));
+			p += sizeof(ce);
+			if (ce.off % CKPT_ALIGN != 0 || ce.off + MYFS_EXTENT_SIZE > (uint64_t) st.st_size)
+				goto out;
+			if (filedata_reserve(&inode->data, ce.idx) != 0) {
+				err = -ENOSPC;
+				goto out;
+			}
+			inode->data.map[ce.idx] = (uintptr_t) (map + ce.off);
+			inode->data.nextents++;
+		}
+
+		if (S_ISDIR(ci.mode) && ci.nentries > 0) {
+			/* size the table once instead of doubling it while the entries come in */
+			while (inode->nbuckets < ci.nentries)
+				if (dir_grow(inode) != 0) {
+					err = -ENOSPC;
+					goto out;
+				}
+			if (depth == cap) {
+				cap = cap ? cap * 2 : 64;
+				struct ckpt_frame *s = realloc(stack, cap * sizeof(*s));
+				if (s == NULL) {
+					err = -ENOMEM;
+					goto out;
+				}
+				stack = s;
+			}
+			stack[depth++] = (struct ckpt_frame) { inode, ci.nentries, inode->mtime, inode->ctime };
+		}
+	}
+	/* dir_add() stamped the directories that got entries last */
+	while (depth > 0) {
+		stack[depth - 1].dir->mtime = stack[depth - 1].mtime;
+		stack[depth - 1].dir->ctime = stack[depth - 1].ctime;
+		depth--;
+	}
+	myfs_next_ino = hdr.next_ino;
+	*seq = hdr.seq;
+	err = 0;
+out:
+	free(stack);
+	free(shared);
+	if (err != 0)
+		fprintf(stderr, "myfs: the checkpoint image is damaged\n");
+	return err;
+}
+
+/* writing an image: metadata through a buffer at meta_off, extents directly at data_off */
+struct ckpt_writer {
+	int fd;
+	int err;
+	char *buf;
+	size_t len;
+	uint64_t meta_off;
+	uint64_t data_off;
+};
+
+static char ckpt_buffer[CKPT_BUFFER];
+static struct myfs_extent ckpt_unpacked; //compressed extents are written out plain
+static unsigned int ckpt_marks; //inode->ckpt_pass values handed out so far
+
+/* a pass over the tree (started when ckpt_marks was base) numbers the
+   shared inodes in the order it meets them. 0 the first time it meets
+   inode, otherwise 1 + the inode's number. */
+static unsigned int ckpt_visit(struct myfs_inode *inode, unsigned int base)
+{
+	if (inode->refs <= 1)
+		return 0;
+	if (inode->ckpt_pass > base)
+		return inode->ckpt_pass - base;
+	inode->ckpt_pass = ++ckpt_marks; //the child's copy of the page, or the tree at unmount
+	return 0;
+}
+
+static void ckpt_flush(struct ckpt_writer *w)
+{
+	size_t done = 0;
+	while (done < w->len && w->err == 0) {
+		ssize_t n = pwrite(w->fd, w->buf + done, w->len - done, w->meta_off + done);
+		if (n == -1 && errno != EINTR)
+			w->err = -errno;
+		else if (n > 0)
+			done += n;
+	}
+	w->meta_off += done;
+	w->len = 0;
+}
+
+static void ckpt_put(struct ckpt_writer *w, const void *p, size_t len)
+{
+	while (len > 0) {
+		size_t n = CKPT_BUFFER - w->len < len ? CKPT_BUFFER - w->len : len;
+		memcpy(w->buf + w->len, p, n);
+		w->len += n;
+		p = (const char *) p + n;
+		len -= n;
+		if (w->len == CKPT_BUFFER)
+			ckpt_flush(w);
+	}
+}
+
+/* bytes of metadata and number of records below (and including) inode */
+static void ckpt_measure(struct myfs_inode *inode, size_t namelen, uint64_t *meta, uint64_t *ninodes,
+		unsigned int base)
+{
+	*meta += sizeof(struct ckpt_inode) + ((namelen + 7) & ~7UL);
+	(*ninodes)++;
+	if (ckpt_visit(inode, base) != 0)
+		return; //a link
+	*meta += filedata_count(&inode->data) * sizeof(struct ckpt_extent); //nextents may be off, see ckpt_put_inode()
+	for (size_t b = 0; b < inode->nbuckets; b++)
+		for (const struct myfs_dirent *de = inode->buckets[b]; de != NULL; de = de->next)
+			ckpt_measure(de->inode, de->len, meta, ninodes, base);
+}
+
+static void ckpt_put_inode(struct ckpt_writer *w, struct myfs_inode *inode,
+		const char *name, size_t namelen, unsigned int base)
+{
+	static const char zeros[8];
+	unsigned int seen = ckpt_visit(inode, base);
+
+	if (seen != 0) {
+		struct ckpt_inode link = {
+			.ino = inode->ino,
+			.mode = inode->mode | CKPT_LINK,
+			.namelen = namelen,
+			.nentries = seen - 1,
+		};
+		ckpt_put(w, &link, sizeof(link));
+		ckpt_put(w, name, namelen);
+		ckpt_put(w, zeros, ((namelen + 7) & ~7UL) - namelen);
+		return;
+	}
+
+	struct ckpt_inode ci = {
+		.ino = inode->ino,
+		.mode = inode->mode | (inode->refs > 1 ? CKPT_SHARED : 0),
+		.namelen = namelen,
+		.size = inode->size,
+		.times = { inode->atime.tv_sec, inode->atime.tv_nsec, inode->mtime.tv_sec,
+				inode->mtime.tv_nsec, inode->ctime.tv_sec, inode->ctime.tv_nsec },
+		.nentries = S_ISDIR(inode->mode) ? inode->nentries : 0,
+		/* not data.nextents: the fork may have caught the packer between
+		   making a hole and counting it, and the loader reads exactly
+		   this many extent records */
+		.nextents = filedata_count(&inode->data),
+	};
+
+	ckpt_put(w, &ci, sizeof(ci));
+	ckpt_put(w, name, namelen);
+	ckpt_put(w, zeros, ((namelen + 7) & ~7UL) - namelen);
+	for (size_t i = 0; i < inode->data.nmap; i++) {
+		uintptr_t slot = inode->data.map[i];
+		if (slot == 0)
+			continue;
+		const struct myfs_extent *e = (const struct myfs_extent *) slot_data(slot); //shared ones too, once per file
+		if (slot & EXTENT_PACKED) {
+			if (pack_unpack(slot_packed(slot), ckpt_unpacked.data) != 0)
+				w->err = -EIO;
+			e = &ckpt_unpacked;
+		}
+		struct ckpt_extent ce = { i, w->data_off };
+		ckpt_put(w, &ce, sizeof(ce));
+		size_t done = 0;
+		while (done < sizeof(*e) && w->err == 0) {
+			ssize_t n = pwrite(w->fd, e->data + done, sizeof(*e) - done, w->data_off + done);
+			if (n == -1 && errno != EINTR)
+				w->err = -errno;
+			else if (n > 0)
+				done += n;
+		}
+		w->data_off += sizeof(*e);
+	}
+	for (size_t b = 0; b < inode->nbuckets; b++)
+		for (const struct myfs_dirent *de = inode->buckets[b]; de != NULL; de = de->next)
+			ckpt_put_inode(w, de->inode, de->name, de->len, base);
+}
+
+/* write the tree as DIR/checkpoint; seq is the first segment not contained in it */
+static int ckpt_save(uint64_t seq)
+{
+	struct ckpt_header hdr = { .seq = seq, .next_ino = myfs_next_ino };
+	struct ckpt_writer w = { .buf = ckpt_buffer };
+
+	memcpy(hdr.magic, CKPT_MAGIC, 8);
+	hdr.meta_size = sizeof(hdr);
+	ckpt_measure(myfs_root, 0, &hdr.meta_size, &hdr.ninodes, ckpt_marks);
+	w.data_off = (hdr.meta_size + CKPT_ALIGN - 1) & ~(uint64_t) (CKPT_ALIGN - 1);
+
+	w.fd = openat(journal.dirfd, "checkpoint.tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (w.fd == -1)
+		return -errno;
+	ckpt_put(&w, &hdr, sizeof(hdr));
+	ckpt_put_inode(&w, myfs_root, NULL, 0, ckpt_marks);
+	ckpt_flush(&w);
+	if (w.err == 0 && fsync(w.fd) == -1)
+		w.err = -errno;
+	close(w.fd);
+	if (w.err == 0 && renameat(journal.dirfd, "checkpoint.tmp", journal.dirfd, "checkpoint") == -1)
+		w.err = -errno;
+	if (w.err == 0 && fsync(journal.dirfd) == -1)
+		w.err = -errno;
+	return w.err;
+}
+
+/* take an image, in a forked child if background is set */
+static int journal_checkpoint(int background)
+{
+	uint64_t seq, lsn;
+	pid_t pid = -1;
+	int err, fd;
+
+	pthread_mutex_lock(&journal.order);
+	/* everything before the image goes into the old segment, everything after into a new one */
+	err = journal_sync(journal.appended);
+	if (err == 0 && (fd = journal_open_segment(journal.seq + 1)) < 0)
+		err = fd;
+	if (err != 0) {
+		pthread_mutex_unlock(&journal.order);
+		return err;
+	}
+	pthread_mutex_lock(&journal.lock);
+	close(journal.fd);
+	journal.fd = fd;
+	seq = ++journal.seq;
+	lsn = journal.appended;
+	pthread_mutex_unlock(&journal.lock);
+
+	if (background) {
+		pack_prepare(); //the child decompresses with this thread's context
+		pid = fork();
+		if (pid == 0)
+			_exit(ckpt_save(seq) == 0 ? 0 : 1);
+		if (pid == -1)
+			err = -errno;
+	} else
+		err = ckpt_save(seq);
+	pthread_mutex_unlock(&journal.order);
+
+	if (pid > 0) {
+		int status;
+		while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+			;
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			err = -EIO;
+	}
+	if (err != 0) {
+		fprintf(stderr, "myfs: checkpoint failed: %s\n", strerror(-err));
+		return err;
+	}
+	journal_trim(seq);
+	pthread_mutex_lock(&journal.lock);
+	journal.checkpointed = lsn;
+	journal.checkpoints++;
+	pthread_mutex_unlock(&journal.lock);
+	return 0;
+}
+
+static void journal_wait(unsigned int ms)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (long) (ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&journal.wake, &journal.lock, &ts);
+}
+
+/* bounds how long a change can stay in memory when nobody calls fsync() */
+static void *journal_flusher(void *arg)
+{
+	(void) arg;
+	pthread_mutex_lock(&journal.lock);
+	while (!journal.stop) {
+		journal_wait(journal.commit_ms);
+		uint64_t lsn = journal.appended;
+		if (lsn == journal.durable || journal.error != 0)
+			continue;
+		pthread_mutex_unlock(&journal.lock);
+		journal_sync(lsn);
+		pthread_mutex_lock(&journal.lock);
+	}
+	pthread_mutex_unlock(&journal.lock);
+	return NULL;
+}
+
+static void *journal_checkpointer(void *arg)
+{
+	(void) arg;
+	pthread_mutex_lock(&journal.lock);
+	while (!journal.stop) {
+		journal_wait(journal.checkpoint_secs * 1000);
+		if (journal.stop || journal.appended == journal.checkpointed || journal.error != 0)
+			continue;
+		pthread_mutex_unlock(&journal.lock);
+		journal_checkpoint(1);
+		pthread_mutex_lock(&journal.lock);
+	}
+	pthread_mutex_unlock(&journal.lock);
+	return NULL;
+}
+
+/* open the store in dir and bring the (empty) tree up to date; before the FUSE session starts */
+static int journal_open(const char *dir, void (*apply)(const struct journal_rec *r, const char *payload))
+{
+	uint64_t seq, replayed = 0;
+	size_t n;
+	int err, fd;
+
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+		return -errno;
+	journal.dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (journal.dirfd == -1)
+		return -errno;
+	crc32c_init();
+	myfs_time = &journal.now; //the loader sets the times itself, spare it the clock
+	err = ckpt_load(&seq);
+	if (err != 0)
+		return err;
+
+	journal.enabled = 1;
+	journal.replaying = 1;
+	uint64_t *seqs = journal_segments(&n);
+	for (size_t i = 0; i < n; i++) {
+		if (seqs[i] < seq)
+			continue; //left behind by a crash between the image and the trim
+		replayed += journal_replay_segment(seqs[i], apply);
+		seq = seqs[i] + 1;
+	}
+	free(seqs);
+	myfs_time = NULL;
+	journal.replaying = 0;
+	if (replayed > 0)
+		fprintf(stderr, "myfs: replayed %llu journal records\n", (unsigned long long) replayed);
+
+	/* never append behind a torn tail: start a fresh segment */
+	fd = journal_open_segment(seq);
+	if (fd < 0)
+		return fd;
+	journal.fd = fd;
+	journal.seq = seq;
+	return 0;
+}
+
+/* after fuse_main() has forked into the background */
+static int journal_start(void)
+{
+	if (!journal.enabled)
+		return 0;
+	if (pthread_create(&journal.flusher, NULL, journal_flusher, NULL) != 0)
+		return -1;
+	if (journal.checkpoint_secs > 0 &&
+			pthread_create(&journal.checkpointer, NULL, journal_checkpointer, NULL) != 0)
+		journal.checkpoint_secs = 0;
+	return 0;
+}
+
+/* at unmount: stop the threads, put the log on disk, and take an image if replay would be long */
+static void journal_close(void)
+{
+	if (!journal.enabled)
+		return;
+	pthread_mutex_lock(&journal.lock);
+	journal.stop = 1;
+	pthread_cond_broadcast(&journal.wake);
+	pthread_mutex_unlock(&journal.lock);
+	pthread_join(journal.flusher, NULL);
+	if (journal.checkpoint_secs > 0)
+		pthread_join(journal.checkpointer, NULL);
+
+	if (journal_sync(journal.appended) == 0 &&
+			journal.appended - journal.checkpointed > CKPT_REPLAY_LIMIT)
+		journal_checkpoint(0);
+	close(journal.fd);
+	close(journal.dirfd);
+	journal.enabled = 0;
+}
+
+/* the tree has been freed: drop the image its extents pointed into */
+static void journal_unmap(void)
+{
+	if (journal.image != NULL)
+		munmap(journal.image, journal.image_size);
+	journal.image = NULL;
+	extent_mapped_lo = extent_mapped_hi = NULL;
+}
+
+/* snprintf() style, for the stats file */
+static int journal_format(char *buf, size_t size)
+{
+	if (!journal.enabled)
+		return snprintf(buf, size, "%s", "");
+	pthread_mutex_lock(&journal.lock);
+	int len = snprintf(buf, size, "journal: segment %llu, %llu records, %llu bytes logged, %llu on disk, "
+			"%llu flushes for %llu fsyncs, %llu checkpoints%s\n",
+			(unsigned long long) journal.seq, (unsigned long long) journal.records,
+			(unsigned long long) journal.appended, (unsigned long long) journal.durable,
+			(unsigned long long) journal.flushes, (unsigned long long) journal.fsyncs,
+			(unsigned long long) journal.checkpoints, journal.error ? ", WRITE ERROR" : "");
+	pthread_mutex_unlock(&journal.lock);
+	return len;
+}
+
+#endif /* MYFS_JOURNAL_H */
@@ -0,0 +1,349 @@
+/*
+   Size-classed slab allocator for myfs metadata and extents
+
+   Inodes, directory entries (with their names) and extents are small,
+   fixed-size and allocated by the million, so instead of going through
+   malloc() one object at a time they are carved out of 2 MiB chunks, one
+   set of chunks per size class. A chunk is aligned to its own size, so
+   the chunk an object belongs to is found by masking the pointer.
+
+   Every thread keeps a small magazine of free objects per class and only
+   takes the class lock to refill or drain half a magazine at a time.
+   Chunks that become empty are handed back to the system.
+
+   All memory (chunks and the few allocations too large for a class) is
+   charged against slab_limit. When the limit is reached allocations fail
+   and the filesystem reports ENOSPC instead of the daemon being OOM
+   killed, and statfs() reports the space that is really left.
+ */
+
+#ifndef MYFS_SLAB_H
+#define MYFS_SLAB_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/statvfs.h>
+
+#define SLAB_CHUNK_SHIFT 21
+#define SLAB_CHUNK_SIZE (1UL << SLAB_CHUNK_SHIFT) //2 MiB
+#define SLAB_MIN_SHIFT 4 //smallest class: 16 bytes
+#define SLAB_MAX_SHIFT 12 //largest small class: 4 KiB
+#define SLAB_NSMALL (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_NCLASSES (SLAB_NSMALL + 1) //small classes plus the extent class
+#define SLAB_MAG_SIZE 32
+#define SLAB_HDR_SIZE 64 //room for struct slab_chunk, keeps objects cache line aligned
+
+struct slab_chunk {
+	struct slab_chunk *next; //in the partial or full list of its class
+	struct slab_chunk *prev;
+	void *free_objs; //objects of this chunk that are not handed out
+	unsigned int inuse; //handed out to callers or sitting in a magazine
+	unsigned int nobjs;
+	int cls;
+};
+
+struct slab_class {
+	pthread_mutex_t lock;
+	size_t size;
+	unsigned int mag_max; //how many objects a thread may cache
+	struct slab_chunk *partial; //chunks with at least one free object
+	struct slab_chunk *full;
+	size_t nchunks;
+	atomic_size_t inuse; //objects held by callers
+};
+
+struct slab_magazine {
+	unsigned int n;
+	void *objs[SLAB_MAG_SIZE];
+};
+
+static struct slab_class slab_classes[SLAB_NCLASSES];
+static size_t slab_limit = SIZE_MAX;
+static atomic_size_t slab_reserved; //chunks plus large allocations
+static atomic_size_t slab_large_bytes;
+static atomic_size_t slab_large_count;
+
+static __thread struct slab_magazine slab_mags[SLAB_NCLASSES];
+static __thread int slab_mags_registered;
+static pthread_key_t slab_mags_key;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+
+_Static_assert(sizeof(struct slab_chunk) <= SLAB_HDR_SIZE, "slab header too large");
+
+static void slab_drain(int c, struct slab_magazine *m, unsigned int keep);
+
+/* give the cached objects of an exiting thread back to their chunks */
+static void slab_thread_exit(void *arg)
+{
+	struct slab_magazine *mags = arg;
+	for (int c = 0; c < SLAB_NCLASSES; c++)
+		slab_drain(c, &mags[c], 0);
+}
+
+static void slab_setup(void)
+{
+	pthread_key_create(&slab_mags_key, slab_thread_exit);
+}
+
+/* set the memory cap and the size of the extent class */
+static void slab_init(size_t limit, size_t extent_size)
+{
+	slab_limit = limit;
+	for (int c = 0; c < SLAB_NCLASSES; c++) {
+		struct slab_class *cls = &slab_classes[c];
+		pthread_mutex_init(&cls->lock, NULL);
+		cls->size = c < SLAB_NSMALL ? 1UL << (c + SLAB_MIN_SHIFT) : extent_size;
+		cls->mag_max = SLAB_MAG_SIZE;
+		if (cls->size * SLAB_MAG_SIZE > 256 * 1024)
+			cls->mag_max = 4; //don't let every thread sit on megabytes of extents
+	}
+}
+
+static int slab_class_of(size_t size)
+{
+	if (size <= (1UL << SLAB_MIN_SHIFT))
+		return 0;
+	if (size <= (1UL << SLAB_MAX_SHIFT))
+		return 64 - __builtin_clzl(size - 1) - SLAB_MIN_SHIFT;
+	if (size == slab_classes[SLAB_NSMALL].size)
+		return SLAB_NSMALL;
+	return -1;
+}
+
+static int slab_charge(size_t size)
+{
+	size_t old = atomic_load_explicit(&slab_reserved, memory_order_relaxed);
+	do {
+		if (old + size > slab_limit || old + size < old)
+			return -1;
+	} while (!atomic_compare_exchange_weak(&slab_reserved, &old, old + size));
+	return 0;
+}
+
+static void slab_uncharge(size_t size)
+{
+	atomic_fetch_sub(&slab_reserved, size);
+}
+
+static void slab_list_del(struct slab_chunk **head, struct slab_chunk *ch)
+{
+	if (ch->prev != NULL)
+		ch->prev->next = ch->next;
+	else
+		*head = ch->next;
+	if (ch->next != NULL)
+		ch->next->prev = ch->prev;
+}
+
+static void slab_list_add(struct slab_chunk **head, struct slab_chunk *ch)
+{
+	ch->prev = NULL;
+	ch->next = *head;
+	if (*head != NULL)
+		(*head)->prev = ch;
+	*head = ch;
+}
+
+/* called with cls->lock held */
+static struct slab_chunk *slab_chunk_new(int c)
+{
+	struct slab_class *cls = &slab_classes[c];
+
+	if (slab_charge(SLAB_CHUNK_SIZE) != 0)
+		return NULL;
+	struct slab_chunk *ch = aligned_alloc(SLAB_CHUNK_SIZE, SLAB_CHUNK_SIZE);
+	if (ch == NULL) {
+		slab_uncharge(SLAB_CHUNK_SIZE);
+		return NULL;
+	}
+	ch->cls = c;
+	ch->inuse = 0;
+	ch->nobjs = (SLAB_CHUNK_SIZE - SLAB_HDR_SIZE) / cls->size;
+	ch->free_objs = NULL;
+	for (unsigned int i = ch->nobjs; i-- > 0;) {
+		void **obj = (void **) ((char *) ch + SLAB_HDR_SIZE + i * cls->size);
+		*obj = ch->free_objs;
+		ch->free_objs = obj;
+	}
+	slab_list_add(&cls->partial, ch);
+	cls->nchunks++;
+	return ch;
+}
+
+static struct slab_magazine *slab_magazine(int c)
+{
+	if (!slab_mags_registered) {
+		pthread_once(&slab_once, slab_setup);
+		pthread_setspecific(slab_mags_key, slab_mags);
+		slab_mags_registered = 1;
+	}
+	return &slab_mags[c];
+}
+
+/* move up to half a magazine of objects from the chunks of class c */
+static unsigned int slab_refill(int c, struct slab_magazine *m)
+{
+	struct slab_class *cls = &slab_classes[c];
+	unsigned int want = (cls->mag_max + 1) / 2;
+
+	pthread_mutex_lock(&cls->lock);
+	while (m->n < want) {
+		struct slab_chunk *ch = cls->partial;
+		if (ch == NULL && (ch = slab_chunk_new(c)) == NULL)
+			break;
+		while (m->n < want && ch->free_objs != NULL) {
+			void **obj = ch->free_objs;
+			ch->free_objs = *obj;
+			ch->inuse++;
+			m->objs[m->n++] = obj;
+		}
+		if (ch->free_objs == NULL) {
+			slab_list_del(&cls->partial, ch);
+			slab_list_add(&cls->full, ch);
+		}
+	}
+	pthread_mutex_unlock(&cls->lock);
+	return m->n;
+}
+
+/* return objects from a magazine to their chunks until keep are left */
+static void slab_drain(int c, struct slab_magazine *m, unsigned int keep)
+{
+	struct slab_class *cls = &slab_classes[c];
+
+	if (m->n <= keep)
+		return;
+	pthread_mutex_lock(&cls->lock);
+	while (m->n > keep) {
+		void **obj = m->objs[--m->n];
+		struct slab_chunk *ch = (struct slab_chunk *) ((uintptr_t) obj & ~(SLAB_CHUNK_SIZE - 1));
+		if (ch->free_objs == NULL) {
+			slab_list_del(&cls->full, ch);
+			slab_list_add(&cls->partial, ch);
+		}
+		*obj = ch->free_objs;
+		ch->free_objs = obj;
+		if (--ch->inuse == 0 && cls->nchunks > 1) {
+			slab_list_del(&cls->partial, ch);
+			cls->nchunks--;
+			free(ch);
+			slab_uncharge(SLAB_CHUNK_SIZE);
+		}
+	}
+	pthread_mutex_unlock(&cls->lock);
+}
+
+/* returns NULL when the memory cap would be exceeded */
+static void *slab_alloc(size_t size)
+{
+	int c = slab_class_of(size);
+
+	if (c < 0) {
+		if (slab_charge(size) != 0)
+			return NULL;
+		void *p = malloc(size);
+		if (p == NULL) {
+			slab_uncharge(size);
+			return NULL;
+		}
+		atomic_fetch_add_explicit(&slab_large_bytes, size, memory_order_relaxed);
+		atomic_fetch_add_explicit(&slab_large_count, 1, memory_order_relaxed);
+		return p;
+	}
+
+	struct slab_magazine *m = slab_magazine(c);
+	if (m->n == 0 && slab_refill(c, m) == 0)
+		return NULL;
+	atomic_fetch_add_explicit(&slab_classes[c].inuse, 1, memory_order_relaxed);
+	return m->objs[--m->n];
+}
+
+static void *slab_zalloc(size_t size)
+{
+	void *p = slab_alloc(size);
+	if (p != NULL)
+		memset(p, 0, size);
+	return p;
+}
+
+/* size must be the size the object was allocated with */
+static void slab_free(void *p, size_t size)
+{
+	if (p == NULL)
+		return;
+	int c = slab_class_of(size);
+	if (c < 0) {
+		free(p);
+		slab_uncharge(size);
+		atomic_fetch_sub_explicit(&slab_large_bytes, size, memory_order_relaxed);
+		atomic_fetch_sub_explicit(&slab_large_count, 1, memory_order_relaxed);
+		return;
+	}
+
+	struct slab_magazine *m = slab_magazine(c);
+	atomic_fetch_sub_explicit(&slab_classes[c].inuse, 1, memory_order_relaxed);
+	if (m->n == slab_classes[c].mag_max)
+		slab_drain(c, m, slab_classes[c].mag_max / 2);
+	m->objs[m->n++] = p;
+}
+
+/* hand everything the calling thread caches back at once, e.g. after a
+   whole subtree has been released */
+static void slab_flush(void)
+{
+	for (int c = 0; c < SLAB_NCLASSES; c++)
+		slab_drain(c, &slab_mags[c], 0);
+}
+
+/* free space as seen by file data: unreserved memory plus free extent slots */
+static void slab_statfs(struct statvfs *st, size_t bsize)
+{
+	struct slab_class *ext = &slab_classes[SLAB_NSMALL];
+	size_t reserved = atomic_load(&slab_reserved);
+	size_t limit = slab_limit;
+	size_t free_bytes = limit > reserved ? limit - reserved : 0;
+
+	pthread_mutex_lock(&ext->lock);
+	size_t slots = ext->nchunks * ((SLAB_CHUNK_SIZE - SLAB_HDR_SIZE) / ext->size);
+	pthread_mutex_unlock(&ext->lock);
+	size_t used = atomic_load(&ext->inuse);
+	if (slots > used)
+		free_bytes += (slots - used) * ext->size;
+
+	memset(st, 0, sizeof(*st));
+	st->f_bsize = bsize;
+	st->f_frsize = bsize;
+	st->f_blocks = limit / bsize;
+	st->f_bfree = st->f_bavail = free_bytes / bsize;
+}
+
+/* one line per size class: bytes handed out, bytes reserved in chunks and
+   how much of the reservation is not used by live objects */
+static int slab_format_stats(char *buf, size_t size)
+{
+	int len = snprintf(buf, size, "memory: limit %zu reserved %zu\n",
+			slab_limit, atomic_load(&slab_reserved));
+
+	for (int c = 0; c < SLAB_NCLASSES; c++) {
+		struct slab_class *cls = &slab_classes[c];
+		pthread_mutex_lock(&cls->lock);
+		size_t reserved = cls->nchunks * SLAB_CHUNK_SIZE;
+		pthread_mutex_unlock(&cls->lock);
+		size_t inuse = atomic_load(&cls->inuse) * cls->size;
+		double frag = reserved ? 100.0 * (reserved - inuse) / reserved : 0.0;
+		len += snprintf(buf ? buf + len : NULL, size > (size_t) len ? size - len : 0,
+				"class %7zu: in_use %zu bytes reserved %zu bytes fragmentation %.1f%%\n",
+				cls->size, inuse, reserved, frag);
+	}
+	len += snprintf(buf ? buf + len : NULL, size > (size_t) len ? size - len : 0,
+			"large: %zu allocations %zu bytes\n",
+			atomic_load(&slab_large_count), atomic_load(&slab_large_bytes));
+	return len;
+}
+
+#endif /* MYFS_SLAB_H */
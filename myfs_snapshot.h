@@ -0,0 +1,372 @@
+/*
+   Copy-on-write snapshots and clones for myfs
+
+   A snapshot does not copy anything: the new entry (/.snapshots/NAME for
+   a read-only snapshot, any path for a writable clone) points to the
+   inode of the source directory or file, which is now shared by two
+   entries (refs in myfs_inode.h). Taking one costs the same for an empty
+   directory and for a tree of a million files.
+
+   Nothing shared is ever changed. A change walks its path with
+   path_private(), which replaces every shared inode on the way by a copy
+   of its own in the parent directory: a directory copy gets new entries
+   pointing to the same children, which become shared in turn, a file
+   copy the same extents through the blocks of myfs_dedup.h, which a
+   write copies one at a time. So a change below a snapshot copies one
+   directory per level and, for a file, only the extents it writes.
+
+   The gate keeps snapshots and changes apart: every change holds it
+   shared from its lookup to its end, taking or deleting a snapshot holds
+   it exclusively, so a snapshot never sees half a change and reference
+   counts only move under it in ways the walk above expects.
+
+   A snapshot of the root is a shallow copy of it, without /.snapshots,
+   and so is a clone of a directory into the tree below it: the entry
+   must not lead back to itself. That costs one entry per name in the
+   directory, not per file.
+
+   .myfs_stats shows how many snapshots there are and how many inodes
+   have been copied on write.
+ */
+
+#ifndef MYFS_SNAPSHOT_H
+#define MYFS_SNAPSHOT_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "myfs_inode.h"
+
+#define SNAPSHOT_DIR ".snapshots" //below the root
+#define SNAPSHOT_INO_BITS 40 //live inode numbers below 2^40 never meet those of snapshot_ino()
+#define SNAPSHOT_CLONE 1 //writable, anywhere, and may replace the destination
+
+static pthread_rwlock_t snapshot_gate;
+
+/* counters, printed in /.myfs_stats */
+static atomic_uint_fast64_t snapshot_taken; //snapshots and clones made
+static atomic_uint_fast64_t snapshot_dir_copies; //shared directories copied by a change
+static atomic_uint_fast64_t snapshot_file_copies; //and files
+
+/* writers first: a stream of changes must not keep a snapshot out forever */
+static void snapshot_init(void)
+{
+	pthread_rwlockattr_t attr;
+
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&snapshot_gate, &attr);
+	pthread_rwlockattr_destroy(&attr);
+}
+
+/* around a change */
+static void snapshot_lock_shared(void)
+{
+	pthread_rwlock_rdlock(&snapshot_gate);
+}
+
+/* around taking or deleting a snapshot */
+static void snapshot_lock(void)
+{
+	pthread_rwlock_wrlock(&snapshot_gate);
+}
+
+static void snapshot_unlock(void)
+{
+	pthread_rwlock_unlock(&snapshot_gate);
+}
+
+/* how deep path is below /.snapshots: 0 outside it, 1 for the directory
+   itself, 2 for a snapshot, more for what is in one */
+static int snapshot_depth(const char *path)
+{
+	int depth = 0;
+
+	while (*path == '/')
+		path++;
+	if (strncmp(path, SNAPSHOT_DIR, strlen(SNAPSHOT_DIR)) != 0)
+		return 0;
+	path += strlen(SNAPSHOT_DIR);
+	if (*path != '/' && *path != '\0')
+		return 0;
+	for (;;) {
+		depth++;
+		while (*path == '/')
+			path++;
+		if (*path == '\0')
+			return depth;
+		path += strcspn(path, "/");
+	}
+}
+
+/* st_ino for path, an object with number ino. Below /.snapshots/NAME
+   the inodes are the live ones, or were until they were copied on
+   write, and keep their numbers, but tools that see the same st_ino
+   under two paths (du, tar, cp -a, find) take them for one file. So
+   each snapshot shows them in a range of its own above the numbers
+   myfs hands out, picked by the hash of its name: stable across
+   restarts, and the same for hard links within one snapshot. */
+static ino_t snapshot_ino(const char *path, ino_t ino)
+{
+	const uint64_t low = (1ULL << SNAPSHOT_INO_BITS) - 1;
+
+	if (snapshot_depth(path) < 2)
+		return ino;
+	while (*path == '/')
+		path++;
+	path += strlen(SNAPSHOT_DIR);
+	while (*path == '/')
+		path++;
+	uint64_t h = name_hash(path, strcspn(path, "/"));
+	return (ino_t) (1ULL << 63 | (h << SNAPSHOT_INO_BITS & ~(1ULL << 63)) | (ino & low));
+}
+
+/* the child name of dir, a private directory, made private in turn if
+   a snapshot shares it */
+static int snapshot_step(struct myfs_inode *dir, const char *name, size_t len, struct myfs_inode **out)
+{
+	struct myfs_inode *child = dir_lookup(dir, name, len);
+	int err = 0;
+
+	if (child == NULL)
+		return -ENOENT;
+	if (!inode_shared(child)) {
+		*out = child;
+		return 0;
+	}
+	dir_lock(dir);
+	child = dir_lookup(dir, name, len);
+	if (child == NULL)
+		err = -ENOENT;
+	else if (inode_shared(child)) { //nobody made it private meanwhile
+		struct myfs_inode *copy = inode_copy(child);
+		if (copy == NULL)
+			err = -ENOSPC;
+		else {
+			atomic_fetch_add_explicit(S_ISDIR(child->mode) ? &snapshot_dir_copies :
+					&snapshot_file_copies, 1, memory_order_relaxed);
+			dir_swap(dir, name, len, copy);
+			child = copy;
+		}
+	}
+	dir_unlock(dir);
+	*out = child;
+	return err;
+}
+
+/* path_lookup() for a change: the inode at path and every directory on
+   the way are private to the live tree. NULL, and the error in *err, if
+   there is none or a copy failed. */
+static struct myfs_inode *path_private(const char *path, int *err)
+{
+	struct myfs_inode *inode = myfs_root;
+
+	for (;;) {
+		while (*path == '/')
+			path++;
+		if (*path == '\0')
+			return inode;
+		if (!S_ISDIR(inode->mode)) {
+			*err = -ENOENT;
+			return NULL;
+		}
+		size_t len = strcspn(path, "/");
+		int res = snapshot_step(inode, path, len, &inode);
+		if (res != 0) {
+			*err = res;
+			return NULL;
+		}
+		path += len;
+	}
+}
+
+/* path_parent() for a change: the directory is private, the entry
+   itself may still be shared */
+static struct myfs_inode *path_private_parent(const char *path, const char **name, size_t *len, int *err)
+{
+	const char *end = path + strlen(path);
+	while (end > path && end[-1] == '/')
+		end--;
+	const char *base = end;
+	while (base > path && base[-1] != '/')
+		base--;
+	if (base == end) {
+		*err = -ENOENT;
+		return NULL; //the root has no parent
+	}
+
+	*name = base;
+	*len = end - base;
+
+	struct myfs_inode *inode = myfs_root;
+	const char *p = path;
+	int res = 0;
+	for (;;) {
+		while (p < base && *p == '/')
+			p++;
+		if (p >= base || !S_ISDIR(inode->mode))
+			break;
+		const char *slash = memchr(p, '/', base - p);
+		if ((res = snapshot_step(inode, p, slash - p, &inode)) != 0)
+			break;
+		p = slash;
+	}
+	if (res == 0 && !S_ISDIR(inode->mode))
+		res = -ENOENT;
+	if (res != 0) {
+		*err = res;
+		return NULL;
+	}
+	return inode;
+}
+
+/* is inode one of the directories path walks through to its last component */
+static int snapshot_on_path(const char *path, const struct myfs_inode *inode)
+{
+	const struct myfs_inode *dir = myfs_root;
+	const char *base = path + strlen(path);
+
+	while (base > path && base[-1] == '/')
+		base--;
+	while (base > path && base[-1] != '/')
+		base--;
+	while (dir != NULL && dir != inode) {
+		while (path < base && *path == '/')
+			path++;
+		if (path >= base)
+			return 0;
+		const char *slash = memchr(path, '/', base - path);
+		dir = dir_lookup(dir, path, slash - path);
+		path = slash;
+	}
+	return dir == inode;
+}
+
+/* the root as it is now, without /.snapshots; with the gate held exclusively */
+static struct myfs_inode *snapshot_copy_root(void)
+{
+	struct myfs_inode *copy = inode_copy(myfs_root);
+	struct myfs_inode *dir;
+
+	if (copy == NULL)
+		return NULL;
+	if ((dir = dir_remove(copy, SNAPSHOT_DIR, strlen(SNAPSHOT_DIR))) != NULL) {
+		inode_put(dir);
+		copy->mtime = myfs_root->mtime; //dir_remove() stamped it
+		copy->ctime = myfs_root->ctime;
+	}
+	return copy;
+}
+
+/* make dst an entry for what src is now. Without SNAPSHOT_CLONE dst must
+   not exist yet; with it an existing dst of the same type is replaced, so
+   cloning again resets a clone. With the gate held exclusively. */
+static int snapshot_take(const char *src, const char *dst, int flags)
+{
+	struct myfs_inode *inode = path_lookup(src), *parent, *old;
+	const char *name;
+	size_t len;
+	int err = 0;
+
+	if (inode == NULL)
+		return -ENOENT;
+	/* copies first: they share what is below them, which the walk to dst
+	   has to see as shared */
+	if (inode == myfs_root)
+		inode = snapshot_copy_root();
+	else if (S_ISDIR(inode->mode) && snapshot_on_path(dst, inode))
+		inode = inode_copy(inode);
+	else
+		__atomic_fetch_add(&inode->refs, 1, __ATOMIC_RELAXED);
+	if (inode == NULL)
+		return -ENOSPC;
+	if ((parent = path_private_parent(dst, &name, &len, &err)) == NULL) {
+		inode_put(inode);
+		return err;
+	}
+
+	dir_lock(parent);
+	old = dir_lookup(parent, name, len);
+	if (old == NULL)
+		err = dir_add(parent, name, len, inode);
+	else if (!(flags & SNAPSHOT_CLONE))
+		err = -EEXIST;
+	else if (S_ISDIR(old->mode) != S_ISDIR(inode->mode))
+		err = S_ISDIR(old->mode) ? -EISDIR : -ENOTDIR;
+	else
+		dir_replace(parent, name, len, inode);
+	dir_unlock(parent);
+	if (err != 0) {
+		inode_put(inode);
+		return err;
+	}
+	if (old != NULL)
+		inode_put(old); //what only the replaced clone used goes away
+	atomic_fetch_add_explicit(&snapshot_taken, 1, memory_order_relaxed);
+	return 0;
+}
+
+/* path is /.snapshots/NAME, which is made on first use */
+static int snapshot_create(const char *src, const char *path)
+{
+	struct myfs_inode *dir = dir_lookup(myfs_root, SNAPSHOT_DIR, strlen(SNAPSHOT_DIR));
+
+	if (dir == NULL) {
+		if ((dir = inode_new(S_IFDIR | 0755)) == NULL)
+			return -ENOSPC;
+		dir_lock(myfs_root);
+		int err = dir_add(myfs_root, SNAPSHOT_DIR, strlen(SNAPSHOT_DIR), dir);
+		dir_unlock(myfs_root);
+		if (err != 0) {
+			inode_free(dir);
+			return err;
+		}
+	}
+	return snapshot_take(src, path, 0);
+}
+
+/* drop /.snapshots/NAME, whatever it holds: rmdir (is_dir) or unlink.
+   What no other entry shares is freed. With the gate held exclusively. */
+static int snapshot_delete(const char *path, int is_dir)
+{
+	const char *name;
+	size_t len;
+	int err = 0;
+	struct myfs_inode *parent = path_private_parent(path, &name, &len, &err), *inode;
+
+	if (parent == NULL)
+		return err;
+	dir_lock(parent);
+	inode = dir_lookup(parent, name, len);
+	if (inode == NULL)
+		err = -ENOENT;
+	else if (S_ISDIR(inode->mode) != is_dir)
+		err = is_dir ? -ENOTDIR : -EISDIR;
+	else
+		dir_remove(parent, name, len);
+	dir_unlock(parent);
+	if (err == 0)
+		inode_put(inode);
+	return err;
+}
+
+/* snprintf() style, for the stats file */
+static int snapshot_format(char *buf, size_t size)
+{
+	struct myfs_inode *dir = dir_lookup(myfs_root, SNAPSHOT_DIR, strlen(SNAPSHOT_DIR));
+	uint_fast64_t taken = atomic_load(&snapshot_taken);
+
+	if (taken == 0 && dir == NULL)
+		return snprintf(buf, size, "%s", "");
+	return snprintf(buf, size, "snapshots: %zu in /" SNAPSHOT_DIR ", %llu taken, copied on write: "
+			"%llu directories %llu files %llu extents\n",
+			dir ? __atomic_load_n(&dir->nentries, __ATOMIC_RELAXED) : 0, (unsigned long long) taken,
+			(unsigned long long) atomic_load(&snapshot_dir_copies),
+			(unsigned long long) atomic_load(&snapshot_file_copies),
+			(unsigned long long) atomic_load(&dedup_snapshot_copies));
+}
+
+#endif /* MYFS_SNAPSHOT_H */
@@ -0,0 +1,223 @@
+/*
+   Request tracing for myfs and my_passthrough
+
+   Instead of printf() from the handlers, every traced request leaves a
+   fixed-size binary record (operation, hash of the path, offset, size,
+   latency, errno) in a ring buffer owned by the thread that served it.
+   The owner is the only writer and a background thread the only reader
+   of each ring, so recording needs no lock and no atomic read-modify-
+   write, only a release store of the head. The background thread formats
+   the records and writes them out in batches. When a ring is full new
+   records are dropped and counted rather than blocking the request.
+
+   The level is 0 (off), 1 (failed requests only) or 2 (all requests). It
+   can be set at startup (--trace=N) and changed at runtime with SIGUSR2,
+   which cycles off -> errors -> all -> off. With tracing off a request
+   pays for one relaxed load.
+ */
+
+#ifndef MYFS_TRACE_H
+#define MYFS_TRACE_H
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_OFF 0
+#define TRACE_ERRORS 1
+#define TRACE_ALL 2
+
+#define TRACE_RING 1024 //records per thread, power of two
+#define TRACE_DRAIN_NS 20000000 //the drain thread wakes up every 20 ms
+
+struct trace_record {
+	uint64_t time; //CLOCK_MONOTONIC ns
+	const char *op; //static string
+	uint64_t path; //FNV-1a of the path
+	int64_t offset;
+	uint64_t size;
+	uint64_t latency; //ns
+	int err; //positive errno, 0 on success
+};
+
+struct trace_ring {
+	struct trace_ring *next;
+	int in_use; //0 once the owner exited; drained, then reused by a new thread
+	_Atomic uint64_t head; //written by the owner
+	_Atomic uint64_t tail; //written by the drain thread
+	_Atomic uint64_t dropped;
+	struct trace_record rec[TRACE_RING];
+};
+
+static _Atomic int trace_level;
+static FILE *trace_out;
+static struct trace_ring *trace_rings;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t trace_key;
+static __thread struct trace_ring *this_ring;
+static uint64_t trace_epoch;
+
+static inline uint64_t trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline int trace_on(int level)
+{
+	return atomic_load_explicit(&trace_level, memory_order_relaxed) >= level;
+}
+
+/* start of a request; 0 if nothing will be recorded */
+static inline uint64_t trace_begin(void)
+{
+	return trace_on(TRACE_ERRORS) ? trace_now() : 0;
+}
+
+static void trace_thread_exit(void *arg)
+{
+	struct trace_ring *r = arg;
+	pthread_mutex_lock(&trace_lock);
+	r->in_use = 0;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static struct trace_ring *trace_register(void)
+{
+	struct trace_ring *r;
+
+	pthread_mutex_lock(&trace_lock);
+	for (r = trace_rings; r != NULL; r = r->next)
+		if (!r->in_use)
+			break;
+	if (r == NULL) {
+		r = calloc(1, sizeof(*r));
+		if (r == NULL) {
+			pthread_mutex_unlock(&trace_lock);
+			return NULL;
+		}
+		r->next = trace_rings;
+		trace_rings = r;
+	}
+	r->in_use = 1;
+	pthread_mutex_unlock(&trace_lock);
+	pthread_setspecific(trace_key, r);
+	return r;
+}
+
+static inline uint64_t trace_hash(const char *path)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (; *path; path++) {
+		h ^= (unsigned char) *path;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/* record the end of a request that started at start (from trace_begin()) and returned res */
+static inline void trace_op(const char *op, const char *path, int64_t offset,
+		uint64_t size, uint64_t start, long res)
+{
+	struct trace_ring *r;
+	struct trace_record *rec;
+	uint64_t head;
+
+	if (start == 0 || !trace_on(res < 0 ? TRACE_ERRORS : TRACE_ALL))
+		return;
+	if (this_ring == NULL && (this_ring = trace_register()) == NULL)
+		return;
+	r = this_ring;
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&r->tail, memory_order_acquire) >= TRACE_RING) {
+		atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed); //rare, races with the drain thread
+		return;
+	}
+	rec = &r->rec[head & (TRACE_RING - 1)];
+	rec->time = trace_now();
+	rec->op = op;
+	rec->path = path ? trace_hash(path) : 0;
+	rec->offset = offset;
+	rec->size = size;
+	rec->latency = rec->time - start;
+	rec->err = res < 0 ? (int) -res : 0;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+/* called with trace_lock held */
+static void trace_drain_ring(struct trace_ring *r)
+{
+	uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+	uint64_t dropped;
+
+	for (; tail != head; tail++) {
+		const struct trace_record *rec = &r->rec[tail & (TRACE_RING - 1)];
+		uint64_t t = rec->time - trace_epoch;
+		fprintf(trace_out, "%llu.%06llu %-12s path=%016llx off=%lld size=%llu lat=%lluns err=%d\n",
+				(unsigned long long) (t / 1000000000), (unsigned long long) (t % 1000000000 / 1000),
+				rec->op, (unsigned long long) rec->path, (long long) rec->offset,
+				(unsigned long long) rec->size, (unsigned long long) rec->latency, rec->err);
+	}
+	atomic_store_explicit(&r->tail, tail, memory_order_release);
+	dropped = atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed);
+	if (dropped != 0)
+		fprintf(trace_out, "trace: %llu records dropped\n", (unsigned long long) dropped);
+}
+
+static void *trace_drain_thread(void *arg)
+{
+	struct timespec ts = { 0, TRACE_DRAIN_NS };
+	(void) arg;
+
+	for (;;) {
+		nanosleep(&ts, NULL);
+		pthread_mutex_lock(&trace_lock);
+		for (struct trace_ring *r = trace_rings; r != NULL; r = r->next)
+			trace_drain_ring(r);
+		pthread_mutex_unlock(&trace_lock);
+		fflush(trace_out);
+	}
+	return NULL;
+}
+
+static void trace_cycle_level(int sig)
+{
+	(void) sig;
+	atomic_store(&trace_level, (atomic_load(&trace_level) + 1) % (TRACE_ALL + 1));
+}
+
+/*
+   Start the drain thread and the SIGUSR2 handler. Records go to out, or
+   stderr if out is NULL. Must run in the process that serves requests,
+   i.e. after fuse_daemonize() forked, so init() is a good place.
+*/
+static int trace_start(int level, FILE *out)
+{
+	struct sigaction sa;
+	pthread_t tid;
+
+	trace_out = out ? out : stderr;
+	trace_epoch = trace_now();
+	if (pthread_key_create(&trace_key, trace_thread_exit) != 0)
+		return -1;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = trace_cycle_level;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGUSR2, &sa, NULL) == -1)
+		return -1;
+	if (pthread_create(&tid, NULL, trace_drain_thread, NULL) != 0)
+		return -1;
+	pthread_detach(tid);
+	atomic_store(&trace_level, level);
+	return 0;
+}
+
+#endif /* MYFS_TRACE_H */